@@ -0,0 +1,325 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "libassoofs.h"
+
+/*
+ * Banco de pruebas de libassoofs: mide sobre una imagen, sin el modulo, la
+ * creacion de ficheros, lookup, readdir y lecturas y escrituras secuenciales
+ * y aleatorias. Para cada fase muestra operaciones por segundo y los
+ * percentiles de latencia, de modo que se puede ejecutar bajo perf o
+ * valgrind y comparar una version con otra. Los desplazamientos aleatorios
+ * salen siempre de la misma semilla para que las ejecuciones se puedan
+ * comparar. Todo se crea en un directorio nuevo dentro de la raiz.
+ */
+
+struct bench_opts {
+    const char *image;
+    unsigned int files;
+    uint64_t file_size;
+    size_t io_size;
+    unsigned int random_ops;
+    unsigned int readdir_passes;
+};
+
+struct bench_lat {
+    uint64_t *ns;
+    size_t n;
+    double elapsed;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static int lat_init(struct bench_lat *lat, size_t n) {
+    lat->ns = calloc(n ? n : 1, sizeof(*lat->ns));
+    lat->n = 0;
+    lat->elapsed = 0;
+    return lat->ns ? 0 : -ENOMEM;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct bench_lat *lat, double p) {
+    size_t i = (size_t)(p * (lat->n - 1) + 0.5);
+
+    return lat->ns[i] / 1e3;
+}
+
+static void report(const char *phase, struct bench_lat *lat, uint64_t bytes) {
+    qsort(lat->ns, lat->n, sizeof(*lat->ns), cmp_u64);
+    printf("%-10s %10zu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", phase, lat->n, lat->n / lat->elapsed,
+           bytes / lat->elapsed / (1024 * 1024), percentile_us(lat, 0.5), percentile_us(lat, 0.9),
+           percentile_us(lat, 0.99), lat->ns[lat->n - 1] / 1e3);
+    free(lat->ns);
+}
+
+static int bench_create(struct assoofs_img *img, struct assoofs_inode_info *dir, const struct bench_opts *opts) {
+    struct assoofs_inode_info info;
+    struct bench_lat lat;
+    char name[32];
+    uint64_t t, start;
+    unsigned int i;
+    int ret;
+
+    if (lat_init(&lat, opts->files))
+        return -ENOMEM;
+    start = now_ns();
+    for (i = 0; i < opts->files; i++) {
+        snprintf(name, sizeof(name), "file-%u", i);
+        t = now_ns();
+        ret = assoofs_img_create(img, dir, name, S_IFREG | 0644, 0, 0, &info);
+        lat.ns[lat.n++] = now_ns() - t;
+        if (ret) {
+            fprintf(stderr, "Error creating %s: %s\n", name, strerror(-ret));
+            free(lat.ns);
+            return ret;
+        }
+    }
+    lat.elapsed = (now_ns() - start) / 1e9;
+    report("create", &lat, 0);
+    return 0;
+}
+
+static int bench_lookup(struct assoofs_img *img, const struct assoofs_inode_info *dir, const struct bench_opts *opts) {
+    struct bench_lat lat;
+    char name[32];
+    uint64_t t, start, ino, seed = 1;
+    unsigned int i;
+    int ret;
+
+    if (lat_init(&lat, opts->files))
+        return -ENOMEM;
+    //En orden aleatorio, para no recorrer las hojas una detras de otra
+    start = now_ns();
+    for (i = 0; i < opts->files; i++) {
+        snprintf(name, sizeof(name), "file-%u", (unsigned int)(xorshift64(&seed) % opts->files));
+        t = now_ns();
+        ret = assoofs_img_lookup(img, dir, name, &ino);
+        lat.ns[lat.n++] = now_ns() - t;
+        if (ret) {
+            fprintf(stderr, "Error looking up %s: %s\n", name, strerror(-ret));
+            free(lat.ns);
+            return ret;
+        }
+    }
+    lat.elapsed = (now_ns() - start) / 1e9;
+    report("lookup", &lat, 0);
+    return 0;
+}
+
+static int count_entry(void *arg, const char *name, unsigned int len, uint64_t inode_no, uint8_t file_type,
+                       uint64_t next) {
+    (*(unsigned long *)arg)++;
+    return 0;
+}
+
+static int bench_readdir(struct assoofs_img *img, const struct assoofs_inode_info *dir, const struct bench_opts *opts) {
+    struct bench_lat lat;
+    unsigned long entries;
+    uint64_t t, start, pos;
+    unsigned int i;
+    int ret;
+
+    if (lat_init(&lat, opts->readdir_passes))
+        return -ENOMEM;
+    start = now_ns();
+    for (i = 0; i < opts->readdir_passes; i++) {
+        entries = 0;
+        pos = 0;
+        t = now_ns();
+        ret = assoofs_img_readdir(img, dir, &pos, count_entry, &entries);
+        lat.ns[lat.n++] = now_ns() - t;
+        if (ret || entries != opts->files) {
+            fprintf(stderr, "Error reading the directory: %s (%lu entries)\n", strerror(ret ? -ret : EIO), entries);
+            free(lat.ns);
+            return ret ? ret : -EIO;
+        }
+    }
+    lat.elapsed = (now_ns() - start) / 1e9;
+    report("readdir", &lat, 0);
+    return 0;
+}
+
+/*
+ * Lee o escribe el fichero entero por trozos de io_size o, si random, hace
+ * random_ops operaciones de un bloque en posiciones aleatorias
+ */
+static int bench_io(struct assoofs_img *img, struct assoofs_inode_info *info, const struct bench_opts *opts,
+                    const char *phase, int write, int random) {
+    struct bench_lat lat;
+    uint64_t t, start, off, seed = 1, bytes = 0;
+    size_t len = random ? ASSOOFS_DEFAULT_BLOCK_SIZE : opts->io_size;
+    size_t nops = random ? opts->random_ops : (opts->file_size + len - 1) / len;
+    ssize_t ret;
+    size_t i;
+    char *buf;
+
+    buf = malloc(len);
+    if (!buf || lat_init(&lat, nops)) {
+        free(buf);
+        return -ENOMEM;
+    }
+    memset(buf, 'a', len);
+
+    start = now_ns();
+    for (i = 0; i < nops; i++) {
+        if (random)
+            off = xorshift64(&seed) % (opts->file_size / len) * len;
+        else
+            off = i * len;
+        if (off + len > opts->file_size)
+            len = opts->file_size - off;
+        t = now_ns();
+        if (write)
+            ret = assoofs_img_write(img, info, buf, len, off);
+        else
+            ret = assoofs_img_read(img, info, buf, len, off);
+        lat.ns[lat.n++] = now_ns() - t;
+        if (ret != (ssize_t)len) {
+            fprintf(stderr, "Error in %s at offset %llu: %s\n", phase, (unsigned long long)off,
+                    ret < 0 ? strerror(-ret) : "short transfer");
+            free(lat.ns);
+            free(buf);
+            return ret < 0 ? ret : -EIO;
+        }
+        bytes += len;
+    }
+    lat.elapsed = (now_ns() - start) / 1e9;
+    report(phase, &lat, bytes);
+    free(buf);
+    return 0;
+}
+
+//Admite los sufijos k, m y g
+static uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t n = strtoull(arg, &end, 0);
+
+    switch (*end) {
+    case 'g': case 'G':
+        n <<= 10;
+        /* fallthrough */
+    case 'm': case 'M':
+        n <<= 10;
+        /* fallthrough */
+    case 'k': case 'K':
+        n <<= 10;
+    }
+    return n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n files] [-s file_size] [-b io_size] [-i random_ops] [-r readdir_passes] <image>\n", prog);
+    fprintf(stderr, "  -n  files created, looked up and listed (default: 10000)\n");
+    fprintf(stderr, "  -s  size of the file for the read/write phases (default: 16 MiB)\n");
+    fprintf(stderr, "  -b  request size of the sequential phases (default: 65536)\n");
+    fprintf(stderr, "  -i  operations of the random phases, one block each (default: 10000)\n");
+    fprintf(stderr, "  -r  full passes of the readdir phase (default: 10)\n");
+    fprintf(stderr, "The image is modified: run it on a scratch image made with mkassoofs.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_opts opts;
+    struct assoofs_img img;
+    struct assoofs_inode_info root, dir, data;
+    char name[32];
+    int opt, ret;
+
+    opts.files = 10000;
+    opts.file_size = 16 << 20;
+    opts.io_size = 65536;
+    opts.random_ops = 10000;
+    opts.readdir_passes = 10;
+
+    while ((opt = getopt(argc, argv, "n:s:b:i:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.files = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            opts.file_size = parse_size(optarg);
+            break;
+        case 'b':
+            opts.io_size = parse_size(optarg);
+            break;
+        case 'i':
+            opts.random_ops = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            opts.readdir_passes = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !opts.files || opts.file_size < ASSOOFS_DEFAULT_BLOCK_SIZE || !opts.io_size ||
+        !opts.random_ops || !opts.readdir_passes)
+        usage(argv[0]);
+    opts.image = argv[optind];
+
+    ret = assoofs_img_open(&img, opts.image, 0);
+    if (ret) {
+        fprintf(stderr, "Error opening %s: %s\n", opts.image, strerror(-ret));
+        return 1;
+    }
+
+    //Cada ejecucion usa su propio directorio para poder repetirla sobre la misma imagen
+    snprintf(name, sizeof(name), "bench-%ld", (long)getpid());
+    ret = assoofs_img_read_inode(&img, ASSOOFS_ROOTDIR_INODE_NUMBER, &root);
+    if (!ret)
+        ret = assoofs_img_create(&img, &root, name, S_IFDIR | 0755, 0, 0, &dir);
+    if (ret) {
+        fprintf(stderr, "Error creating /%s: %s\n", name, strerror(-ret));
+        assoofs_img_close(&img);
+        return 1;
+    }
+
+    printf("%-10s %10s %12s %9s %9s %9s %9s %9s\n", "phase", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us",
+           "max us");
+    ret = bench_create(&img, &dir, &opts);
+    if (!ret)
+        ret = bench_lookup(&img, &dir, &opts);
+    if (!ret)
+        ret = bench_readdir(&img, &dir, &opts);
+    //El fichero de datos se crea despues para que readdir vea solo los de la fase create
+    if (!ret)
+        ret = assoofs_img_create(&img, &root, "bench-data", S_IFREG | 0644, 0, 0, &data);
+    if (ret == -EEXIST && !assoofs_img_resolve(&img, "/bench-data", &data.inode_no))
+        ret = assoofs_img_read_inode(&img, data.inode_no, &data);
+    if (!ret)
+        ret = bench_io(&img, &data, &opts, "seqwrite", 1, 0);
+    if (!ret)
+        ret = bench_io(&img, &data, &opts, "seqread", 0, 0);
+    if (!ret)
+        ret = bench_io(&img, &data, &opts, "randwrite", 1, 1);
+    if (!ret)
+        ret = bench_io(&img, &data, &opts, "randread", 0, 1);
+
+    if (assoofs_img_close(&img) && !ret) {
+        fprintf(stderr, "Error writing back %s\n", opts.image);
+        return 1;
+    }
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,833 @@
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "libassoofs.h"
+
+/*
+ * Sirve una imagen de assoofs por FUSE, sin el modulo, con libassoofs y las
+ * estructuras de assoofs.h. Usa el bucle multihilo de libfuse y la API de
+ * bajo nivel, asi que los numeros de nodo de FUSE son directamente los
+ * numeros de inodo de assoofs (la raiz es el 1 en los dos).
+ *
+ * Las lecturas de bloques se contestan con descriptores de la imagen para
+ * que libfuse los pase con splice al dispositivo de FUSE sin copiarlos, y
+ * las escrituras que llegan en una tuberia se llevan con splice a los
+ * bloques que asigna assoofs_img_write_begin. Solo se journalizan los
+ * metadatos, asi que los bloques de datos que se leen del descriptor son los
+ * buenos aunque la imagen se abra en solo lectura con el journal por aplicar.
+ *
+ * Los inodos que conoce el kernel se guardan decodificados en una tabla hash
+ * hasta que llega su forget, y los nombres ya resueltos en una cache de
+ * entradas de tamaño fijo, de modo que lookup y getattr no vuelven a la
+ * imagen. Como este proceso es el unico que escribe en la imagen, el kernel
+ * puede guardar atributos, entradas y paginas mucho tiempo.
+ *
+ * lock protege la imagen y el contenido de los inodos en cache: se coge
+ * para leer en las operaciones que solo leen y para escribir en las que
+ * modifican. cache_lock protege las listas de la tabla de inodos, los
+ * contadores de lookup y la cache de entradas.
+ */
+#define ASSOOFS_FUSE_ICACHE_BUCKETS 65536
+#define ASSOOFS_FUSE_DCACHE_SLOTS 16384
+#define ASSOOFS_FUSE_TIMEOUT 60.0
+#define ASSOOFS_FUSE_ZERO_SIZE (1 << 20)
+
+struct fs_inode {
+    struct fs_inode *next;
+    uint64_t nlookup;
+    struct assoofs_inode_info info;
+};
+
+struct fs_dentry {
+    uint64_t parent;
+    uint64_t ino;
+    unsigned int len;
+    char name[ASSOOFS_FILENAME_MAXLEN];
+};
+
+struct fs {
+    struct assoofs_img img;
+    pthread_rwlock_t lock;
+    pthread_mutex_t cache_lock;
+    struct fs_inode **icache;
+    struct fs_dentry *dcache;
+    char *zero;
+    int splice;
+};
+
+struct fs_opts {
+    char *image;
+    int ro;
+    int nosplice;
+};
+
+/*
+ *  Caches de inodos y de entradas
+ */
+
+/**
+ * Devuelve el inodo de la cache, leyendolo de la imagen si no esta. Se
+ * llama con lock cogido.
+ * @param fs sistema de ficheros
+ * @param ino numero de inodo
+ * @param ref lookups que se suman al inodo, 1 si se le pasa al kernel
+ * @param err 0 o el error
+ * @return inodo o NULL si hay un error
+ */
+static struct fs_inode *fs_iget(struct fs *fs, uint64_t ino, int ref, int *err) {
+    struct fs_inode **bucket = &fs->icache[ino & (ASSOOFS_FUSE_ICACHE_BUCKETS - 1)];
+    struct fs_inode *node, *new;
+
+    *err = 0;
+    pthread_mutex_lock(&fs->cache_lock);
+    for (node = *bucket; node; node = node->next) {
+        if (node->info.inode_no == ino)
+            goto found;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+
+    new = calloc(1, sizeof(*new));
+    if (!new) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    *err = assoofs_img_read_inode(&fs->img, ino, &new->info);
+    if (*err) {
+        free(new);
+        return NULL;
+    }
+
+    //Otro hilo con lock para leer puede haberlo metido mientras tanto
+    pthread_mutex_lock(&fs->cache_lock);
+    for (node = *bucket; node; node = node->next) {
+        if (node->info.inode_no == ino)
+            break;
+    }
+    if (node) {
+        free(new);
+    } else {
+        new->next = *bucket;
+        *bucket = new;
+        node = new;
+    }
+found:
+    node->nlookup += ref;
+    pthread_mutex_unlock(&fs->cache_lock);
+    return node;
+}
+
+/**
+ * Resta lookups a un inodo y lo saca de la cache cuando el kernel ya no lo
+ * tiene. Se llama con lock cogido para escribir, asi que nadie lo esta usando.
+ */
+static void fs_iput(struct fs *fs, uint64_t ino, uint64_t nlookup) {
+    struct fs_inode **pp = &fs->icache[ino & (ASSOOFS_FUSE_ICACHE_BUCKETS - 1)];
+    struct fs_inode *node;
+
+    pthread_mutex_lock(&fs->cache_lock);
+    for (; (node = *pp); pp = &node->next) {
+        if (node->info.inode_no != ino)
+            continue;
+        node->nlookup -= nlookup < node->nlookup ? nlookup : node->nlookup;
+        if (!node->nlookup) {
+            *pp = node->next;
+            free(node);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+static struct fs_dentry *fs_dslot(struct fs *fs, uint64_t parent, const char *name, unsigned int len) {
+    uint32_t hash = assoofs_name_hash(name, len) ^ (uint32_t)(parent * 2654435761u);
+
+    return &fs->dcache[hash & (ASSOOFS_FUSE_DCACHE_SLOTS - 1)];
+}
+
+/**
+ * Busca un nombre en la cache de entradas
+ * @return 0 si esta o -ENOENT si no
+ */
+static int fs_dcache_lookup(struct fs *fs, uint64_t parent, const char *name, uint64_t *ino) {
+    unsigned int len = strlen(name);
+    struct fs_dentry *d = fs_dslot(fs, parent, name, len);
+    int ret = -ENOENT;
+
+    pthread_mutex_lock(&fs->cache_lock);
+    if (d->ino && d->parent == parent && d->len == len && !memcmp(d->name, name, len)) {
+        *ino = d->ino;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+    return ret;
+}
+
+//Cada nombre tiene una sola posicion en la cache y sustituye a lo que hubiera
+static void fs_dcache_add(struct fs *fs, uint64_t parent, const char *name, uint64_t ino) {
+    unsigned int len = strlen(name);
+    struct fs_dentry *d = fs_dslot(fs, parent, name, len);
+
+    if (len > ASSOOFS_FILENAME_MAXLEN)
+        return;
+    pthread_mutex_lock(&fs->cache_lock);
+    d->parent = parent;
+    d->ino = ino;
+    d->len = len;
+    memcpy(d->name, name, len);
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+/*
+ *  Atributos
+ */
+
+static void fs_now(struct assoofs_time *t) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t->sec = ts.tv_sec;
+    t->nsec = ts.tv_nsec;
+}
+
+static void fs_fill_stat(const struct fs *fs, const struct assoofs_inode_info *info, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = info->inode_no;
+    st->st_mode = info->mode;
+    st->st_nlink = info->links_count;
+    st->st_uid = info->uid;
+    st->st_gid = info->gid;
+    st->st_size = info->file_size;
+    st->st_blksize = fs->img.block_size;
+    //Los datos dentro del inodo no ocupan bloques
+    if (!(info->flags & ASSOOFS_INODE_INLINE_DATA))
+        st->st_blocks = (info->file_size + fs->img.block_size - 1) / fs->img.block_size * (fs->img.block_size / 512);
+    st->st_atim.tv_sec = info->atime.sec;
+    st->st_atim.tv_nsec = info->atime.nsec;
+    st->st_mtim.tv_sec = info->mtime.sec;
+    st->st_mtim.tv_nsec = info->mtime.nsec;
+    st->st_ctim.tv_sec = info->ctime.sec;
+    st->st_ctim.tv_nsec = info->ctime.nsec;
+}
+
+static void fs_fill_entry(const struct fs *fs, const struct fs_inode *node, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(*e));
+    e->ino = node->info.inode_no;
+    e->attr_timeout = ASSOOFS_FUSE_TIMEOUT;
+    e->entry_timeout = ASSOOFS_FUSE_TIMEOUT;
+    fs_fill_stat(fs, &node->info, &e->attr);
+}
+
+/*
+ *  Operaciones
+ */
+
+static void fs_init(void *userdata, struct fuse_conn_info *conn) {
+    struct fs *fs = userdata;
+
+    if (fs->splice)
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    else
+        conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+}
+
+static void fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct fuse_entry_param e;
+    struct fs_inode *dir, *node = NULL;
+    uint64_t ino;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    dir = fs_iget(fs, parent, 0, &ret);
+    if (dir && fs_dcache_lookup(fs, parent, name, &ino)) {
+        ret = assoofs_img_lookup(&fs->img, &dir->info, name, &ino);
+        if (!ret)
+            fs_dcache_add(fs, parent, name, ino);
+    }
+    if (!ret)
+        node = fs_iget(fs, ino, 1, &ret);
+    if (node)
+        fs_fill_entry(fs, node, &e);
+    pthread_rwlock_unlock(&fs->lock);
+
+    //Los nombres que no existen tambien se quedan en la cache del kernel
+    if (ret == -ENOENT) {
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = ASSOOFS_FUSE_TIMEOUT;
+        ret = 0;
+    }
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void fs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    struct fs *fs = fuse_req_userdata(req);
+
+    pthread_rwlock_wrlock(&fs->lock);
+    fs_iput(fs, ino, nlookup);
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_none(req);
+}
+
+static void fs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    struct fs *fs = fuse_req_userdata(req);
+    size_t i;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    for (i = 0; i < count; i++)
+        fs_iput(fs, forgets[i].ino, forgets[i].nlookup);
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_none(req);
+}
+
+static void fs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct fs_inode *node;
+    struct stat st;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    node = fs_iget(fs, ino, 0, &ret);
+    if (node)
+        fs_fill_stat(fs, &node->info, &st);
+    pthread_rwlock_unlock(&fs->lock);
+
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_attr(req, &st, ASSOOFS_FUSE_TIMEOUT);
+}
+
+static void fs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct assoofs_inode_info *info;
+    struct fs_inode *node;
+    struct assoofs_time now;
+    struct stat st;
+    int ret;
+
+    fs_now(&now);
+    pthread_rwlock_wrlock(&fs->lock);
+    node = fs_iget(fs, ino, 0, &ret);
+    if (!node)
+        goto out;
+    info = &node->info;
+    if (fs->img.flags & ASSOOFS_IMG_RDONLY) {
+        ret = -EROFS;
+        goto out;
+    }
+    //El tamaño primero, que es lo unico que puede fallar
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        ret = assoofs_img_truncate(&fs->img, info, attr->st_size);
+        if (ret)
+            goto out;
+    }
+    if (to_set & FUSE_SET_ATTR_MODE)
+        info->mode = (info->mode & S_IFMT) | (attr->st_mode & 07777);
+    if (to_set & FUSE_SET_ATTR_UID)
+        info->uid = attr->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID)
+        info->gid = attr->st_gid;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+        info->atime = now;
+    } else if (to_set & FUSE_SET_ATTR_ATIME) {
+        info->atime.sec = attr->st_atim.tv_sec;
+        info->atime.nsec = attr->st_atim.tv_nsec;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+        info->mtime = now;
+    } else if (to_set & FUSE_SET_ATTR_MTIME) {
+        info->mtime.sec = attr->st_mtim.tv_sec;
+        info->mtime.nsec = attr->st_mtim.tv_nsec;
+    }
+    if (to_set & FUSE_SET_ATTR_CTIME) {
+        info->ctime.sec = attr->st_ctim.tv_sec;
+        info->ctime.nsec = attr->st_ctim.tv_nsec;
+    } else {
+        info->ctime = now;
+    }
+    ret = assoofs_img_write_inode(&fs->img, info);
+    fs_fill_stat(fs, info, &st);
+out:
+    pthread_rwlock_unlock(&fs->lock);
+
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_attr(req, &st, ASSOOFS_FUSE_TIMEOUT);
+}
+
+/**
+ * Crea un fichero o un directorio y se lo pasa al kernel con un lookup
+ */
+static int fs_mknode(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_entry_param *e) {
+    struct fs *fs = fuse_req_userdata(req);
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct assoofs_inode_info info;
+    struct fs_inode *dir, *node = NULL;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    dir = fs_iget(fs, parent, 0, &ret);
+    if (dir)
+        ret = assoofs_img_create(&fs->img, &dir->info, name, mode, ctx->uid, ctx->gid, &info);
+    if (!ret) {
+        fs_dcache_add(fs, parent, name, info.inode_no);
+        node = fs_iget(fs, info.inode_no, 1, &ret);
+    }
+    if (node)
+        fs_fill_entry(fs, node, e);
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+static void fs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct fuse_entry_param e;
+    int ret;
+
+    ret = fs_mknode(req, parent, name, S_IFDIR | (mode & 07777), &e);
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void fs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
+    int ret;
+
+    if (!S_ISREG(mode)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    ret = fs_mknode(req, parent, name, mode, &e);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fi->keep_cache = 1;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void fs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct fs_inode *node;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    node = fs_iget(fs, ino, 0, &ret);
+    if (node && S_ISDIR(node->info.mode))
+        ret = -EISDIR;
+    pthread_rwlock_unlock(&fs->lock);
+    if (!ret && (fi->flags & O_ACCMODE) != O_RDONLY && (fs->img.flags & ASSOOFS_IMG_RDONLY))
+        ret = -EROFS;
+
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    //Nadie mas escribe en la imagen, asi que las paginas del kernel siguen valiendo
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * Contesta una lectura con un fuse_buf por cada racha de bloques seguidos,
+ * que apunta al descriptor de la imagen para que libfuse use splice, y con
+ * memoria a cero para los huecos
+ */
+static void fs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct assoofs_img *img = &fs->img;
+    struct fuse_bufvec *bufv = NULL;
+    struct fs_inode *node;
+    uint64_t end, pos, pblock, count, boff;
+    size_t n, max_bufs;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    node = fs_iget(fs, ino, 0, &ret);
+    if (!node)
+        goto out;
+    if ((uint64_t)off >= node->info.file_size) {
+        fuse_reply_buf(req, NULL, 0);
+        goto out;
+    }
+    end = off + size > node->info.file_size ? node->info.file_size : off + size;
+    if (node->info.flags & ASSOOFS_INODE_INLINE_DATA) {
+        fuse_reply_buf(req, node->info.inline_data + off, end - off);
+        goto out;
+    }
+
+    //Como mucho una racha por bloque y un trozo de ceros por cada ASSOOFS_FUSE_ZERO_SIZE
+    max_bufs = (end - off) / img->block_size + (end - off) / ASSOOFS_FUSE_ZERO_SIZE + 3;
+    bufv = calloc(1, sizeof(*bufv) + max_bufs * sizeof(struct fuse_buf));
+    if (!bufv) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (pos = off; pos < end; pos += n) {
+        boff = pos & (img->block_size - 1);
+        ret = assoofs_img_map_blocks(img, &node->info, pos >> img->blocksize_bits,
+                                     ((end - pos + boff - 1) >> img->blocksize_bits) + 1, &pblock, &count);
+        n = (count << img->blocksize_bits) - boff;
+        if (n > end - pos)
+            n = end - pos;
+        if (ret == -ENOENT) {
+            if (n > ASSOOFS_FUSE_ZERO_SIZE)
+                n = ASSOOFS_FUSE_ZERO_SIZE;
+            bufv->buf[bufv->count].mem = fs->zero;
+        } else {
+            bufv->buf[bufv->count].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            bufv->buf[bufv->count].fd = img->fd;
+            bufv->buf[bufv->count].pos = (pblock << img->blocksize_bits) + boff;
+        }
+        bufv->buf[bufv->count].size = n;
+        bufv->count++;
+    }
+    ret = 0;
+    //Dentro del cerrojo, para que nadie cambie los bloques mientras se copian
+    fuse_reply_data(req, bufv, fs->splice ? FUSE_BUF_SPLICE_MOVE : FUSE_BUF_NO_SPLICE);
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    free(bufv);
+    if (ret)
+        fuse_reply_err(req, -ret);
+}
+
+/**
+ * Escribe lo que llega de FUSE. Si viene en una tuberia se pasa con splice a
+ * los bloques de la imagen; los ficheros que siguen dentro del inodo se
+ * escriben desde memoria.
+ */
+static void fs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in, off_t off, struct fuse_file_info *fi) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(0);
+    size_t len = fuse_buf_size(in), done = 0;
+    struct assoofs_inode_info *info;
+    struct fs_inode *node;
+    ssize_t n = 0;
+    uint64_t addr;
+    char *tmp;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    node = fs_iget(fs, ino, 0, &ret);
+    if (!node)
+        goto out;
+    info = &node->info;
+
+    if ((info->flags & ASSOOFS_INODE_INLINE_DATA) && off + len <= ASSOOFS_INLINE_DATA_MAX) {
+        tmp = malloc(len);
+        if (!tmp) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        dst.buf[0].mem = tmp;
+        dst.buf[0].size = len;
+        n = fuse_buf_copy(&dst, in, 0);
+        if (n > 0)
+            n = assoofs_img_write(&fs->img, info, tmp, n, off);
+        free(tmp);
+        if (n < 0)
+            ret = n;
+        else
+            done = n;
+        goto out;
+    }
+
+    while (done < len) {
+        n = assoofs_img_write_begin(&fs->img, info, off + done, len - done, &addr);
+        if (n < 0)
+            break;
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+        dst.buf[0].fd = fs->img.fd;
+        dst.buf[0].pos = addr;
+        dst.buf[0].size = n;
+        dst.idx = dst.off = 0;
+        //fuse_buf_copy avanza in, asi que cada racha sigue donde acabo la anterior
+        n = fuse_buf_copy(&dst, in, fs->splice ? 0 : FUSE_BUF_NO_SPLICE);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done)
+        assoofs_img_write_end(&fs->img, info, off, done);
+    else
+        ret = n < 0 ? n : -EIO;
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_write(req, done);
+}
+
+struct fs_readdir_ctx {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+};
+
+static int fs_add_direntry(struct fs_readdir_ctx *ctx, const char *name, uint64_t ino, mode_t mode, uint64_t next) {
+    struct stat st;
+    size_t n;
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = ino;
+    st.st_mode = mode;
+    n = fuse_add_direntry(ctx->req, ctx->buf + ctx->used, ctx->size - ctx->used, name, &st, next);
+    if (n > ctx->size - ctx->used)
+        return 1;
+    ctx->used += n;
+    return 0;
+}
+
+static int fs_filldir(void *arg, const char *name, unsigned int len, uint64_t inode_no, uint8_t file_type,
+                      uint64_t next) {
+    char buf[ASSOOFS_FILENAME_MAXLEN + 1];
+
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    return fs_add_direntry(arg, buf, inode_no, file_type == ASSOOFS_FT_DIR ? S_IFDIR : S_IFREG, next);
+}
+
+/*
+ * Las posiciones son las de assoofs_img_readdir, que deja libres las dos
+ * primeras para '.' y '..'
+ */
+static void fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct fs_readdir_ctx ctx = { .req = req, .size = size };
+    struct fs_inode *dir;
+    uint64_t pos = off;
+    int ret;
+
+    ctx.buf = malloc(size);
+    if (!ctx.buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&fs->lock);
+    dir = fs_iget(fs, ino, 0, &ret);
+    if (!dir)
+        goto out;
+    if (pos == 0 && fs_add_direntry(&ctx, ".", ino, S_IFDIR, 1))
+        goto out;
+    if (pos <= 1 && fs_add_direntry(&ctx, "..", ino, S_IFDIR, 2))
+        goto out;
+    ret = assoofs_img_readdir(&fs->img, &dir->info, &pos, fs_filldir, &ctx);
+out:
+    pthread_rwlock_unlock(&fs->lock);
+
+    if (ret)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_buf(req, ctx.buf, ctx.used);
+    free(ctx.buf);
+}
+
+static void fs_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct fs *fs = fuse_req_userdata(req);
+    struct statvfs st;
+
+    memset(&st, 0, sizeof(st));
+    pthread_rwlock_rdlock(&fs->lock);
+    st.f_bsize = fs->img.block_size;
+    st.f_frsize = fs->img.block_size;
+    st.f_blocks = fs->img.sb->blocks_count;
+    st.f_bfree = st.f_bavail = fs->img.block_bitmap.free;
+    st.f_files = fs->img.sb->inodes_total;
+    st.f_ffree = st.f_favail = fs->img.inode_bitmap.free;
+    st.f_namemax = ASSOOFS_FILENAME_MAXLEN;
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_statfs(req, &st);
+}
+
+static void fs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    struct fs *fs = fuse_req_userdata(req);
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    ret = assoofs_img_sync(&fs->img);
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_err(req, -ret);
+}
+
+static const struct fuse_lowlevel_ops fs_ops = {
+    .init = fs_init,
+    .lookup = fs_lookup,
+    .forget = fs_forget,
+    .forget_multi = fs_forget_multi,
+    .getattr = fs_getattr,
+    .setattr = fs_setattr,
+    .mkdir = fs_mkdir,
+    .create = fs_create,
+    .open = fs_open,
+    .read = fs_read,
+    .write_buf = fs_write_buf,
+    .fsync = fs_fsync,
+    .readdir = fs_readdir,
+    .fsyncdir = fs_fsync,
+    .statfs = fs_statfs,
+};
+
+/*
+ *  Arranque
+ */
+
+static int fs_open_image(struct fs *fs, const struct fs_opts *opts) {
+    struct fs_inode *root;
+    int ret;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->splice = !opts->nosplice;
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    fs->icache = calloc(ASSOOFS_FUSE_ICACHE_BUCKETS, sizeof(*fs->icache));
+    fs->dcache = calloc(ASSOOFS_FUSE_DCACHE_SLOTS, sizeof(*fs->dcache));
+    fs->zero = calloc(1, ASSOOFS_FUSE_ZERO_SIZE);
+    if (!fs->icache || !fs->dcache || !fs->zero)
+        return -ENOMEM;
+
+    ret = assoofs_img_open(&fs->img, opts->image, opts->ro ? ASSOOFS_IMG_RDONLY : 0);
+    if (ret)
+        return ret;
+    //La raiz no recibe lookup ni forget, se queda siempre en la cache
+    root = fs_iget(fs, ASSOOFS_ROOTDIR_INODE_NUMBER, 1, &ret);
+    if (!ret && !S_ISDIR(root->info.mode))
+        ret = -ENOTDIR;
+    if (ret)
+        assoofs_img_close(&fs->img);
+    return ret;
+}
+
+static void fs_close_image(struct fs *fs) {
+    struct fs_inode *node, *next;
+    size_t i;
+
+    assoofs_img_close(&fs->img);
+    for (i = 0; i < ASSOOFS_FUSE_ICACHE_BUCKETS; i++) {
+        for (node = fs->icache[i]; node; node = next) {
+            next = node->next;
+            free(node);
+        }
+    }
+    free(fs->icache);
+    free(fs->dcache);
+    free(fs->zero);
+}
+
+#define FS_OPT(t, p) { t, offsetof(struct fs_opts, p), 1 }
+
+static const struct fuse_opt fs_opt_spec[] = {
+    FS_OPT("nosplice", nosplice),
+    FUSE_OPT_END
+};
+
+//El primer argumento que no es una opcion es la imagen y el segundo el punto de montaje
+static int fs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    struct fs_opts *opts = data;
+
+    if (key == FUSE_OPT_KEY_NONOPT && !opts->image) {
+        opts->image = strdup(arg);
+        return 0;
+    }
+    //ro se deja tambien para el montaje
+    if (key == FUSE_OPT_KEY_OPT && !strcmp(arg, "ro"))
+        opts->ro = 1;
+    return 1;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options] <image> <mountpoint>\n", prog);
+    printf("    -o nosplice            copy data through memory instead of splice\n");
+    printf("    -o ro                  mount read-only and never write the image\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts cmd;
+    struct fuse_loop_config config;
+    struct fuse_session *se;
+    struct fs_opts opts;
+    static struct fs fs;
+    int ret = 1, err;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&cmd, 0, sizeof(cmd));
+    if (fuse_opt_parse(&args, &opts, fs_opt_spec, fs_opt_proc) == -1)
+        return 1;
+    if (fuse_parse_cmdline(&args, &cmd) != 0)
+        goto out_args;
+    if (cmd.show_help) {
+        usage(argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto out_args;
+    }
+    if (cmd.show_version) {
+        fuse_lowlevel_version();
+        ret = 0;
+        goto out_args;
+    }
+    if (!opts.image || !cmd.mountpoint) {
+        usage(argv[0]);
+        goto out_args;
+    }
+
+    err = fs_open_image(&fs, &opts);
+    if (err) {
+        fprintf(stderr, "Error opening %s: %s\n", opts.image, strerror(-err));
+        goto out_args;
+    }
+
+    se = fuse_session_new(&args, &fs_ops, sizeof(fs_ops), &fs);
+    if (!se)
+        goto out_image;
+    if (fuse_set_signal_handlers(se) != 0)
+        goto out_session;
+    if (fuse_session_mount(se, cmd.mountpoint) != 0)
+        goto out_signals;
+
+    fuse_daemonize(cmd.foreground);
+    if (cmd.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        config.clone_fd = cmd.clone_fd;
+        config.max_idle_threads = cmd.max_idle_threads;
+        ret = fuse_session_loop_mt(se, &config);
+    }
+    ret = ret ? 1 : 0;
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_session:
+    fuse_session_destroy(se);
+out_image:
+    fs_close_image(&fs);
+out_args:
+    free(cmd.mountpoint);
+    free(opts.image);
+    fuse_opt_free_args(&args);
+    return ret;
+}
@@ -0,0 +1,621 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+
+/*
+ * Prueba de carga de assoofs: N hilos crean cada uno ficheros en su propio
+ * directorio y escriben en ellos. Se repite con 1, 2, 4... hilos hasta el
+ * maximo pedido para ver como escala la creacion de ficheros con el numero
+ * de hilos.
+ * Con -r mide en cambio readdir + stat de todas las entradas de un
+ * directorio con -n ficheros, primero con la cache vacia y despues llena.
+ * Con -d lee un directorio con -n ficheros mientras otro hilo crea y borra
+ * entradas en el, y comprueba que cada fichero sale una sola vez.
+ * Con -u recorta ficheros y comprueba tamaños, ceros y bloques libres, y
+ * con -U, despues de volver a montar, que todo sigue igual en disco.
+ */
+
+struct stress_opts {
+    const char *root;
+    unsigned int max_threads;
+    unsigned int files;
+    size_t write_size;
+    int do_fsync;
+    int readdir_bench;
+    int truncate_check;
+    int readdir_check;
+};
+
+struct stress_thread {
+    pthread_t tid;
+    const struct stress_opts *opts;
+    pthread_barrier_t *barrier;
+    unsigned int round;
+    unsigned int id;
+    int error;
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t ret;
+
+    while (len) {
+        ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void *stress_worker(void *arg) {
+    struct stress_thread *t = arg;
+    const struct stress_opts *opts = t->opts;
+    char dir[4096], path[4096 + 32];
+    char *buf;
+    unsigned int i;
+    int fd;
+
+    buf = malloc(opts->write_size ? opts->write_size : 1);
+    if (!buf) {
+        t->error = ENOMEM;
+        pthread_barrier_wait(t->barrier);
+        return NULL;
+    }
+    memset(buf, 'a' + t->id % 26, opts->write_size);
+
+    //Todos los hilos empiezan a la vez para que compitan de verdad
+    snprintf(dir, sizeof(dir), "%s/stress-%u-%u", opts->root, t->round, t->id);
+    pthread_barrier_wait(t->barrier);
+
+    if (mkdir(dir, 0755) == -1) {
+        t->error = errno;
+        goto out;
+    }
+
+    for (i = 0; i < opts->files; i++) {
+        snprintf(path, sizeof(path), "%s/file-%u", dir, i);
+        fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd == -1) {
+            t->error = errno;
+            goto out;
+        }
+        if ((opts->write_size && write_all(fd, buf, opts->write_size) == -1) ||
+            (opts->do_fsync && fsync(fd) == -1)) {
+            t->error = errno;
+            close(fd);
+            goto out;
+        }
+        close(fd);
+    }
+
+out:
+    free(buf);
+    return NULL;
+}
+
+static int run_round(const struct stress_opts *opts, unsigned int nthreads, double *elapsed) {
+    struct stress_thread *threads;
+    pthread_barrier_t barrier;
+    unsigned int i;
+    double start;
+    int ret = 0;
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (!threads)
+        return ENOMEM;
+    //El hilo principal tambien espera en la barrera para tomar el tiempo
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].opts = opts;
+        threads[i].barrier = &barrier;
+        threads[i].round = nthreads;
+        threads[i].id = i;
+        ret = pthread_create(&threads[i].tid, NULL, stress_worker, &threads[i]);
+        if (ret) {
+            fprintf(stderr, "Error creating thread %u: %s\n", i, strerror(ret));
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = now();
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        if (threads[i].error && !ret) {
+            fprintf(stderr, "Thread %u failed: %s\n", i, strerror(threads[i].error));
+            ret = threads[i].error;
+        }
+    }
+    //Sin sync el tiempo solo mediria la cache de paginas
+    sync();
+    *elapsed = now() - start;
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+    return ret;
+}
+
+/*
+ * Recorre el directorio y hace stat de cada entrada, como ls -l o du
+ */
+static int readdir_stat_pass(const char *dir, unsigned long *entries, double *elapsed) {
+    struct dirent *de;
+    struct stat st;
+    double start;
+    DIR *d;
+
+    *entries = 0;
+    *elapsed = 0;
+    start = now();
+    d = opendir(dir);
+    if (!d)
+        return errno;
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            closedir(d);
+            return errno;
+        }
+        (*entries)++;
+    }
+    closedir(d);
+    *elapsed = now() - start;
+    return 0;
+}
+
+static int drop_caches(void) {
+    int fd, ret;
+
+    sync();
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd == -1)
+        return -1;
+    ret = write_all(fd, "3", 1);
+    close(fd);
+    return ret;
+}
+
+static int run_readdir_bench(const struct stress_opts *opts) {
+    char dir[4096], path[4096 + 32];
+    const char *pass[] = { "cold", "warm" };
+    unsigned long entries;
+    double elapsed;
+    unsigned int i;
+    int fd, ret;
+
+    snprintf(dir, sizeof(dir), "%s/readdir-bench", opts->root);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    //Si el directorio ya existe de una ejecucion anterior se reutiliza
+    for (i = 0; i < opts->files; i++) {
+        snprintf(path, sizeof(path), "%s/entry-%u", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+    }
+
+    printf("%8s %12s %10s %12s\n", "pass", "entries", "seconds", "entries/s");
+    for (i = 0; i < 2; i++) {
+        //Sin vaciar la cache la pasada en frio no lee nada del disco
+        if (i == 0 && drop_caches() == -1)
+            fprintf(stderr, "Could not drop caches (needs root), cold pass may be warm\n");
+        ret = readdir_stat_pass(dir, &entries, &elapsed);
+        if (ret) {
+            fprintf(stderr, "Error walking %s: %s\n", dir, strerror(ret));
+            return 1;
+        }
+        printf("%8s %12lu %10.3f %12.0f\n", pass[i], entries, elapsed, entries / elapsed);
+    }
+    return 0;
+}
+
+/*
+ * Prueba de readdir con el directorio cambiando. getdents64 con un buffer
+ * pequeño obliga a seguir desde la posicion devuelta muchas veces por
+ * pasada, mientras las entradas que se crean y se borran parten y compactan
+ * las hojas del directorio.
+ */
+#define READDIR_CHECK_PASSES 20
+#define READDIR_CHECK_CHURN 256
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct churn_thread {
+    pthread_t tid;
+    const char *dir;
+    volatile int stop;
+    int error;
+};
+
+static void *readdir_churn(void *arg) {
+    struct churn_thread *c = arg;
+    char path[4096 + 32];
+    unsigned int i;
+    int fd;
+
+    for (i = 0; !c->stop; i++) {
+        snprintf(path, sizeof(path), "%s/churn-%u", c->dir, i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd == -1) {
+            c->error = errno;
+            return NULL;
+        }
+        close(fd);
+        if (i >= READDIR_CHECK_CHURN) {
+            snprintf(path, sizeof(path), "%s/churn-%u", c->dir, i - READDIR_CHECK_CHURN);
+            if (unlink(path) == -1) {
+                c->error = errno;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int readdir_check_pass(const char *dir, unsigned int files, unsigned char *seen) {
+    char buf[512];
+    struct linux_dirent64 *de;
+    unsigned int i;
+    long n, off;
+    int fd, end, ret = 0;
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        return errno;
+    memset(seen, 0, files);
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (off = 0; off < n; off += de->d_reclen) {
+            de = (struct linux_dirent64 *)(buf + off);
+            if (sscanf(de->d_name, "fixed-%u%n", &i, &end) != 1 || de->d_name[end] || i >= files)
+                continue;
+            if (seen[i]++) {
+                fprintf(stderr, "%s/%s returned twice\n", dir, de->d_name);
+                ret = EEXIST;
+            }
+        }
+    }
+    if (n == -1)
+        ret = errno;
+    close(fd);
+    for (i = 0; i < files && !ret; i++) {
+        if (!seen[i]) {
+            fprintf(stderr, "%s/fixed-%u skipped\n", dir, i);
+            ret = ENOENT;
+        }
+    }
+    return ret;
+}
+
+static int run_readdir_check(const struct stress_opts *opts) {
+    char dir[4096], path[4096 + 32];
+    struct churn_thread churn;
+    unsigned char *seen;
+    unsigned int i;
+    int fd, ret = 0;
+
+    snprintf(dir, sizeof(dir), "%s/readdir-check", opts->root);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < opts->files; i++) {
+        snprintf(path, sizeof(path), "%s/fixed-%u", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+    }
+    seen = malloc(opts->files);
+    if (!seen)
+        return 1;
+
+    memset(&churn, 0, sizeof(churn));
+    churn.dir = dir;
+    if (pthread_create(&churn.tid, NULL, readdir_churn, &churn)) {
+        fprintf(stderr, "Error creating churn thread\n");
+        free(seen);
+        return 1;
+    }
+    for (i = 0; i < READDIR_CHECK_PASSES && !ret; i++)
+        ret = readdir_check_pass(dir, opts->files, seen);
+    churn.stop = 1;
+    pthread_join(churn.tid, NULL);
+    free(seen);
+
+    if (churn.error) {
+        fprintf(stderr, "Churn thread failed: %s\n", strerror(churn.error));
+        return 1;
+    }
+    if (ret) {
+        fprintf(stderr, "readdir check failed on pass %u: %s\n", i, strerror(ret));
+        return 1;
+    }
+    printf("readdir check: %u passes over %u files, no duplicates or skips\n", i, opts->files);
+    return 0;
+}
+
+/*
+ * Prueba de recorte: un fichero grande que se recorta a mitad de bloque y
+ * luego se alarga, otro que se vacia con O_TRUNC y uno pequeño, con los
+ * datos dentro del inodo, que se recorta y se alarga con truncate(2)
+ */
+#define TRUNC_BIG_SIZE (1 << 20)
+#define TRUNC_CUT 100000
+#define TRUNC_GROW 200000
+#define TRUNC_SMALL_SIZE 100
+#define TRUNC_SMALL_CUT 10
+#define TRUNC_SMALL_GROW 60
+
+static int free_blocks(const char *path, unsigned long long *bfree, unsigned long *bsize) {
+    struct statvfs st;
+
+    sync();
+    if (statvfs(path, &st) == -1)
+        return -1;
+    *bfree = st.f_bfree;
+    *bsize = st.f_frsize;
+    return 0;
+}
+
+/*
+ * Comprueba que el fichero mide size bytes, con c hasta data y ceros despues
+ */
+static int check_file(const char *path, off_t size, off_t data, char c) {
+    char buf[4096];
+    struct stat st;
+    off_t off = 0;
+    ssize_t i, n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (st.st_size != size) {
+        fprintf(stderr, "%s: size %lld, expected %lld\n", path, (long long)st.st_size, (long long)size);
+        close(fd);
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++, off++) {
+            if (buf[i] != (off < data ? c : 0)) {
+                fprintf(stderr, "%s: bad byte at %lld\n", path, (long long)off);
+                close(fd);
+                return -1;
+            }
+        }
+    }
+    close(fd);
+    if (n == -1 || off != size) {
+        fprintf(stderr, "%s: short read at %lld\n", path, (long long)off);
+        return -1;
+    }
+    return 0;
+}
+
+static int fill_file(const char *path, size_t size, char c) {
+    char *buf;
+    int fd, ret;
+
+    buf = malloc(size);
+    if (!buf)
+        return -1;
+    memset(buf, c, size);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    ret = fd == -1 || write_all(fd, buf, size) == -1 || fsync(fd) == -1 ? -1 : 0;
+    if (fd != -1)
+        close(fd);
+    free(buf);
+    return ret;
+}
+
+static int run_truncate_check(const struct stress_opts *opts) {
+    char dir[4096], big[4096 + 32], emptied[4096 + 32], small[4096 + 32], expect[4096 + 32];
+    unsigned long long bfree0, bfree1, want;
+    unsigned long bsize;
+    FILE *f;
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%s/truncate-test", opts->root);
+    snprintf(big, sizeof(big), "%s/big", dir);
+    snprintf(emptied, sizeof(emptied), "%s/emptied", dir);
+    snprintf(small, sizeof(small), "%s/small", dir);
+    snprintf(expect, sizeof(expect), "%s/expect", dir);
+
+    if (opts->truncate_check == 2) {
+        //Despues de volver a montar: los tamaños y los bloques libres vienen del disco
+        f = fopen(expect, "r");
+        if (!f || fscanf(f, "%llu", &want) != 1) {
+            fprintf(stderr, "Error reading %s, run -u first\n", expect);
+            return 1;
+        }
+        fclose(f);
+        if (check_file(big, TRUNC_GROW, TRUNC_CUT, 'x') || check_file(emptied, 0, 0, 'e') ||
+            check_file(small, TRUNC_SMALL_GROW, TRUNC_SMALL_CUT, 's') || free_blocks(opts->root, &bfree1, &bsize))
+            return 1;
+        if (bfree1 != want) {
+            fprintf(stderr, "free blocks %llu after remount, expected %llu\n", bfree1, want);
+            return 1;
+        }
+        printf("truncate check after remount: ok\n");
+        return 0;
+    }
+
+    if (mkdir(dir, 0755) == -1) {
+        fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    //Los ficheros vacios y el de las cuentas no ocupan bloques: caben en el inodo
+    if (fill_file(big, 0, 'x') || fill_file(emptied, 0, 'e') || fill_file(expect, 0, 0) ||
+        free_blocks(opts->root, &bfree0, &bsize))
+        goto err;
+
+    if (fill_file(big, TRUNC_BIG_SIZE, 'x') || truncate(big, TRUNC_CUT) == -1 ||
+        check_file(big, TRUNC_CUT, TRUNC_CUT, 'x'))
+        goto err;
+    //Los bytes que quedan fuera del ultimo bloque tienen que volver como ceros
+    if (truncate(big, TRUNC_GROW) == -1 || check_file(big, TRUNC_GROW, TRUNC_CUT, 'x'))
+        goto err;
+
+    if (fill_file(emptied, TRUNC_BIG_SIZE, 'e'))
+        goto err;
+    fd = open(emptied, O_WRONLY | O_TRUNC);
+    if (fd == -1)
+        goto err;
+    close(fd);
+    if (check_file(emptied, 0, 0, 'e'))
+        goto err;
+
+    fd = -1;
+    if (fill_file(small, TRUNC_SMALL_SIZE, 's') || (fd = open(small, O_WRONLY)) == -1 ||
+        ftruncate(fd, TRUNC_SMALL_CUT) == -1 || ftruncate(fd, TRUNC_SMALL_GROW) == -1 || fsync(fd) == -1) {
+        if (fd != -1)
+            close(fd);
+        goto err;
+    }
+    close(fd);
+    if (check_file(small, TRUNC_SMALL_GROW, TRUNC_SMALL_CUT, 's'))
+        goto err;
+
+    if (free_blocks(opts->root, &bfree1, &bsize))
+        goto err;
+    want = (TRUNC_CUT + bsize - 1) / bsize;
+    if (bfree0 - bfree1 != want) {
+        fprintf(stderr, "truncated files use %llu blocks, expected %llu\n", bfree0 - bfree1, want);
+        return 1;
+    }
+
+    f = fopen(expect, "w");
+    if (!f || fprintf(f, "%llu\n", bfree1) < 0 || fflush(f) || fsync(fileno(f)) || fclose(f)) {
+        fprintf(stderr, "Error writing %s\n", expect);
+        return 1;
+    }
+    printf("truncate check: ok, remount and run -U\n");
+    return 0;
+
+err:
+    fprintf(stderr, "truncate check failed: %s\n", strerror(errno));
+    return 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t max_threads] [-n files_per_thread] [-s write_size] [-f] [-r] [-d] [-u|-U] <directory>\n", prog);
+    fprintf(stderr, "  -t  run with 1, 2, 4... up to max_threads threads (default: online CPUs)\n");
+    fprintf(stderr, "  -n  files created by each thread (default: 1000)\n");
+    fprintf(stderr, "  -s  bytes written to each file (default: 4096)\n");
+    fprintf(stderr, "  -f  fsync every file after writing it\n");
+    fprintf(stderr, "  -r  instead, time readdir + stat of a directory with -n entries\n");
+    fprintf(stderr, "  -d  instead, readdir a directory with -n files while entries are created and removed\n");
+    fprintf(stderr, "  -u  instead, truncate files and check sizes, zeroed tails and free blocks\n");
+    fprintf(stderr, "  -U  after remounting, check the files and free blocks left by -u\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct stress_opts opts;
+    double elapsed, base = 0, rate;
+    unsigned int n;
+    long cpus;
+    int opt;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.max_threads = cpus > 0 ? cpus : 1;
+    opts.files = 1000;
+    opts.write_size = 4096;
+    opts.do_fsync = 0;
+    opts.readdir_bench = 0;
+    opts.truncate_check = 0;
+    opts.readdir_check = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:s:frduU")) != -1) {
+        switch (opt) {
+        case 't':
+            opts.max_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            opts.files = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            opts.write_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            opts.do_fsync = 1;
+            break;
+        case 'r':
+            opts.readdir_bench = 1;
+            break;
+        case 'd':
+            opts.readdir_check = 1;
+            break;
+        case 'u':
+            opts.truncate_check = 1;
+            break;
+        case 'U':
+            opts.truncate_check = 2;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !opts.max_threads || !opts.files)
+        usage(argv[0]);
+    opts.root = argv[optind];
+    if (opts.readdir_bench)
+        return run_readdir_bench(&opts);
+    if (opts.readdir_check)
+        return run_readdir_check(&opts);
+    if (opts.truncate_check)
+        return run_truncate_check(&opts);
+
+    printf("%8s %12s %12s %10s %8s\n", "threads", "files", "files/s", "MB/s", "speedup");
+    for (n = 1;; n = n * 2 < opts.max_threads ? n * 2 : opts.max_threads) {
+        if (run_round(&opts, n, &elapsed))
+            return 1;
+        rate = (double)n * opts.files / elapsed;
+        if (n == 1)
+            base = rate;
+        printf("%8u %12llu %12.0f %10.1f %7.2fx\n", n, (unsigned long long)n * opts.files, rate,
+               rate * opts.write_size / (1024 * 1024), rate / base);
+        if (n == opts.max_threads)
+            break;
+    }
+    return 0;
+}
@@ -4,7 +4,24 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/pagemap.h>      /* address_space         */
+#include <linux/mpage.h>        /* mpage_readahead       */
+#include <linux/vmalloc.h>      /* kvcalloc              */
+#include <linux/sort.h>         /* sort                  */
+#include <linux/parser.h>       /* match_token           */
+#include <linux/seq_file.h>     /* seq_printf            */
+#include <linux/workqueue.h>    /* delayed_work          */
+#include <linux/blkdev.h>       /* blkdev_issue_flush    */
+#include <linux/crc32.h>        /* crc32_le              */
+#include <linux/iomap.h>        /* iomap_dio_rw          */
+#include <linux/percpu.h>       /* alloc_percpu          */
+#include <linux/percpu_counter.h> /* percpu_counter */
+#include <linux/statfs.h>       /* kstatfs               */
+#include <linux/kobject.h>      /* /sys/fs/assoofs       */
+#include <linux/sched/mm.h>     /* memalloc_nofs_save    */
 #include "assoofs.h"
+#define CREATE_TRACE_POINTS
+#include "assoofs_trace.h"
 
 
 
@@ -14,565 +31,4062 @@
 void assoofs_save_sb_info(struct super_block *vsb);
 void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+struct assoofs_disk_inode *assoofs_inode_table_slot(struct super_block *sb, uint64_t inode_no, struct buffer_head **bhp);
+int assoofs_sb_get_a_freeinode(struct super_block *sb, uint64_t *inode_no);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+void assoofs_sb_put_a_freeblock(struct super_block *sb, uint64_t block);
+int assoofs_map_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t *pblock);
+int assoofs_map_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t max, uint64_t *pblock, uint64_t *count);
+int assoofs_alloc_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t max, int reserved, uint64_t *pblock, uint64_t *count);
+int assoofs_bitmap_load(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t start, uint64_t nbits);
+void assoofs_bitmap_release(struct assoofs_bitmap *bm);
+int assoofs_bitmap_alloc(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t *bit);
+int assoofs_bitmap_alloc_range(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t goal, uint64_t max, int reserved, uint64_t *start, uint64_t *count);
+int assoofs_bitmap_reserve(struct assoofs_bitmap *bm, uint64_t n, uint64_t margin);
+void assoofs_bitmap_unreserve(struct assoofs_bitmap *bm, uint64_t n);
+void assoofs_bitmap_free(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t bit);
+void assoofs_bitmap_free_range(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t start, uint64_t count);
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+/*
+ * Journal de metadatos. Toda modificacion de metadatos se hace dentro de un
+ * manejador (assoofs_journal_start/stop) que reserva credits bloques en la
+ * transaccion en curso, y cada bloque modificado se apunta con
+ * assoofs_journal_dirty en lugar de marcarlo sucio. Dentro del manejador las
+ * reservas de memoria no entran en el sistema de ficheros: la recuperacion de
+ * memoria podria desalojar un inodo y esperar a un commit que no puede
+ * empezar mientras el manejador sigue abierto.
+ */
+#define ASSOOFS_DIR_ADD_CREDITS 16
+#define ASSOOFS_CREATE_CREDITS (ASSOOFS_DIR_ADD_CREDITS + 4)
+#define ASSOOFS_MKDIR_CREDITS (ASSOOFS_CREATE_CREDITS + 6)
+#define ASSOOFS_WRITE_CREDITS 6
+#define ASSOOFS_UNLINK_CREDITS 3
+#define ASSOOFS_RENAME_CREDITS (ASSOOFS_DIR_ADD_CREDITS + 5)
+#define ASSOOFS_MAX_CREDITS ASSOOFS_MKDIR_CREDITS
+
+/*
+ * Al borrar un inodo sus bloques se liberan desde el final, como mucho
+ * ASSOOFS_FREE_RUNS rachas por manejador, cada una dentro de un solo bloque
+ * del mapa de bits. El manejador toca esos bloques del mapa, el de tramos
+ * adicionales y el de la tabla de inodos; el que libera el propio inodo, su
+ * bloque de la tabla, el del mapa de inodos y el superbloque.
+ */
+#define ASSOOFS_FREE_RUNS 4
+#define ASSOOFS_FREE_CREDITS (ASSOOFS_FREE_RUNS + 2)
+
+//Bloques de la tabla de inodos que readdir lee por adelantado en cada hoja
+#define ASSOOFS_DIR_RA_BLOCKS 64
+
+/*
+ * Asignacion retrasada: al escribir en un hueco solo se aparta un bloque del
+ * mapa y el bloque se elige al escribir la pagina, en rachas contiguas de
+ * hasta ASSOOFS_MAX_ALLOC_RUN bloques que cubren las paginas sucias
+ * siguientes. Siempre quedan ASSOOFS_META_RESERVE bloques sin apartar para
+ * los metadatos.
+ */
+#define ASSOOFS_MAX_ALLOC_RUN 1024
+#define ASSOOFS_META_RESERVE 64
+
+/*
+ * Error maximo de la lectura aproximada de los contadores por CPU de un mapa
+ * de bits (dos contadores, con hasta percpu_counter_batch por CPU cada uno,
+ * y margen para las reservas que se cruzan). Por debajo se suman exactos.
+ */
+#define ASSOOFS_COUNTER_SLACK (4 * percpu_counter_batch * (s64)num_possible_cpus())
+#define ASSOOFS_DELAYED_BLOCK (~(sector_t)0)
+
+unsigned int assoofs_journal_start(struct super_block *sb, unsigned int credits);
+void assoofs_journal_stop(struct super_block *sb, unsigned int credits, unsigned int nofs);
+void assoofs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+void assoofs_journal_defer_free(struct super_block *sb, uint64_t start, uint64_t count);
+int assoofs_journal_commit(struct super_block *sb, uint64_t sequence);
+static int assoofs_journal_checkpoint(struct super_block *sb);
+static int assoofs_journal_release_freed(struct super_block *sb);
+int assoofs_journal_load(struct super_block *sb);
+void assoofs_journal_release(struct super_block *sb);
+static int assoofs_free_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t from);
 
 /*
  *  Operaciones sobre ficheros
  */
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+static int assoofs_file_open(struct inode *inode, struct file *file);
+static loff_t assoofs_file_llseek(struct file *file, loff_t offset, int whence);
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
 const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
+    .open = assoofs_file_open,
+    .llseek = assoofs_file_llseek,
+    .read_iter = assoofs_file_read_iter,
+    .write_iter = assoofs_file_write_iter,
+    .mmap = generic_file_mmap,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .fsync = assoofs_fsync,
 };
 
 /**
- * Permite leer de un archivo
- * @param filp fichero a leer
- * @param __user direccion del buffer
- * @return tamaño de fichero
+ * Abre un fichero. Si se monto con readahead=, la ventana de lectura
+ * anticipada del fichero pasa a ser esa en lugar de la del dispositivo.
+ * @param inode inodo del fichero
+ * @param file fichero abierto
+ * @return 0 si todo sale bien o un error
  */
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
+static int assoofs_file_open(struct inode *inode, struct file *file){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(inode->i_sb);
 
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-    char *buffer;
-    int nbytes;
+    if(sbi->ra_pages)
+        file->f_ra.ra_pages = sbi->ra_pages;
+    return generic_file_open(inode, file);
+}
+
+/**
+ * Lleva a disco un fichero o directorio: escribe sus paginas y hace commit
+ * de la transaccion en curso, que lleva todos sus metadatos. Los campos que
+ * el VFS marco sucios sin pasar por el journal (tiempos, modo, dueño) se
+ * apuntan antes con write_inode. Si otro fsync ya ha hecho ese commit no se
+ * repite.
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync){
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+    uint64_t sequence;
+    int ret;
 
-    printk(KERN_INFO "Read request\n");
-    //Accedemos a la informacion persistente del archivo
-    inode_info = filp->f_path.dentry->d_inode->i_private;
+    ret = file_write_and_wait_range(file, start, end);
+    if(ret)
+        return ret;
 
-    //Combrobamos si hemos ppos es mayor que el tamaño del archivo
-    if(*ppos >= inode_info->file_size){
-	    return 0;
+    sequence = READ_ONCE(j->sequence);
+    //Con datasync los tiempos solos no hacen falta
+    if(!datasync || (inode->i_state & I_DIRTY_DATASYNC)){
+        ret = sync_inode_metadata(inode, 1);
+        if(ret)
+            return ret;
     }
+    ret = assoofs_journal_commit(sb, sequence);
+    //Sin metadatos pendientes el commit no vacia la cache del disco y los datos aun no son persistentes
+    if(!ret && READ_ONCE(j->commit_sequence) < sequence)
+        ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+    return ret;
+}
 
-    //Accedemos al contenido del archivo y lo guardamos en buffer
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *) bh->b_data;
+/*
+ *  Operaciones sobre la cache de paginas de los ficheros
+ */
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create);
+static int assoofs_readpage(struct file *file, struct page *page);
+static void assoofs_readahead(struct readahead_control *rac);
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc);
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc);
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata);
+static int assoofs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata);
+static void assoofs_invalidatepage(struct page *page, unsigned int offset, unsigned int length);
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block);
+const struct address_space_operations assoofs_aops = {
+    .readpage = assoofs_readpage,
+    .readahead = assoofs_readahead,
+    .writepage = assoofs_writepage,
+    .writepages = assoofs_writepages,
+    .write_begin = assoofs_write_begin,
+    .write_end = assoofs_write_end,
+    .invalidatepage = assoofs_invalidatepage,
+    .bmap = assoofs_bmap,
+    //O_DIRECT va por iomap en read_iter y write_iter
+    .direct_IO = noop_direct_IO,
+};
 
-    //Copiamos los datos al buffer usuario para leerlos y devolvemos el numero de bytes leidos
-    nbytes = min((size_t) inode_info->file_size, len);
-    copy_to_user(buf, buffer, nbytes);
-    *ppos += nbytes;
-    return nbytes;
+/*
+ *  Datos dentro del inodo. El flag solo cambia en write_begin, con el
+ *  cerrojo del inodo cogido, y con la pagina 0 bloqueada.
+ */
+static inline int assoofs_has_inline_data(struct assoofs_inode *ai){
+    return ai->info.flags & ASSOOFS_INODE_INLINE_DATA;
 }
 
 /**
- * Permite escribir en un archivo
- * @param filp archivo
- * @param __user direccion del buffer
- * @return longitud del archivo
+ * Rellena una pagina con los datos guardados dentro del inodo y ceros
+ * @param ai inodo
+ * @param page pagina bloqueada
  */
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
+static void assoofs_read_inline_page(struct assoofs_inode *ai, struct page *page){
+    void *kaddr;
+    size_t len = 0;
 
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-    char *buffer;
-    printk(KERN_INFO "Write request\n");
-    //Accedemos a la informacion persistente del archivo
-    inode_info = filp->f_path.dentry->d_inode->i_private;
-    
-    //Accedemos al contenido del archivo
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *) bh->b_data;
-    
-    //Copiamos al archivo
-    buffer += *ppos;
-    copy_from_user(buffer, buf, len);
-    *ppos += len;
-
-    //Marcamos el bloque como sucio y sincronizamos
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-
-    //Actualizamos el tamaño
-    inode_info->file_size = *ppos;
-    assoofs_save_inode_info(filp->f_path.dentry->d_inode->i_sb, inode_info);
-    brelse(bh);
-    return len;
+    down_read(&ai->data_sem);
+    kaddr = kmap_atomic(page);
+    if(page->index == 0){
+        len = min_t(uint64_t, ai->info.file_size, ASSOOFS_INLINE_DATA_MAX);
+        memcpy(kaddr, ai->info.inline_data, len);
+    }
+    memset(kaddr + len, 0, PAGE_SIZE - len);
+    kunmap_atomic(kaddr);
+    up_read(&ai->data_sem);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
 }
 
-/*
- *  Operaciones sobre directorios
+/**
+ * Copia dentro del inodo el contenido de la pagina 0 hasta el final del
+ * fichero y lo apunta en el journal
+ * @param inode inodo con datos dentro
+ * @param page pagina 0, bloqueada y actualizada
+ * @param size nuevo tamaño del fichero, como mucho ASSOOFS_INLINE_DATA_MAX
  */
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
-const struct file_operations assoofs_dir_operations = {
-    .owner = THIS_MODULE,
-    .iterate = assoofs_iterate,
-};
+static void assoofs_write_inline_page(struct inode *inode, struct page *page, loff_t size){
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    void *kaddr;
+    unsigned int nofs;
+
+    nofs = assoofs_journal_start(inode->i_sb, 1);
+    down_write(&ai->data_sem);
+    kaddr = kmap_atomic(page);
+    memcpy(ai->info.inline_data, kaddr, size);
+    kunmap_atomic(kaddr);
+    ai->info.file_size = size;
+    assoofs_save_inode_info(inode->i_sb, &ai->info);
+    up_write(&ai->data_sem);
+    assoofs_journal_stop(inode->i_sb, 1, nofs);
+}
 
 /**
- * Permite mostrar el contenido de un directorio
- * @param filp directorio
- * @param ctx contexto
- * @return 0 o -1, si sale todo bien o no
+ * Pasa los datos de un fichero de dentro del inodo a la pagina 0, que queda
+ * sucia, y deja el inodo sin tramos. El bloque se asigna al escribir la
+ * pagina, como en cualquier otro fichero.
+ * @param inode inodo con datos dentro
+ * @param flags flags de write_begin
+ * @return 0 si todo sale bien o un error
  */
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
+static int assoofs_convert_inline_data(struct inode *inode, unsigned flags){
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct page *page;
+    unsigned int nofs;
 
-    struct inode *inode;
-    struct super_block *sb;
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i;
+    page = grab_cache_page_write_begin(inode->i_mapping, 0, flags);
+    if(!page)
+        return -ENOMEM;
+    if(!PageUptodate(page))
+        assoofs_read_inline_page(ai, page);
 
-    printk(KERN_INFO "Iterate request\n");
+    nofs = assoofs_journal_start(inode->i_sb, 1);
+    down_write(&ai->data_sem);
+    ai->info.flags &= ~ASSOOFS_INODE_INLINE_DATA;
+    memset(ai->info.inline_data, 0, sizeof(ai->info.inline_data));
+    ai->info.extent_count = 0;
+    ai->info.extent_block = 0;
+    assoofs_save_inode_info(inode->i_sb, &ai->info);
+    up_write(&ai->data_sem);
+    assoofs_journal_stop(inode->i_sb, 1, nofs);
 
-    //Accedemos al inodo y cogemos la parte persistente
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    inode_info = inode->i_private;
+    set_page_dirty(page);
+    unlock_page(page);
+    put_page(page);
+    return 0;
+}
+
+/**
+ * Cuenta los bloques seguidos desde iblock, dentro del fichero, cuyas
+ * paginas estan sucias en la cache. Es la longitud de la racha que conviene
+ * asignar de una vez al escribir la pagina de iblock.
+ * @param inode inodo del fichero
+ * @param iblock bloque logico, con su pagina sucia
+ * @return numero de bloques, al menos 1
+ */
+static uint64_t assoofs_dirty_run(struct inode *inode, sector_t iblock){
+    unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+    uint64_t end = (i_size_read(inode) + (1 << inode->i_blkbits) - 1) >> inode->i_blkbits;
+    uint64_t n, max;
+    struct page *page;
+    pgoff_t index;
+    int dirty;
 
-    //Hacemos comprobaciones
-    //Si la pos del contexto es distinto de 0
-    if(ctx->pos){ 
-	    return -1;
+    if(end <= iblock)
+        return 1;
+    max = min_t(uint64_t, end - iblock, ASSOOFS_MAX_ALLOC_RUN);
+
+    //La pagina de iblock es la que se esta escribiendo; miramos las siguientes
+    n = (((iblock >> shift) + 1) << shift) - iblock;
+    for(index = (iblock >> shift) + 1; n < max; index++){
+        page = find_get_page(inode->i_mapping, index);
+        dirty = page && PageDirty(page);
+        if(page)
+            put_page(page);
+        if(!dirty)
+            break;
+        n += 1 << shift;
     }
+    return min(n, max);
+}
 
-    //Si el archivo no es un directorio
-    if(!(S_ISDIR(inode_info->mode))){
-	    return -1;
+/**
+ * Asocia un buffer_head de la cache de paginas con su bloque en disco, o con
+ * la racha de bloques contiguos que empieza en el si b_size pide varios. Al
+ * escribir las paginas, los bloques que no estan asignados se asignan en una
+ * racha que cubre tambien las paginas sucias que siguen.
+ * @param inode inodo del fichero
+ * @param iblock bloque logico dentro del fichero
+ * @param bh_result buffer_head a mapear
+ * @param create si se debe asignar el bloque cuando no existe
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create){
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int delayed = buffer_delay(bh_result);
+    uint64_t pblock, count;
+    int ret;
+    unsigned int nofs;
+
+    //Los ficheros con los datos dentro del inodo no tienen bloques
+    if(assoofs_has_inline_data(ai))
+        return create ? -EIO : 0;
+
+    //Al leer, b_size trae cuantos bloques quiere el llamante y devolvemos
+    //cuantos siguen contiguos en disco, para que mpage arme bios grandes
+    down_read(&ai->data_sem);
+    ret = assoofs_map_blocks(sb, &ai->info, iblock, max_t(uint64_t, bh_result->b_size >> inode->i_blkbits, 1), &pblock, &count);
+    up_read(&ai->data_sem);
+    if(ret == 0){
+        bh_result->b_size = count << inode->i_blkbits;
+        goto mapped;
+    }
+    if(ret != -ENOENT)
+        return ret;
+    //Los huecos se dejan sin mapear y la cache de paginas los rellena con ceros
+    if(!create)
+        return 0;
+
+    count = assoofs_dirty_run(inode, iblock);
+    nofs = assoofs_journal_start(sb, ASSOOFS_WRITE_CREDITS);
+    down_write(&ai->data_sem);
+    //Otro hilo puede haber asignado el bloque mientras no teniamos el semaforo
+    ret = assoofs_map_block(sb, &ai->info, iblock, &pblock);
+    if(ret == -ENOENT){
+        ret = assoofs_alloc_blocks(sb, &ai->info, iblock, count, delayed, &pblock, &count);
+        if(!ret){
+            assoofs_save_inode_info(sb, &ai->info);
+            set_buffer_new(bh_result);
+        }
     }
+    up_write(&ai->data_sem);
+    assoofs_journal_stop(sb, ASSOOFS_WRITE_CREDITS, nofs);
+    if(ret)
+        return ret;
+
+mapped:
+    //El bloque apartado en write_begin ya tiene sitio en el disco
+    if(delayed)
+        assoofs_bitmap_unreserve(&ASSOOFS_SB(sb)->block_bitmap, 1);
+    map_bh(bh_result, sb, pblock);
+    return 0;
+}
 
-    //Accedemos al bloque correspondiente donde se encuentra la informacion del directorio
+/**
+ * get_block de write_begin: los bloques asignados se mapean, y para los
+ * huecos solo se aparta un bloque del mapa y el buffer queda retrasado hasta
+ * que se escriba la pagina
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_get_block_prep(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create){
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    uint64_t pblock;
+    int ret;
 
-    bh = sb_bread(sb, inode_info->data_block_number);
-    record = (struct assoofs_dir_record_entry *) bh->b_data;
-    for(i = 0; i < inode_info->dir_children_count ; i++){
-        //Se añaden las entradas del directorio al contexto y se incrementa la posición
-	    dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-	    ctx->pos += sizeof(struct assoofs_dir_record_entry);
-	    record++;
+    down_read(&ai->data_sem);
+    ret = assoofs_map_block(sb, &ai->info, iblock, &pblock);
+    up_read(&ai->data_sem);
+    if(ret == 0){
+        map_bh(bh_result, sb, pblock);
+        return 0;
     }
-    brelse(bh);
+    if(ret != -ENOENT)
+        return ret;
+
+    //El error de espacio se da aqui, en write, y no al escribir la pagina
+    ret = assoofs_bitmap_reserve(&ASSOOFS_SB(sb)->block_bitmap, 1, ASSOOFS_META_RESERVE);
+    //Los bloques de un borrado reciente vuelven al mapa en el checkpoint
+    if(ret == -ENOSPC && assoofs_journal_release_freed(sb))
+        ret = assoofs_bitmap_reserve(&ASSOOFS_SB(sb)->block_bitmap, 1, ASSOOFS_META_RESERVE);
+    if(ret)
+        return ret;
+    map_bh(bh_result, sb, ASSOOFS_DELAYED_BLOCK);
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
     return 0;
 }
 
+/**
+ * Descarta una pagina, o parte de ella, devolviendo los bloques apartados
+ * de sus buffers retrasados
+ */
+static void assoofs_invalidatepage(struct page *page, unsigned int offset, unsigned int length){
+    struct inode *inode = page->mapping->host;
+    struct buffer_head *head, *bh;
+    unsigned int pos = 0, n = 0;
+
+    if(page_has_buffers(page)){
+        head = bh = page_buffers(page);
+        do{
+            if(pos >= offset && pos + bh->b_size <= offset + length && buffer_delay(bh))
+                n++;
+            pos += bh->b_size;
+            bh = bh->b_this_page;
+        }while(bh != head);
+    }
+    if(n)
+        assoofs_bitmap_unreserve(&ASSOOFS_SB(inode->i_sb)->block_bitmap, n);
+    block_invalidatepage(page, offset, length);
+}
+
+/**
+ * Lee una pagina de un fichero
+ */
+static int assoofs_readpage(struct file *file, struct page *page){
+    struct assoofs_inode *ai = ASSOOFS_I(page->mapping->host);
+
+    if(assoofs_has_inline_data(ai)){
+        assoofs_read_inline_page(ai, page);
+        unlock_page(page);
+        return 0;
+    }
+    return block_read_full_page(page, assoofs_get_block);
+}
+
+/**
+ * Lee por adelantado las paginas que pide la cache de paginas
+ */
+static void assoofs_readahead(struct readahead_control *rac){
+    struct assoofs_inode *ai = ASSOOFS_I(rac->mapping->host);
+    struct page *page;
+
+    if(assoofs_has_inline_data(ai)){
+        while((page = readahead_page(rac))){
+            assoofs_read_inline_page(ai, page);
+            unlock_page(page);
+            put_page(page);
+        }
+        return;
+    }
+    mpage_readahead(rac, assoofs_get_block);
+}
+
+/**
+ * Escribe en disco una pagina sucia
+ */
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc){
+    struct inode *inode = page->mapping->host;
+    loff_t size;
+
+    //Solo llegan aqui las paginas de datos dentro del inodo modificadas con mmap
+    if(assoofs_has_inline_data(ASSOOFS_I(inode))){
+        size = i_size_read(inode);
+        if(page->index == 0)
+            assoofs_write_inline_page(inode, page, min_t(loff_t, size, ASSOOFS_INLINE_DATA_MAX));
+        unlock_page(page);
+        return 0;
+    }
+    return block_write_full_page(page, assoofs_get_block, wbc);
+}
+
+/**
+ * Escribe en disco las paginas sucias de un fichero
+ */
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc){
+    //mpage escribiria los buffers retrasados en su bloque ficticio, asi que
+    //vamos pagina a pagina; las rachas contiguas se juntan en el plug
+    return generic_writepages(mapping, wbc);
+}
+
+/**
+ * Prepara una pagina para copiar en ella los datos de una escritura
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata){
+    struct inode *inode = mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct page *page;
+    int ret;
+
+    if(assoofs_has_inline_data(ai)){
+        //Mientras quepa, la escritura se hace sobre la pagina 0 y se copia al inodo en write_end
+        if(pos + len <= ASSOOFS_INLINE_DATA_MAX){
+            page = grab_cache_page_write_begin(mapping, 0, flags);
+            if(!page)
+                return -ENOMEM;
+            if(!PageUptodate(page))
+                assoofs_read_inline_page(ai, page);
+            *pagep = page;
+            return 0;
+        }
+        ret = assoofs_convert_inline_data(inode, flags);
+        if(ret)
+            return ret;
+    }
+
+    ret = block_write_begin(mapping, pos, len, flags, pagep, assoofs_get_block_prep);
+    //Si falla descartamos lo que se haya quedado en cache mas alla del final
+    if(ret < 0 && pos + len > inode->i_size)
+        truncate_pagecache(inode, inode->i_size);
+    return ret;
+}
+
+/**
+ * Termina una escritura en una pagina y actualiza el tamaño del fichero
+ * @return numero de bytes copiados
+ */
+static int assoofs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata){
+    struct inode *inode = mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret;
+    unsigned int nofs;
+
+    if(assoofs_has_inline_data(ai)){
+        //La pagina ya estaba actualizada, asi que una copia corta no deja basura
+        if(pos + copied > inode->i_size)
+            i_size_write(inode, pos + copied);
+        assoofs_write_inline_page(inode, page, inode->i_size);
+        unlock_page(page);
+        put_page(page);
+        return copied;
+    }
+
+    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+
+    //Guardamos el nuevo tamaño si la escritura ha hecho crecer el fichero
+    if(inode->i_size != READ_ONCE(ai->info.file_size)){
+        nofs = assoofs_journal_start(inode->i_sb, 1);
+        down_write(&ai->data_sem);
+        ai->info.file_size = inode->i_size;
+        assoofs_save_inode_info(inode->i_sb, &ai->info);
+        up_write(&ai->data_sem);
+        assoofs_journal_stop(inode->i_sb, 1, nofs);
+    }
+    return ret;
+}
+
+/**
+ * Escribe las paginas sucias de un fichero para que sus bloques retrasados
+ * tengan numero antes de consultar los tramos
+ * @param mapping cache de paginas del fichero
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_flush_delayed(struct address_space *mapping){
+    if(!mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+        return 0;
+    return filemap_write_and_wait(mapping);
+}
+
+/**
+ * Traduce un bloque logico a bloque fisico (ioctl FIBMAP)
+ */
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block){
+    assoofs_flush_delayed(mapping);
+    return generic_block_bmap(mapping, block, assoofs_get_block);
+}
+
 /*
- *  Operaciones sobre inodos
+ *  E/S directa, fiemap y SEEK_HOLE/SEEK_DATA a traves de iomap. La E/S con
+ *  cache sigue usando buffer_heads porque la asignacion retrasada depende
+ *  de los buffers retrasados.
  */
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
-static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
 
-static struct inode_operations assoofs_inode_ops = {
-    .create = assoofs_create,
-    .lookup = assoofs_lookup,
-    .mkdir = assoofs_mkdir,
+/**
+ * Direccion en bytes dentro del dispositivo de los datos de un fichero que
+ * los guarda dentro de su inodo
+ */
+static u64 assoofs_inline_data_addr(struct super_block *sb, uint64_t inode_no){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    u64 block = sbi->disk_sb->inode_table_block + inode_no / sbi->inodes_per_block;
+
+    return (block << sb->s_blocksize_bits) + (inode_no % sbi->inodes_per_block) * sizeof(struct assoofs_disk_inode) + offsetof(struct assoofs_disk_inode, inline_data);
+}
+
+/**
+ * Describe el tramo de un fichero que contiene pos: bloques en disco, un
+ * hueco o los datos dentro del inodo. En las escrituras directas los huecos
+ * se rellenan asignando bloques seguidos.
+ * @param inode inodo del fichero
+ * @param pos posicion en bytes
+ * @param length longitud en bytes del rango pedido
+ * @param flags IOMAP_WRITE, IOMAP_DIRECT, IOMAP_REPORT...
+ * @param iomap tramo que se rellena
+ * @param srcmap tramo de origen, que assoofs no usa
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned flags, struct iomap *iomap, struct iomap *srcmap){
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    unsigned int blkbits = inode->i_blkbits;
+    uint64_t iblock = pos >> blkbits;
+    uint64_t max = ((pos + length - 1) >> blkbits) - iblock + 1;
+    uint64_t pblock, count;
+    int ret;
+    unsigned int nofs;
+
+    iomap->bdev = sb->s_bdev;
+    iomap->flags = 0;
+
+    if(assoofs_has_inline_data(ai)){
+        //La E/S directa de estos ficheros pasa por la cache de paginas
+        if(!(flags & IOMAP_REPORT))
+            return -ENOTBLK;
+        down_read(&ai->data_sem);
+        if(pos < ai->info.file_size){
+            iomap->type = IOMAP_INLINE;
+            iomap->offset = 0;
+            iomap->length = ai->info.file_size;
+            iomap->addr = assoofs_inline_data_addr(sb, ai->info.inode_no);
+            iomap->inline_data = ai->info.inline_data;
+        }else{
+            iomap->type = IOMAP_HOLE;
+            iomap->offset = pos;
+            iomap->length = length;
+            iomap->addr = IOMAP_NULL_ADDR;
+        }
+        up_read(&ai->data_sem);
+        return 0;
+    }
+
+    down_read(&ai->data_sem);
+    ret = assoofs_map_blocks(sb, &ai->info, iblock, max, &pblock, &count);
+    up_read(&ai->data_sem);
+
+    if(ret == -ENOENT && (flags & IOMAP_WRITE)){
+        nofs = assoofs_journal_start(sb, ASSOOFS_WRITE_CREDITS);
+        down_write(&ai->data_sem);
+        ret = assoofs_map_blocks(sb, &ai->info, iblock, count, &pblock, &count);
+        if(ret == -ENOENT){
+            ret = assoofs_alloc_blocks(sb, &ai->info, iblock, count, 0, &pblock, &count);
+            if(!ret){
+                assoofs_save_inode_info(sb, &ai->info);
+                //iomap pone a cero la parte de los bloques nuevos que no se escribe
+                iomap->flags |= IOMAP_F_NEW;
+            }
+        }
+        up_write(&ai->data_sem);
+        assoofs_journal_stop(sb, ASSOOFS_WRITE_CREDITS, nofs);
+    }
+
+    if(ret == -ENOENT){
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+    }else if(ret){
+        return ret;
+    }else{
+        iomap->type = IOMAP_MAPPED;
+        iomap->addr = pblock << blkbits;
+    }
+    iomap->offset = (loff_t)iblock << blkbits;
+    iomap->length = count << blkbits;
+    return 0;
+}
+
+static const struct iomap_ops assoofs_iomap_ops = {
+    .iomap_begin = assoofs_iomap_begin,
+};
+
+/**
+ * Al terminar una escritura directa guarda el nuevo tamaño si el fichero
+ * ha crecido. En las escrituras asincronas se llama sin el cerrojo del inodo.
+ * @param iocb escritura
+ * @param size bytes escritos
+ * @param error error de la escritura
+ * @param flags flags de iomap
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned int flags){
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    loff_t end = iocb->ki_pos + size;
+    unsigned int nofs;
+
+    if(error)
+        return error;
+    if(end <= i_size_read(inode))
+        return 0;
+
+    nofs = assoofs_journal_start(inode->i_sb, 1);
+    down_write(&ai->data_sem);
+    if(end > i_size_read(inode)){
+        i_size_write(inode, end);
+        ai->info.file_size = end;
+        assoofs_save_inode_info(inode->i_sb, &ai->info);
+    }
+    up_write(&ai->data_sem);
+    assoofs_journal_stop(inode->i_sb, 1, nofs);
+    return 0;
+}
+
+static const struct iomap_dio_ops assoofs_dio_write_ops = {
+    .end_io = assoofs_dio_write_end_io,
 };
 
 /**
- * Permite crear un inodo con la informacion persistente
+ * Lee de un fichero. Con O_DIRECT los datos van del disco al buffer del
+ * usuario sin pasar por la cache de paginas.
+ * @return numero de bytes leidos o un error
+ */
+static ssize_t assoofs_do_read_iter(struct kiocb *iocb, struct iov_iter *to){
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if(!(iocb->ki_flags & IOCB_DIRECT))
+        return generic_file_read_iter(iocb, to);
+    if(!iov_iter_count(to))
+        return 0;
+
+    if(iocb->ki_flags & IOCB_NOWAIT){
+        if(!inode_trylock_shared(inode))
+            return -EAGAIN;
+    }else{
+        inode_lock_shared(inode);
+    }
+    ret = iomap_dio_rw(iocb, to, &assoofs_iomap_ops, NULL, is_sync_kiocb(iocb));
+    inode_unlock_shared(inode);
+
+    //Sin bloques que leer directamente, generic_file_read_iter lee por la cache
+    if(ret == -ENOTBLK)
+        return generic_file_read_iter(iocb, to);
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+/**
+ * Escribe en un fichero. Con O_DIRECT los datos van del buffer del usuario
+ * al disco y los huecos se asignan en el momento, sin asignacion retrasada.
+ * @return numero de bytes escritos o un error
+ */
+static ssize_t assoofs_do_write_iter(struct kiocb *iocb, struct iov_iter *from){
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if(!(iocb->ki_flags & IOCB_DIRECT))
+        return generic_file_write_iter(iocb, from);
+
+    if(iocb->ki_flags & IOCB_NOWAIT){
+        if(!inode_trylock(inode))
+            return -EAGAIN;
+    }else{
+        inode_lock(inode);
+    }
+    ret = generic_write_checks(iocb, from);
+    if(ret <= 0)
+        goto out;
+    ret = file_remove_privs(iocb->ki_filp);
+    if(!ret)
+        ret = file_update_time(iocb->ki_filp);
+    if(!ret)
+        ret = iomap_dio_rw(iocb, from, &assoofs_iomap_ops, &assoofs_dio_write_ops, is_sync_kiocb(iocb));
+out:
+    inode_unlock(inode);
+
+    //Los ficheros con los datos dentro del inodo se escriben por la cache:
+    //con noop_direct_IO generic_file_write_iter pasa a escritura con cache
+    if(ret == -ENOTBLK)
+        return generic_file_write_iter(iocb, from);
+    if(ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+/**
+ * read_iter: lee con assoofs_do_read_iter y lo apunta en las estadisticas
+ * y en el punto de traza assoofs_read
+ */
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to){
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t len = iov_iter_count(to);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = assoofs_do_read_iter(iocb, to);
+    assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_READS);
+    if(ret > 0)
+        assoofs_stat_add(inode->i_sb, ASSOOFS_STAT_READ_BYTES, ret);
+    trace_assoofs_read(inode, pos, len, ret, !!(iocb->ki_flags & IOCB_DIRECT), ktime_get_ns() - start);
+    return ret;
+}
+
+/**
+ * write_iter: escribe con assoofs_do_write_iter y lo apunta en las
+ * estadisticas y en el punto de traza assoofs_write
+ */
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from){
+    struct inode *inode = file_inode(iocb->ki_filp);
+    loff_t pos = iocb->ki_pos;
+    size_t len = iov_iter_count(from);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = assoofs_do_write_iter(iocb, from);
+    assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_WRITES);
+    if(ret > 0)
+        assoofs_stat_add(inode->i_sb, ASSOOFS_STAT_WRITE_BYTES, ret);
+    trace_assoofs_write(inode, pos, len, ret, !!(iocb->ki_flags & IOCB_DIRECT), ktime_get_ns() - start);
+    return ret;
+}
+
+/**
+ * lseek con SEEK_HOLE y SEEK_DATA a partir de los tramos del fichero
+ */
+static loff_t assoofs_file_llseek(struct file *file, loff_t offset, int whence){
+    struct inode *inode = file_inode(file);
+    int ret;
+
+    if(whence != SEEK_HOLE && whence != SEEK_DATA)
+        return generic_file_llseek(file, offset, whence);
+
+    ret = assoofs_flush_delayed(inode->i_mapping);
+    if(ret)
+        return ret;
+    inode_lock_shared(inode);
+    if(whence == SEEK_HOLE)
+        offset = iomap_seek_hole(inode, offset, &assoofs_iomap_ops);
+    else
+        offset = iomap_seek_data(inode, offset, &assoofs_iomap_ops);
+    inode_unlock_shared(inode);
+    if(offset < 0)
+        return offset;
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/**
+ * Lista los tramos de un fichero o directorio (ioctl FS_IOC_FIEMAP)
+ */
+static int assoofs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len){
+    int ret;
+
+    ret = assoofs_flush_delayed(inode->i_mapping);
+    if(ret)
+        return ret;
+    return iomap_fiemap(inode, fieinfo, start, len, &assoofs_iomap_ops);
+}
+
+/**
+ * Devuelve el tramo numero i de un inodo, que puede estar en el propio inodo
+ * o en el bloque de tramos adicionales
+ * @param inode_info informacion persistente del inodo
+ * @param overflow contenido del bloque de tramos adicionales
+ * @param i posicion del tramo
+ * @return puntero al tramo
+ */
+static struct assoofs_extent *assoofs_extent_at(struct assoofs_inode_info *inode_info, struct assoofs_extent *overflow, uint32_t i){
+    if(i < ASSOOFS_INLINE_EXTENTS)
+        return &inode_info->extents[i];
+    return &overflow[i - ASSOOFS_INLINE_EXTENTS];
+}
+
+/**
+ * Traduce un bloque logico de un fichero a su bloque fisico
  * @param sb superbloque
- * @param ino número de inodo en el almacen de inodos
- * @return struct inode con la informacion persistente del inodo numero ino
+ * @param inode_info informacion persistente del inodo
+ * @param iblock bloque logico dentro del fichero
+ * @param pblock bloque fisico correspondiente
+ * @return 0 si el bloque esta asignado, -ENOENT si es un hueco o -EIO
  */
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
-    //Creamos el inodo
-	struct inode *inode;
-    struct assoofs_inode_info *inode_info;
+int assoofs_map_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t *pblock){
+    uint64_t count;
 
-    //Creamos nuevo inodo
-	inode = new_inode(sb);
-	//Usamos la funcion auxiliar para conseguir la informacion del inodo en el almacen de inodos
-	inode_info = assoofs_get_inode_info(sb, ino);
+    return assoofs_map_blocks(sb, inode_info, iblock, 1, pblock, &count);
+}
 
-	//Asignamos las operaciones, el numero de inodo y toda la información al inodo creado
-	if(S_ISDIR(inode_info->mode)){
-		inode->i_fop = &assoofs_dir_operations;
-	}else if(S_ISREG(inode_info->mode)){
-		inode->i_fop = &assoofs_file_operations;
-	}else{
-		printk(KERN_ERR "Unknown inode type. Neither a directory nor a file\n");
-	}
-	inode->i_ino = inode_info->inode_no;
-	inode->i_sb = sb;
-	inode->i_op = &assoofs_inode_ops;
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+/**
+ * Traduce un rango de bloques logicos de un fichero a la racha de bloques
+ * fisicos seguidos que empieza en iblock, para leer de una vez todo lo que
+ * esta contiguo en disco
+ * @param sb superbloque
+ * @param inode_info informacion persistente del inodo
+ * @param iblock primer bloque logico
+ * @param max numero maximo de bloques a traducir
+ * @param pblock bloque fisico de iblock
+ * @param count numero de bloques seguidos a partir de pblock o, si iblock es
+ * un hueco, longitud del hueco
+ * @return 0 si el bloque esta asignado, -ENOENT si es un hueco o -EIO
+ */
+int assoofs_map_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t max, uint64_t *pblock, uint64_t *count){
+    struct buffer_head *bh = NULL;
+    struct assoofs_extent *overflow = NULL;
+    struct assoofs_extent *ext;
+    uint64_t next = 0;
+    uint32_t i;
+    int ret = -ENOENT;
+
+    *count = max;
+    //Solo leemos el bloque de tramos adicionales si el inodo lo usa
+    if(inode_info->extent_count > ASSOOFS_INLINE_EXTENTS){
+        bh = sb_bread(sb, inode_info->extent_block);
+        if(!bh)
+            return -EIO;
+        overflow = (struct assoofs_extent *)bh->b_data;
+    }
+
+    //Los tramos estan ordenados, asi que paramos en cuanto nos pasamos
+    for(i = 0; i < inode_info->extent_count; i++){
+        ext = assoofs_extent_at(inode_info, overflow, i);
+        if(ret == 0){
+            //La racha sigue en el tramo siguiente si tambien sigue en disco
+            if(ext->ee_block != iblock + *count || ext->ee_start != next)
+                break;
+            *count += ext->ee_len;
+        }else{
+            if(iblock < ext->ee_block){
+                *count = ext->ee_block - iblock;
+                break;
+            }
+            if(iblock >= (uint64_t)ext->ee_block + ext->ee_len)
+                continue;
+            *pblock = ext->ee_start + (iblock - ext->ee_block);
+            *count = (uint64_t)ext->ee_len - (iblock - ext->ee_block);
+            ret = 0;
+        }
+        next = ext->ee_start + ext->ee_len;
+        if(*count >= max)
+            break;
+    }
+
+    brelse(bh);
+    *count = min(*count, max);
+    return ret;
+}
+
+/**
+ * Asigna bloques fisicos seguidos a partir del bloque logico iblock de un
+ * fichero, sin pasar del siguiente tramo. Se prefiere el bloque que sigue al
+ * tramo anterior, de modo que el fichero crece sin fragmentarse: si la racha
+ * es contigua se alarga ese tramo y si no se inserta un tramo nuevo.
+ * El llamante debe guardar despues la informacion persistente del inodo.
+ * @param sb superbloque
+ * @param inode_info informacion persistente del inodo
+ * @param iblock bloque logico que no tiene bloque asignado
+ * @param max numero maximo de bloques a asignar
+ * @param reserved si los bloques se apartaron antes con assoofs_bitmap_reserve
+ * @param pblock primer bloque fisico asignado
+ * @param count numero de bloques asignados
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_alloc_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t max, int reserved, uint64_t *pblock, uint64_t *count){
+    struct assoofs_bitmap *bm = &ASSOOFS_SB(sb)->block_bitmap;
+    struct buffer_head *bh = NULL;
+    struct assoofs_extent *overflow = NULL;
+    struct assoofs_extent *ext, *next;
+    uint32_t max_extents = ASSOOFS_INLINE_EXTENTS + sb->s_blocksize / sizeof(struct assoofs_extent);
+    uint32_t pos, i;
+    uint64_t block = 0, goal = U64_MAX;
+    int ret;
+
+    if(iblock >= ASSOOFS_MAX_FILE_BLOCKS)
+        return -EFBIG;
+    max = min(max, ASSOOFS_MAX_FILE_BLOCKS - iblock);
+
+    //Los tramos que no caben en el inodo estan en su bloque de tramos
+    if(inode_info->extent_count >= ASSOOFS_INLINE_EXTENTS && inode_info->extent_block){
+        bh = sb_bread(sb, inode_info->extent_block);
+        if(!bh)
+            return -EIO;
+        overflow = (struct assoofs_extent *)bh->b_data;
+    }
+
+    //Buscamos el primer tramo que empieza despues de iblock
+    for(pos = 0; pos < inode_info->extent_count; pos++){
+        if(assoofs_extent_at(inode_info, overflow, pos)->ee_block > iblock)
+            break;
+    }
+    if(pos < inode_info->extent_count){
+        next = assoofs_extent_at(inode_info, overflow, pos);
+        max = min_t(uint64_t, max, next->ee_block - iblock);
+    }
+    if(pos > 0){
+        ext = assoofs_extent_at(inode_info, overflow, pos - 1);
+        goal = ext->ee_start + ext->ee_len;
+    }
+
+    //El error queda en el tracepoint; con el disco lleno se repite en cada escritura
+    ret = assoofs_bitmap_alloc_range(sb, bm, goal, max, reserved, &block, count);
+    if(ret)
+        goto out;
+
+    //Intentamos alargar el tramo anterior
+    if(pos > 0){
+        ext = assoofs_extent_at(inode_info, overflow, pos - 1);
+        if((uint64_t)ext->ee_block + ext->ee_len == iblock && ext->ee_start + ext->ee_len == block){
+            ext->ee_len += *count;
+            goto done;
+        }
+    }
+
+    if(inode_info->extent_count >= max_extents){
+        ret = -EFBIG;
+        goto out_free;
+    }
+
+    //El quinto tramo es el primero que necesita el bloque de tramos
+    if(inode_info->extent_count >= ASSOOFS_INLINE_EXTENTS && !overflow){
+        ret = assoofs_sb_get_a_freeblock(sb, &inode_info->extent_block);
+        if(ret)
+            goto out_free;
+        bh = sb_getblk(sb, inode_info->extent_block);
+        if(!bh){
+            assoofs_sb_put_a_freeblock(sb, inode_info->extent_block);
+            inode_info->extent_block = 0;
+            ret = -EIO;
+            goto out_free;
+        }
+        wait_on_buffer(bh);
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        overflow = (struct assoofs_extent *)bh->b_data;
+    }
+
+    //Desplazamos los tramos posteriores para dejar sitio al nuevo
+    for(i = inode_info->extent_count; i > pos; i--)
+        *assoofs_extent_at(inode_info, overflow, i) = *assoofs_extent_at(inode_info, overflow, i - 1);
+    ext = assoofs_extent_at(inode_info, overflow, pos);
+    ext->ee_block = iblock;
+    ext->ee_len = *count;
+    ext->ee_start = block;
+    inode_info->extent_count++;
+
+done:
+    if(bh)
+        assoofs_journal_dirty(sb, bh);
+    *pblock = block;
+    assoofs_stat_inc(sb, ASSOOFS_STAT_BLOCK_ALLOCS);
+    assoofs_stat_add(sb, ASSOOFS_STAT_BLOCKS_ALLOCATED, *count);
+    goto out;
+out_free:
+    assoofs_bitmap_free_range(sb, bm, block, *count);
+out:
+    trace_assoofs_alloc_blocks(sb, inode_info->inode_no, iblock, max, block, ret ? 0 : *count, ret);
+    brelse(bh);
+    return ret;
+}
+
+/*
+ *  Directorios indexados por hash
+ */
+struct assoofs_dx_frame {
+    struct buffer_head *bh;
+    struct assoofs_dir_block_header *hdr;
+    struct assoofs_dx_entry *entries;
+    uint16_t pos;
+};
+
+#define assoofs_dir_header(bh) ((struct assoofs_dir_block_header *)(bh)->b_data)
+#define assoofs_dx_entries(bh) ((struct assoofs_dx_entry *)((bh)->b_data + sizeof(struct assoofs_dir_block_header)))
+#define assoofs_dir_records(bh) ((struct assoofs_dir_record_entry *)((bh)->b_data + sizeof(struct assoofs_dir_block_header)))
+#define assoofs_dir_next(record) ((struct assoofs_dir_record_entry *)((char *)(record) + (record)->rec_len))
+#define assoofs_dir_limit(bh) ((struct assoofs_dir_record_entry *)((bh)->b_data + (bh)->b_size))
+
+static inline unsigned int assoofs_dx_capacity(struct super_block *sb){
+    return (sb->s_blocksize - sizeof(struct assoofs_dir_block_header)) / sizeof(struct assoofs_dx_entry);
+}
+
+/**
+ * Deja una hoja vacia: una unica entrada libre que ocupa todo el bloque
+ * @param bh hoja
+ */
+static void assoofs_leaf_init(struct buffer_head *bh){
+    struct assoofs_dir_record_entry *record = assoofs_dir_records(bh);
+
+    assoofs_dir_header(bh)->count = 0;
+    memset(record, 0, sizeof(*record));
+    record->rec_len = bh->b_size - sizeof(struct assoofs_dir_block_header);
+}
+
+/**
+ * Comprueba que las entradas de una hoja se encadenan hasta el final del
+ * bloque y que su numero coincide con el de la cabecera
+ * @param bh hoja
+ * @return 0 si la hoja es correcta o -EUCLEAN
+ */
+static int assoofs_leaf_check(struct buffer_head *bh){
+    struct assoofs_dir_record_entry *record = assoofs_dir_records(bh);
+    struct assoofs_dir_record_entry *limit = assoofs_dir_limit(bh);
+    unsigned int count = 0;
+
+    while(record < limit){
+        if(record->rec_len < ASSOOFS_DIR_REC_LEN(0) || record->rec_len & 3 ||
+           (char *)limit - (char *)record < record->rec_len)
+            return -EUCLEAN;
+        if(record->inode_no){
+            if(!record->name_len || record->rec_len < ASSOOFS_DIR_REC_LEN(record->name_len))
+                return -EUCLEAN;
+            count++;
+        }
+        record = assoofs_dir_next(record);
+    }
+    return count == assoofs_dir_header(bh)->count ? 0 : -EUCLEAN;
+}
+
+/**
+ * Lee un bloque logico de un directorio
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param lblk bloque logico dentro del directorio
+ * @return buffer del bloque o NULL si hay un error
+ */
+static struct buffer_head *assoofs_dir_bread(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t lblk){
+    uint64_t pblock;
+
+    if(assoofs_map_block(sb, dir_info, lblk, &pblock)){
+        printk(KERN_ERR "Bloque %llu del directorio %llu sin asignar\n", lblk, dir_info->inode_no);
+        return NULL;
+    }
+    return sb_bread(sb, pblock);
+}
+
+/**
+ * Añade un bloque vacio al final de un directorio
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param magic tipo de bloque, indice u hoja
+ * @param lblk bloque logico asignado
+ * @return buffer del nuevo bloque o un puntero de error
+ */
+static struct buffer_head *assoofs_dir_new_block(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t magic, uint32_t *lblk){
+    struct assoofs_inode *ai = ASSOOFS_I(assoofs_info_inode(dir_info));
+    struct buffer_head *bh;
+    uint64_t pblock, count;
+    int ret;
+
+    down_write(&ai->data_sem);
+    *lblk = dir_info->file_size / sb->s_blocksize;
+    ret = assoofs_alloc_blocks(sb, dir_info, *lblk, 1, 0, &pblock, &count);
+    if(!ret)
+        dir_info->file_size += sb->s_blocksize;
+    up_write(&ai->data_sem);
+    if(ret)
+        return ERR_PTR(ret);
+
+    bh = sb_getblk(sb, pblock);
+    if(!bh)
+        return ERR_PTR(-EIO);
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    assoofs_dir_header(bh)->magic = magic;
+    if(magic == ASSOOFS_DIR_LEAF_MAGIC)
+        assoofs_leaf_init(bh);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    return bh;
+}
+
+/**
+ * Inicializa un directorio vacio: la raiz del indice y una hoja que cubre
+ * todos los hashes
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_dir_init(struct super_block *sb, struct assoofs_inode_info *dir_info){
+    struct buffer_head *root, *leaf;
+    uint32_t root_lblk, leaf_lblk;
+
+    root = assoofs_dir_new_block(sb, dir_info, ASSOOFS_DIR_INDEX_MAGIC, &root_lblk);
+    if(IS_ERR(root))
+        return PTR_ERR(root);
+    leaf = assoofs_dir_new_block(sb, dir_info, ASSOOFS_DIR_LEAF_MAGIC, &leaf_lblk);
+    if(IS_ERR(leaf)){
+        brelse(root);
+        return PTR_ERR(leaf);
+    }
+
+    assoofs_dir_header(root)->count = 1;
+    assoofs_dx_entries(root)[0].hash = 0;
+    assoofs_dx_entries(root)[0].block = leaf_lblk;
+
+    assoofs_journal_dirty(sb, leaf);
+    brelse(leaf);
+    assoofs_journal_dirty(sb, root);
+    brelse(root);
+    return 0;
+}
+
+/**
+ * Busca en un bloque de indice la ultima entrada con hash menor o igual
+ * @param entries entradas del bloque, ordenadas por hash
+ * @param count numero de entradas
+ * @param hash hash buscado
+ * @return posicion de la entrada
+ */
+static uint16_t assoofs_dx_search(struct assoofs_dx_entry *entries, uint16_t count, uint32_t hash){
+    uint16_t lo = 1, hi = count;
+
+    //La primera entrada cubre desde el hash 0
+    while(lo < hi){
+        uint16_t mid = lo + (hi - lo) / 2;
+        if(entries[mid].hash <= hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/**
+ * Libera los bloques de indice recorridos
+ */
+static void assoofs_dx_release(struct assoofs_dx_frame *frames, int nframes){
+    while(nframes--)
+        brelse(frames[nframes].bh);
+}
+
+/**
+ * Baja por el indice de un directorio hasta la hoja que cubre un hash
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param hash hash del nombre
+ * @param frames bloques de indice recorridos, que el llamante debe liberar
+ * @param nframes numero de bloques de indice recorridos
+ * @return buffer de la hoja o un puntero de error
+ */
+static struct buffer_head *assoofs_dx_probe(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t hash, struct assoofs_dx_frame *frames, int *nframes){
+    struct buffer_head *bh;
+    struct assoofs_dx_frame *frame;
+    uint8_t levels;
+    int level;
+
+    *nframes = 0;
+    bh = assoofs_dir_bread(sb, dir_info, 0);
+    if(!bh)
+        return ERR_PTR(-EIO);
+    levels = assoofs_dir_header(bh)->levels;
+    if(levels > ASSOOFS_DIR_MAX_LEVELS)
+        goto corrupted;
+
+    for(level = 0; ; level++){
+        if(assoofs_dir_header(bh)->magic != ASSOOFS_DIR_INDEX_MAGIC || !assoofs_dir_header(bh)->count)
+            goto corrupted;
+
+        frame = &frames[level];
+        frame->bh = bh;
+        frame->hdr = assoofs_dir_header(bh);
+        frame->entries = assoofs_dx_entries(bh);
+        frame->pos = assoofs_dx_search(frame->entries, frame->hdr->count, hash);
+        *nframes = level + 1;
+
+        bh = assoofs_dir_bread(sb, dir_info, frame->entries[frame->pos].block);
+        if(!bh){
+            assoofs_dx_release(frames, *nframes);
+            return ERR_PTR(-EIO);
+        }
+        if(level == levels)
+            break;
+    }
+
+    if(assoofs_dir_header(bh)->magic != ASSOOFS_DIR_LEAF_MAGIC || assoofs_leaf_check(bh))
+        goto corrupted;
+    return bh;
+
+corrupted:
+    printk(KERN_ERR "Indice del directorio %llu corrupto\n", dir_info->inode_no);
+    brelse(bh);
+    assoofs_dx_release(frames, *nframes);
+    return ERR_PTR(-EUCLEAN);
+}
+
+/**
+ * Busca un nombre en una hoja del directorio
+ * @param bh hoja
+ * @param name nombre
+ * @param len longitud del nombre
+ * @return entrada del directorio o NULL si no esta
+ */
+static struct assoofs_dir_record_entry *assoofs_leaf_find(struct buffer_head *bh, const char *name, unsigned int len){
+    struct assoofs_dir_record_entry *record = assoofs_dir_records(bh);
+    struct assoofs_dir_record_entry *limit = assoofs_dir_limit(bh);
+
+    for(; record < limit; record = assoofs_dir_next(record)){
+        if(record->inode_no && record->name_len == len && !memcmp(record->filename, name, len))
+            return record;
+    }
+    return NULL;
+}
+
+/**
+ * Añade una entrada a una hoja, en una entrada libre o en el hueco que queda
+ * detras de una ocupada
+ * @param bh hoja
+ * @param name nombre
+ * @param len longitud del nombre
+ * @param inode_no numero de inodo
+ * @param file_type tipo de fichero
+ * @return 0 si todo sale bien o -ENOSPC si no cabe en la hoja
+ */
+static int assoofs_leaf_insert(struct buffer_head *bh, const char *name, unsigned int len, uint64_t inode_no, uint8_t file_type){
+    struct assoofs_dir_record_entry *record = assoofs_dir_records(bh);
+    struct assoofs_dir_record_entry *limit = assoofs_dir_limit(bh);
+    struct assoofs_dir_record_entry *slot;
+    unsigned int need = ASSOOFS_DIR_REC_LEN(len), used;
+
+    for(; record < limit; record = assoofs_dir_next(record)){
+        if(!record->inode_no){
+            if(record->rec_len >= need)
+                break;
+            continue;
+        }
+        used = ASSOOFS_DIR_REC_LEN(record->name_len);
+        if(record->rec_len >= used + need){
+            //Partimos la entrada: el hueco de detras pasa a ser la nueva
+            slot = (struct assoofs_dir_record_entry *)((char *)record + used);
+            slot->rec_len = record->rec_len - used;
+            record->rec_len = used;
+            record = slot;
+            break;
+        }
+    }
+    if(record >= limit)
+        return -ENOSPC;
+
+    record->name_len = len;
+    record->file_type = file_type;
+    record->inode_no = inode_no;
+    memcpy(record->filename, name, len);
+    assoofs_dir_header(bh)->count++;
+    return 0;
+}
+
+static int assoofs_hash_cmp(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Elige el hash por el que partir una hoja llena: el de la mediana, o el mas
+ * cercano a ella que no deje el mismo hash a ambos lados del corte
+ * @param bh hoja
+ * @param split_hash hash a partir del cual las entradas van a la hoja nueva
+ * @return 0 si todo sale bien o -ENOSPC si todas las entradas tienen el mismo hash
+ */
+static int assoofs_leaf_split_point(struct buffer_head *bh, uint32_t *split_hash){
+    struct assoofs_dir_record_entry *record = assoofs_dir_records(bh);
+    struct assoofs_dir_record_entry *limit = assoofs_dir_limit(bh);
+    uint16_t count = assoofs_dir_header(bh)->count;
+    uint32_t *hashes;
+    int i, d;
+
+    hashes = kmalloc_array(count, sizeof(uint32_t), GFP_KERNEL);
+    if(!hashes)
+        return -ENOMEM;
+    for(i = 0; record < limit; record = assoofs_dir_next(record)){
+        if(record->inode_no)
+            hashes[i++] = assoofs_name_hash(record->filename, record->name_len);
+    }
+    sort(hashes, count, sizeof(uint32_t), assoofs_hash_cmp, NULL);
+
+    for(d = 0; d < count; d++){
+        i = count / 2 + ((d & 1) ? -(d + 1) / 2 : d / 2);
+        if(i > 0 && i < count && hashes[i - 1] != hashes[i]){
+            *split_hash = hashes[i];
+            kfree(hashes);
+            return 0;
+        }
+    }
+    kfree(hashes);
+    return -ENOSPC;
+}
+
+/**
+ * Reparte las entradas de una hoja llena entre ella y una hoja nueva: las de
+ * hash mayor o igual que split_hash van a la nueva. Las dos hojas quedan
+ * compactadas.
+ * @param old hoja llena
+ * @param new hoja vacia
+ * @param split_hash hash del corte
+ * @param copy copia de la hoja llena, del tamaño de un bloque
+ */
+static void assoofs_leaf_move(struct buffer_head *old, struct buffer_head *new, uint32_t split_hash, char *copy){
+    struct assoofs_dir_record_entry *record, *limit;
+
+    memcpy(copy, old->b_data, old->b_size);
+    record = (struct assoofs_dir_record_entry *)(copy + sizeof(struct assoofs_dir_block_header));
+    limit = (struct assoofs_dir_record_entry *)(copy + old->b_size);
+
+    memset(assoofs_dir_records(old), 0, old->b_size - sizeof(struct assoofs_dir_block_header));
+    assoofs_leaf_init(old);
+    for(; record < limit; record = assoofs_dir_next(record)){
+        if(!record->inode_no)
+            continue;
+        //Las entradas ya cabian en un bloque, asi que caben compactadas
+        assoofs_leaf_insert(assoofs_name_hash(record->filename, record->name_len) >= split_hash ? new : old,
+                            record->filename, record->name_len, record->inode_no, record->file_type);
+    }
+}
+
+/**
+ * Inserta una entrada (hash, bloque) en un bloque de indice detras de la posicion seguida
+ */
+static void assoofs_dx_insert(struct assoofs_dx_frame *frame, uint32_t hash, uint32_t block){
+    struct assoofs_dx_entry *at = frame->entries + frame->pos + 1;
+
+    memmove(at + 1, at, (frame->hdr->count - frame->pos - 1) * sizeof(*at));
+    at->hash = hash;
+    at->block = block;
+    frame->hdr->count++;
+}
+
+/**
+ * Hace sitio en el ultimo bloque de indice recorrido. Si es la raiz, sus
+ * entradas bajan a un bloque de indice nuevo y el arbol crece un nivel; si
+ * es un bloque intermedio, se parte en dos y la mitad superior se cuelga de
+ * la raiz. Los bloques de indice que se quedan en frames los apunta en el
+ * journal el llamante.
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param frames bloques de indice recorridos
+ * @param nframes numero de bloques de indice recorridos
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_dx_grow(struct super_block *sb, struct assoofs_inode_info *dir_info, struct assoofs_dx_frame *frames, int *nframes){
+    struct assoofs_dx_frame *root = &frames[0];
+    struct assoofs_dx_frame *node;
+    struct buffer_head *bh;
+    uint32_t lblk, split_hash;
+    uint16_t half;
+
+    if(*nframes == 1){
+        bh = assoofs_dir_new_block(sb, dir_info, ASSOOFS_DIR_INDEX_MAGIC, &lblk);
+        if(IS_ERR(bh))
+            return PTR_ERR(bh);
+        memcpy(assoofs_dx_entries(bh), root->entries, root->hdr->count * sizeof(struct assoofs_dx_entry));
+        assoofs_dir_header(bh)->count = root->hdr->count;
+
+        node = &frames[1];
+        node->bh = bh;
+        node->hdr = assoofs_dir_header(bh);
+        node->entries = assoofs_dx_entries(bh);
+        node->pos = root->pos;
+
+        root->hdr->levels = 1;
+        root->hdr->count = 1;
+        root->entries[0].hash = 0;
+        root->entries[0].block = lblk;
+        root->pos = 0;
+        *nframes = 2;
+        return 0;
+    }
+
+    if(root->hdr->count >= assoofs_dx_capacity(sb)){
+        printk(KERN_ERR "El indice del directorio %llu esta lleno\n", dir_info->inode_no);
+        return -ENOSPC;
+    }
+
+    node = &frames[1];
+    bh = assoofs_dir_new_block(sb, dir_info, ASSOOFS_DIR_INDEX_MAGIC, &lblk);
+    if(IS_ERR(bh))
+        return PTR_ERR(bh);
+    half = node->hdr->count / 2;
+    split_hash = node->entries[half].hash;
+    memcpy(assoofs_dx_entries(bh), node->entries + half, (node->hdr->count - half) * sizeof(struct assoofs_dx_entry));
+    assoofs_dir_header(bh)->count = node->hdr->count - half;
+    node->hdr->count = half;
+    assoofs_dx_insert(root, split_hash, lblk);
+    assoofs_journal_dirty(sb, node->bh);
+    assoofs_journal_dirty(sb, bh);
+
+    //Seguimos por la mitad que contiene la posicion recorrida
+    if(node->pos >= half){
+        brelse(node->bh);
+        node->bh = bh;
+        node->hdr = assoofs_dir_header(bh);
+        node->entries = assoofs_dx_entries(bh);
+        node->pos -= half;
+        root->pos++;
+    }else{
+        brelse(bh);
+    }
+    return 0;
+}
+
+/**
+ * Busca un nombre en un directorio
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param name nombre
+ * @param inode_no numero de inodo de la entrada
+ * @return 0 si se encuentra, -ENOENT si no esta o un error
+ */
+static int assoofs_dir_find_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, uint64_t *inode_no){
+    struct assoofs_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    struct assoofs_dir_record_entry *record;
+    struct buffer_head *leaf;
+    unsigned int len = strlen(name);
+    int nframes, ret = -ENOENT;
+
+    leaf = assoofs_dx_probe(sb, dir_info, assoofs_name_hash(name, len), frames, &nframes);
+    if(IS_ERR(leaf))
+        return PTR_ERR(leaf);
+
+    record = assoofs_leaf_find(leaf, name, len);
+    if(record){
+        *inode_no = record->inode_no;
+        ret = 0;
+    }
+
+    brelse(leaf);
+    assoofs_dx_release(frames, nframes);
+    return ret;
+}
+
+/**
+ * Añade una entrada a un directorio en la hoja que le corresponde por hash,
+ * partiendo la hoja si esta llena. Se llama dentro de un manejador del journal.
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param name nombre de la entrada
+ * @param inode_no numero de inodo de la entrada
+ * @param mode modo del inodo de la entrada
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_dir_add_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, uint64_t inode_no, umode_t mode){
+    struct assoofs_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    struct buffer_head *leaf, *new_leaf;
+    uint8_t file_type = assoofs_mode_to_ftype(mode);
+    unsigned int len = strlen(name);
+    uint32_t hash, split_hash, lblk;
+    char *copy = NULL;
+    int nframes, i, ret, resplit;
+
+    if(len > ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+    if(inode_no > U32_MAX)
+        return -EOVERFLOW;
+
+    hash = assoofs_name_hash(name, len);
+retry:
+    new_leaf = NULL;
+    resplit = 0;
+    leaf = assoofs_dx_probe(sb, dir_info, hash, frames, &nframes);
+    if(IS_ERR(leaf)){
+        kfree(copy);
+        return PTR_ERR(leaf);
+    }
+
+    if(assoofs_leaf_find(leaf, name, len)){
+        ret = -EEXIST;
+        goto out;
+    }
+
+    ret = assoofs_leaf_insert(leaf, name, len, inode_no, file_type);
+    if(ret != -ENOSPC)
+        goto out;
+
+    //La hoja esta llena: hacemos sitio en el indice y la partimos en dos
+    ret = assoofs_leaf_split_point(leaf, &split_hash);
+    if(ret)
+        goto out;
+    if(!copy){
+        copy = kmalloc(sb->s_blocksize, GFP_KERNEL);
+        if(!copy){
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    //Al crecer la raiz sus entradas bajan a un bloque igual de lleno, que luego se parte
+    while(frames[nframes - 1].hdr->count >= assoofs_dx_capacity(sb)){
+        ret = assoofs_dx_grow(sb, dir_info, frames, &nframes);
+        if(ret)
+            goto out;
+    }
+
+    new_leaf = assoofs_dir_new_block(sb, dir_info, ASSOOFS_DIR_LEAF_MAGIC, &lblk);
+    if(IS_ERR(new_leaf)){
+        ret = PTR_ERR(new_leaf);
+        new_leaf = NULL;
+        goto out;
+    }
+    assoofs_leaf_move(leaf, new_leaf, split_hash, copy);
+    assoofs_dx_insert(&frames[nframes - 1], split_hash, lblk);
+
+    //Con nombres largos la mitad que le toca puede seguir sin sitio y hay que volver a partir
+    ret = assoofs_leaf_insert(hash >= split_hash ? new_leaf : leaf, name, len, inode_no, file_type);
+    if(ret == -ENOSPC){
+        resplit = 1;
+        ret = 0;
+    }
+
+out:
+    //Tambien si hay error, porque los bloques pueden haber cambiado antes del fallo
+    assoofs_journal_dirty(sb, leaf);
+    if(new_leaf)
+        assoofs_journal_dirty(sb, new_leaf);
+    for(i = 0; i < nframes; i++)
+        assoofs_journal_dirty(sb, frames[i].bh);
+    brelse(new_leaf);
+    brelse(leaf);
+    assoofs_dx_release(frames, nframes);
+    if(resplit)
+        goto retry;
+    kfree(copy);
+    return ret;
+}
+
+/**
+ * Borra una entrada de un directorio sin mover las demas: su hueco se suma a
+ * la entrada anterior de la hoja o, si es la primera, queda como entrada
+ * libre, y assoofs_leaf_insert lo reutiliza despues. Se llama dentro de un
+ * manejador del journal.
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param name nombre de la entrada
+ * @return 0 si todo sale bien, -ENOENT si no esta o un error
+ */
+static int assoofs_dir_delete_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name){
+    struct assoofs_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    struct assoofs_dir_record_entry *record, *prev = NULL, *limit;
+    struct buffer_head *leaf;
+    unsigned int len = strlen(name);
+    int nframes, ret = -ENOENT;
+
+    leaf = assoofs_dx_probe(sb, dir_info, assoofs_name_hash(name, len), frames, &nframes);
+    if(IS_ERR(leaf))
+        return PTR_ERR(leaf);
+
+    limit = assoofs_dir_limit(leaf);
+    for(record = assoofs_dir_records(leaf); record < limit; prev = record, record = assoofs_dir_next(record)){
+        if(!record->inode_no || record->name_len != len || memcmp(record->filename, name, len))
+            continue;
+        if(prev)
+            prev->rec_len += record->rec_len;
+        else
+            record->inode_no = 0;
+        assoofs_dir_header(leaf)->count--;
+        assoofs_journal_dirty(sb, leaf);
+        ret = 0;
+        break;
+    }
+
+    brelse(leaf);
+    assoofs_dx_release(frames, nframes);
+    return ret;
+}
+
+/**
+ * Cambia en su sitio el inodo al que apunta una entrada de un directorio
+ * @param sb superbloque
+ * @param dir_info informacion persistente del directorio
+ * @param name nombre de la entrada
+ * @param inode_no nuevo numero de inodo
+ * @param mode modo del nuevo inodo
+ * @return 0 si todo sale bien, -ENOENT si no esta o un error
+ */
+static int assoofs_dir_set_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, uint64_t inode_no, umode_t mode){
+    struct assoofs_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    struct assoofs_dir_record_entry *record;
+    struct buffer_head *leaf;
+    unsigned int len = strlen(name);
+    int nframes, ret = -ENOENT;
+
+    leaf = assoofs_dx_probe(sb, dir_info, assoofs_name_hash(name, len), frames, &nframes);
+    if(IS_ERR(leaf))
+        return PTR_ERR(leaf);
+
+    record = assoofs_leaf_find(leaf, name, len);
+    if(record){
+        record->inode_no = inode_no;
+        record->file_type = assoofs_mode_to_ftype(mode);
+        assoofs_journal_dirty(sb, leaf);
+        ret = 0;
+    }
+
+    brelse(leaf);
+    assoofs_dx_release(frames, nframes);
+    return ret;
+}
+
+/*
+ *  Operaciones sobre directorios
+ */
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
+static loff_t assoofs_dir_llseek(struct file *file, loff_t offset, int whence);
+const struct file_operations assoofs_dir_operations = {
+    .owner = THIS_MODULE,
+    .llseek = assoofs_dir_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = assoofs_iterate,
+    .fsync = assoofs_fsync,
+};
+
+/**
+ * Traduce el tipo de fichero guardado en una entrada de directorio al tipo
+ * que espera dir_emit
+ */
+static inline unsigned char assoofs_ftype_to_dt(uint8_t file_type){
+    switch(file_type){
+    case ASSOOFS_FT_REG_FILE:
+        return DT_REG;
+    case ASSOOFS_FT_DIR:
+        return DT_DIR;
+    default:
+        return DT_UNKNOWN;
+    }
+}
+
+static int assoofs_block_cmp(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Entrada de una hoja en el orden en que la devuelve readdir
+ */
+struct assoofs_dir_pos_entry {
+    uint32_t hash;
+    struct assoofs_dir_record_entry *record;
+};
+
+static int assoofs_dir_pos_cmp(const void *a, const void *b){
+    const struct assoofs_dir_pos_entry *x = a, *y = b;
+    int ret;
+
+    if(x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    ret = memcmp(x->record->filename, y->record->filename, min(x->record->name_len, y->record->name_len));
+    return ret ? ret : (int)x->record->name_len - (int)y->record->name_len;
+}
+
+/**
+ * Lanza la lectura anticipada de los bloques de la tabla de inodos que
+ * tienen los inodos de las entradas que faltan por devolver de una hoja,
+ * para que el stat que suele seguir a readdir los encuentre ya en memoria.
+ * Los bloques se piden ordenados y sin repetir, y el plug junta los que son
+ * contiguos.
+ * @param sb superbloque
+ * @param ents entradas que faltan por devolver
+ * @param count numero de entradas
+ */
+static void assoofs_dir_readahead_inodes(struct super_block *sb, struct assoofs_dir_pos_entry *ents, unsigned int count){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t blocks[ASSOOFS_DIR_RA_BLOCKS];
+    struct blk_plug plug;
+    unsigned int i, n = 0;
+
+    for(i = 0; i < count && n < ASSOOFS_DIR_RA_BLOCKS; i++){
+        //Un numero fuera de la tabla lo rechaza iget; aqui solo no se lee
+        if(ents[i].record->inode_no >= sbi->disk_sb->inodes_total)
+            continue;
+        blocks[n] = sbi->disk_sb->inode_table_block + ents[i].record->inode_no / sbi->inodes_per_block;
+        if(!n || blocks[n] != blocks[n - 1])
+            n++;
+    }
+    sort(blocks, n, sizeof(uint64_t), assoofs_block_cmp, NULL);
+
+    blk_start_plug(&plug);
+    for(i = 0; i < n; i++)
+        if(!i || blocks[i] != blocks[i - 1])
+            sb_breadahead(sb, blocks[i]);
+    blk_finish_plug(&plug);
+}
+
+/**
+ * Devuelve las entradas de la hoja que cubre la posicion de ctx, desde esa
+ * posicion y en orden de hash y nombre, y deja ctx apuntando al principio de
+ * la hoja siguiente o al final del directorio
+ * @param filp directorio
+ * @param ctx contexto
+ * @return 1 si hay que seguir con la hoja siguiente, 0 si no o un error
+ */
+static int assoofs_iterate_leaf(struct file *filp, struct dir_context *ctx){
+    struct inode *inode = file_inode(filp);
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    struct assoofs_dir_record_entry *record, *limit;
+    struct assoofs_dir_pos_entry *ents;
+    uint32_t hash = ASSOOFS_DIR_POS_HASH(ctx->pos);
+    uint32_t skip = ASSOOFS_DIR_POS_MINOR(ctx->pos);
+    uint32_t minor = 0;
+    loff_t next = ASSOOFS_DIR_EOF;
+    struct buffer_head *bh;
+    unsigned int i, n = 0;
+    int nframes, level;
+
+    bh = assoofs_dx_probe(sb, &ASSOOFS_I(inode)->info, hash, frames, &nframes);
+    if(IS_ERR(bh))
+        return PTR_ERR(bh);
+    //La hoja siguiente empieza en el hash de la siguiente entrada del indice, en el nivel mas bajo que la tenga
+    for(level = nframes - 1; level >= 0; level--){
+        if(frames[level].pos + 1 < frames[level].hdr->count){
+            next = ASSOOFS_DIR_POS(frames[level].entries[frames[level].pos + 1].hash, 0);
+            break;
+        }
+    }
+    assoofs_dx_release(frames, nframes);
+
+    ents = kmalloc_array(max_t(uint16_t, assoofs_dir_header(bh)->count, 1), sizeof(*ents), GFP_KERNEL);
+    if(!ents){
+        brelse(bh);
+        return -ENOMEM;
+    }
+    limit = assoofs_dir_limit(bh);
+    for(record = assoofs_dir_records(bh); record < limit && n < assoofs_dir_header(bh)->count; record = assoofs_dir_next(record)){
+        if(!record->inode_no)
+            continue;
+        ents[n].hash = assoofs_name_hash(record->filename, record->name_len);
+        ents[n].record = record;
+        if(ents[n].hash >= hash)
+            n++;
+    }
+    sort(ents, n, sizeof(*ents), assoofs_dir_pos_cmp, NULL);
+    assoofs_dir_readahead_inodes(sb, ents, n);
+
+    for(i = 0; i < n; i++){
+        minor = i && ents[i].hash == ents[i - 1].hash ? minor + 1 : 0;
+        if(ents[i].hash == hash && minor < skip)
+            continue;
+        record = ents[i].record;
+        ctx->pos = ASSOOFS_DIR_POS(ents[i].hash, minor);
+        if(!dir_emit(ctx, record->filename, record->name_len, record->inode_no, assoofs_ftype_to_dt(record->file_type))){
+            kfree(ents);
+            brelse(bh);
+            return 0;
+        }
+    }
+    kfree(ents);
+    brelse(bh);
+    ctx->pos = next;
+    return next != ASSOOFS_DIR_EOF;
+}
+
+/**
+ * Permite mostrar el contenido de un directorio. Despues de . y .., las
+ * entradas salen hoja a hoja en orden de hash, y la posicion de cada una es
+ * su hash, asi que la siguiente llamada sigue donde se quedo la anterior
+ * aunque entre medias se hayan partido o compactado hojas.
+ * @param filp directorio
+ * @param ctx contexto
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_do_iterate(struct file *filp, struct dir_context *ctx) {
+
+    struct inode *inode;
+    struct assoofs_inode_info *inode_info;
+    int ret;
+
+    //Accedemos al inodo y cogemos la parte persistente
+    inode = file_inode(filp);
+    inode_info = &ASSOOFS_I(inode)->info;
+
+    //Si el archivo no es un directorio
+    if(!(S_ISDIR(inode_info->mode))){
+	    return -ENOTDIR;
+    }
+
+    if(!dir_emit_dots(filp, ctx))
+        return 0;
+
+    //Recorremos las hojas del directorio en orden de hash
+    while(ctx->pos <= ASSOOFS_DIR_POS_LAST){
+        ret = assoofs_iterate_leaf(filp, ctx);
+        if(ret <= 0)
+            return ret;
+    }
+    return 0;
+}
+
+/**
+ * Mueve la posicion de un directorio. Las posiciones son hashes, asi que el
+ * final no es el tamaño del directorio sino ASSOOFS_DIR_EOF.
+ * @param file directorio
+ * @param offset desplazamiento
+ * @param whence desde donde se cuenta
+ * @return nueva posicion o un error
+ */
+static loff_t assoofs_dir_llseek(struct file *file, loff_t offset, int whence){
+    return generic_file_llseek_size(file, offset, whence, ASSOOFS_DIR_EOF, ASSOOFS_DIR_EOF);
+}
+
+/**
+ * iterate_shared: recorre el directorio con assoofs_do_iterate y lo apunta
+ * en las estadisticas y en el punto de traza assoofs_iterate
+ */
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
+    struct inode *inode = file_inode(filp);
+    loff_t pos = ctx->pos;
+    u64 start = ktime_get_ns();
+    int ret;
+
+    ret = assoofs_do_iterate(filp, ctx);
+    assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_READDIRS);
+    trace_assoofs_iterate(inode, pos, ctx->pos, ret, ktime_get_ns() - start);
+    return ret;
+}
+
+/*
+ *  Operaciones sobre inodos
+ */
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info);
+static struct inode *assoofs_iget(struct super_block *sb, uint64_t ino);
+static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+static int assoofs_create_locked(struct inode *dir, struct dentry *dentry, umode_t mode);
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
+static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_mkdir_locked(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry);
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry);
+static int assoofs_unlink_locked(struct inode *dir, struct dentry *dentry);
+static int assoofs_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags);
+static int assoofs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len);
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr);
+
+static struct inode_operations assoofs_inode_ops = {
+    .create = assoofs_create,
+    .lookup = assoofs_lookup,
+    .mkdir = assoofs_mkdir,
+    .unlink = assoofs_unlink,
+    .rmdir = assoofs_rmdir,
+    .rename = assoofs_rename,
+    .fiemap = assoofs_fiemap,
+    .setattr = assoofs_setattr,
+};
+
+/**
+ * Devuelve el inodo numero ino. Si ya esta en la cache de inodos no se accede
+ * a disco; si no, se reserva del slab y se rellena con la informacion
+ * persistente de la tabla de inodos.
+ * @param sb superbloque
+ * @param ino número de inodo en el almacen de inodos
+ * @return struct inode con la informacion persistente del inodo numero ino o un puntero de error
+ */
+static struct inode *assoofs_iget(struct super_block *sb, uint64_t ino){
+	struct inode *inode;
+	struct assoofs_inode_info *inode_info;
+	int ret;
+
+	//Los numeros salen de entradas de directorio, que pueden estar corruptas
+	if(ino < ASSOOFS_ROOTDIR_INODE_NUMBER || ino >= ASSOOFS_SB(sb)->disk_sb->inodes_total){
+		printk(KERN_ERR "assoofs: numero de inodo %llu fuera de la tabla\n", ino);
+		return ERR_PTR(-EUCLEAN);
+	}
+
+	inode = iget_locked(sb, ino);
+	if(!inode)
+		return ERR_PTR(-ENOMEM);
+	if(!(inode->i_state & I_NEW)){
+		assoofs_stat_inc(sb, ASSOOFS_STAT_ICACHE_HITS);
+		trace_assoofs_iget(sb, ino, 1);
+		return inode;
+	}
+	assoofs_stat_inc(sb, ASSOOFS_STAT_ICACHE_MISSES);
+	trace_assoofs_iget(sb, ino, 0);
+
+	//Usamos la funcion auxiliar para conseguir la informacion del inodo en el almacen de inodos
+	inode_info = &ASSOOFS_I(inode)->info;
+	ret = assoofs_get_inode_info(sb, ino, inode_info);
+	if(ret){
+		iget_failed(inode);
+		return ERR_PTR(ret);
+	}
+
+	//Asignamos las operaciones y toda la información al inodo
+	inode->i_mode = inode_info->mode;
+	i_uid_write(inode, inode_info->uid);
+	i_gid_write(inode, inode_info->gid);
+	set_nlink(inode, inode_info->links_count);
+	inode->i_atime.tv_sec = inode_info->atime.sec;
+	inode->i_atime.tv_nsec = inode_info->atime.nsec;
+	inode->i_mtime.tv_sec = inode_info->mtime.sec;
+	inode->i_mtime.tv_nsec = inode_info->mtime.nsec;
+	inode->i_ctime.tv_sec = inode_info->ctime.sec;
+	inode->i_ctime.tv_nsec = inode_info->ctime.nsec;
+	if(S_ISDIR(inode_info->mode)){
+		inode->i_fop = &assoofs_dir_operations;
+	}else if(S_ISREG(inode_info->mode)){
+		inode->i_fop = &assoofs_file_operations;
+		inode->i_mapping->a_ops = &assoofs_aops;
+	}else{
+		printk(KERN_ERR "Unknown inode type. Neither a directory nor a file\n");
+		iget_failed(inode);
+		return ERR_PTR(-EUCLEAN);
+	}
+	inode->i_size = inode_info->file_size;
+	inode->i_op = &assoofs_inode_ops;
+
+	unlock_new_inode(inode);
+	return inode;
+}
+
+/**
+ * Busca la entrada con el nombre (child_dentry->d_name.name) en el
+ * directorio padre.
+ * @param parent_inode contiene la informacion del directorio padre
+ * @param child_dentry contiene la informacion de la entrada que se busca en el directorio padre
+ * @param flags
+ * @return NULL en cualquier caso
+ */
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+
+    struct assoofs_inode_info *parent_info = &ASSOOFS_I(parent_inode)->info;
+    struct super_block *sb = parent_inode->i_sb;
+    u64 start = ktime_get_ns();
+    uint64_t ino = 0;
+    int ret;
+
+    assoofs_stat_inc(sb, ASSOOFS_STAT_LOOKUPS);
+    //Buscamos en el indice del directorio la hoja que corresponde al nombre
+    ret = assoofs_dir_find_entry(sb, parent_info, child_dentry->d_name.name, &ino);
+    if(ret == 0){
+	    struct inode *inode = assoofs_iget(sb, ino);
+	    if(IS_ERR(inode))
+		    ret = PTR_ERR(inode);
+	    else
+		    d_add(child_dentry, inode);
+    }else if(ret == -ENOENT){
+	    assoofs_stat_inc(sb, ASSOOFS_STAT_LOOKUP_MISSES);
+    }
+    trace_assoofs_lookup(parent_inode, child_dentry, ino, ret, ktime_get_ns() - start);
+    if(ret && ret != -ENOENT)
+	    return ERR_PTR(ret);
+    return NULL;
+}
+
+/**
+ * Mete un inodo recien creado en la cache de inodos, bloqueado hasta que se
+ * instancia su entrada. insert_inode_locked no espera a los inodos que se
+ * estan sacando de memoria, se los salta, y un numero solo vuelve al mapa de
+ * bits cuando su inodo borrado ya no toca su registro, asi que solo choca con
+ * un inodo vivo si el mapa de bits esta mal. En ese caso el bit se deja
+ * puesto, porque el numero esta en uso.
+ * @param inode inodo nuevo, sin entrada ni registro en disco
+ * @return 0 si todo sale bien o -EIO
+ */
+static int assoofs_insert_new_inode(struct inode *inode){
+    if(insert_inode_locked(inode) < 0){
+	    printk(KERN_ERR "assoofs: el inodo %lu esta libre en el mapa de bits pero en uso\n", inode->i_ino);
+	    iput(inode);
+	    return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * Permite crear inodos para archivos
+ * @param dir inodo del directorio
+ * @param dentry entrada del nuevo archivo
+ * @param mode modo del nuevo archivo
+ * @param excl
+ * @return 0 si todo salio bien o sino devuelve un error
+ */
+static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    struct super_block *sb;
+    u64 start = ktime_get_ns();
+    int ret;
+    unsigned int nofs;
+
+    //Obtenemos un puntero al superbloque desde el directorio
+    sb = dir->i_sb;
+    //Toda la operacion va en una transaccion del journal
+    nofs = assoofs_journal_start(sb, ASSOOFS_CREATE_CREDITS);
+    ret = assoofs_create_locked(dir, dentry, mode);
+    assoofs_journal_stop(sb, ASSOOFS_CREATE_CREDITS, nofs);
+    if(!ret && IS_DIRSYNC(dir))
+	    ret = assoofs_journal_commit(sb, READ_ONCE(ASSOOFS_SB(sb)->journal.sequence));
+    if(!ret)
+	    assoofs_stat_inc(sb, ASSOOFS_STAT_CREATES);
+    trace_assoofs_create(dir, dentry, mode, ret, ktime_get_ns() - start);
+    return ret;
+}
+
+/**
+ * Crea el inodo de un archivo y su entrada en el directorio, dentro de la
+ * transaccion que ha abierto assoofs_create
+ */
+static int assoofs_create_locked(struct inode *dir, struct dentry *dentry, umode_t mode){
+    //Estructura del inodo
+    struct inode *inode;
+    //Estructura que guarda la informacion persistente del inodo
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_inode_info *parent_inode_info;
+    struct super_block *sb = dir->i_sb;
+    uint64_t ino;
+    int ret;
+
+    //Reservamos un numero de inodo libre en el mapa de bits de inodos
+    ret = assoofs_sb_get_a_freeinode(sb, &ino);
+    if(ret)
+	    return ret;
+    
+
+    //Creamos el nuevo inode y le asignamos sus atributos
+    inode = new_inode(sb);
+    if(!inode){
+	    assoofs_bitmap_free(sb, &ASSOOFS_SB(sb)->inode_bitmap, ino);
+	    return -ENOMEM;
+    }
+    inode->i_sb = sb;
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_ino = ino;
+    
+    //Rellenamos la informacion persistente, que va dentro del propio inodo
+    inode_info = &ASSOOFS_I(inode)->info;
+    inode_info->inode_no = inode->i_ino;
+    inode_info->mode = mode;
+    inode_info->file_size = 0;
+    //Los ficheros nuevos empiezan con los datos dentro del inodo
+    inode_info->flags = ASSOOFS_INODE_INLINE_DATA;
+
+    //Asignamos operaciones de fichero al inodo
+    inode->i_fop = &assoofs_file_operations;
+    inode->i_mapping->a_ops = &assoofs_aops;
+
+    //Asignamos propietario y permisos y añadimos el nuevo inodo a la cache
+    inode_init_owner(inode, dir, mode);
+    ret = assoofs_insert_new_inode(inode);
+    if(ret)
+	    return ret;
+
+    //Los bloques de datos se asignan a medida que se escribe en el archivo
+
+    //Añadimos la informacion del inodo al directorio padre. Es lo primero que
+    //puede fallar, asi que hasta aqui no hay nada en disco que deshacer
+    parent_inode_info = &ASSOOFS_I(dir)->info;
+    ret = assoofs_dir_add_entry(sb, parent_inode_info, dentry->d_name.name, inode_info->inode_no, inode_info->mode);
+    if(ret){
+	    assoofs_bitmap_free(sb, &ASSOOFS_SB(sb)->inode_bitmap, ino);
+	    discard_new_inode(inode);
+	    return ret;
+    }
+
+    //Guardamos la informacion persistente en el disco
+    assoofs_add_inode_info(sb, inode_info);
+
+    //Actualizamos la informacion persistente del inodo padre
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    down_write(&ASSOOFS_I(dir)->data_sem);
+    parent_inode_info->dir_children_count++;
+    assoofs_save_inode_info(sb, parent_inode_info);
+    up_write(&ASSOOFS_I(dir)->data_sem);
+
+    //Solo ahora el inodo entra en el arbol de directorios
+    d_instantiate_new(dentry, inode);
+    return 0;
+}
+
+/**
+ * Carga en memoria un mapa de bits del disco y construye su resumen
+ * @param sb superbloque
+ * @param bm mapa de bits a rellenar
+ * @param start primer bloque del mapa en disco
+ * @param nbits numero de bits validos del mapa
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_bitmap_load(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t start, uint64_t nbits){
+    uint64_t blocks, i, w, word, free = nbits;
+    __le64 *words;
+
+    spin_lock_init(&bm->lock);
+    bm->nbits = nbits;
+    bm->nwords = DIV_ROUND_UP(nbits, 64);
+    bm->words_per_block = sb->s_blocksize / sizeof(__le64);
+    bm->hint = 0;
+    blocks = DIV_ROUND_UP(bm->nwords, bm->words_per_block);
+
+    bm->bh = kvcalloc(blocks, sizeof(*bm->bh), GFP_KERNEL);
+    bm->full = kvcalloc(BITS_TO_LONGS(bm->nwords), sizeof(unsigned long), GFP_KERNEL);
+    if(!bm->bh || !bm->full)
+        goto fail;
+
+    for(i = 0; i < blocks; i++){
+        bm->bh[i] = sb_bread(sb, start + i);
+        if(!bm->bh[i])
+            goto fail;
+    }
+
+    //Marcamos en el resumen las palabras que no tienen ningun bit libre y contamos los libres
+    for(w = 0; w < bm->nwords; w++){
+        words = (__le64 *)bm->bh[w / bm->words_per_block]->b_data;
+        word = le64_to_cpu(words[w % bm->words_per_block]);
+        if(word == ~0ULL)
+            __set_bit(w, bm->full);
+        if(w == bm->nwords - 1 && nbits % 64)
+            word &= (1ULL << (nbits % 64)) - 1;
+        free -= hweight64(word);
+    }
+    if(percpu_counter_init(&bm->free, free, GFP_KERNEL) || percpu_counter_init(&bm->reserved, 0, GFP_KERNEL))
+        goto fail;
+    return 0;
+
+fail:
+    printk(KERN_ERR "No se ha podido cargar el mapa de bits\n");
+    assoofs_bitmap_release(bm);
+    return -ENOMEM;
+}
+
+/**
+ * Libera la memoria de un mapa de bits
+ * @param bm mapa de bits
+ */
+void assoofs_bitmap_release(struct assoofs_bitmap *bm){
+    uint64_t i;
+
+    if(bm->bh){
+        for(i = 0; i < DIV_ROUND_UP(bm->nwords, bm->words_per_block); i++)
+            brelse(bm->bh[i]);
+    }
+    kvfree(bm->bh);
+    kvfree(bm->full);
+    bm->bh = NULL;
+    bm->full = NULL;
+    percpu_counter_destroy(&bm->free);
+    percpu_counter_destroy(&bm->reserved);
+}
+
+/**
+ * Busca un bit libre en el mapa. Se empieza por la palabra de la ultima
+ * asignacion y se salta de 64 en 64 bits con el resumen, asi que el coste no
+ * crece al llenarse el mapa. Se llama con el cerrojo del mapa cogido.
+ * @param bm mapa de bits
+ * @param bit bit libre encontrado
+ * @return 0 si todo sale bien o -ENOSPC si el mapa esta lleno
+ */
+static int assoofs_bitmap_find(struct assoofs_bitmap *bm, uint64_t *bit){
+    unsigned int bits_per_block = bm->words_per_block * 64;
+    struct buffer_head *bh;
+    uint64_t w, start = bm->hint;
+    unsigned long nr;
+    int pass;
+
+    for(pass = 0; pass < 2; pass++){
+        w = find_next_zero_bit(bm->full, bm->nwords, start);
+        while(w < bm->nwords){
+            bh = bm->bh[w / bm->words_per_block];
+            nr = find_next_zero_bit_le(bh->b_data, bits_per_block, (w % bm->words_per_block) * 64);
+            *bit = (w / bm->words_per_block) * bits_per_block + nr;
+
+            //Los bits de relleno del final del mapa no son bloques validos
+            if(*bit < bm->nbits)
+                return 0;
+            __set_bit(w, bm->full);
+            w = find_next_zero_bit(bm->full, bm->nwords, w + 1);
+        }
+        //Damos la vuelta y buscamos desde el principio
+        start = 0;
+    }
+    return -ENOSPC;
+}
+
+/**
+ * Marca como ocupados hasta max bits libres seguidos a partir de bit, que
+ * esta libre. Se llama con el cerrojo del mapa cogido.
+ * @param bm mapa de bits
+ * @param bit primer bit
+ * @param max numero maximo de bits
+ * @return numero de bits marcados
+ */
+static uint64_t assoofs_bitmap_set_run(struct assoofs_bitmap *bm, uint64_t bit, uint64_t max){
+    unsigned int bits_per_block = bm->words_per_block * 64;
+    struct buffer_head *bh;
+    uint64_t n, nr, w;
+
+    for(n = 0; n < max && bit + n < bm->nbits; n++){
+        bh = bm->bh[(bit + n) / bits_per_block];
+        nr = (bit + n) % bits_per_block;
+        if(test_bit_le(nr, bh->b_data))
+            break;
+        __set_bit_le(nr, bh->b_data);
+        w = (bit + n) / 64;
+        if(le64_to_cpu(((__le64 *)bh->b_data)[w % bm->words_per_block]) == ~0ULL)
+            __set_bit(w, bm->full);
+    }
+    bm->hint = (bit + n - 1) / 64;
+    percpu_counter_sub(&bm->free, n);
+    return n;
+}
+
+/**
+ * Cuenta los bits libres que no estan apartados. Lejos del limite basta con
+ * la lectura aproximada de los contadores por CPU; si quedan menos de want
+ * mas el error que puede tener esa lectura se suman las copias de todas las
+ * CPU.
+ * @param bm mapa de bits
+ * @param want numero de bits que se quieren coger
+ * @return bits libres sin apartar, que puede ser negativo
+ */
+static s64 assoofs_bitmap_available(struct assoofs_bitmap *bm, s64 want){
+    s64 avail = percpu_counter_read(&bm->free) - percpu_counter_read(&bm->reserved);
+
+    if(avail < want + ASSOOFS_COUNTER_SLACK)
+        avail = percpu_counter_sum(&bm->free) - percpu_counter_sum(&bm->reserved);
+    return avail;
+}
+
+/**
+ * Reserva una racha de bits libres seguidos, empezando en goal si esta
+ * libre o si no en el primer bit libre. Las rachas se limitan a
+ * ASSOOFS_MAX_ALLOC_RUN bits, asi que tocan como mucho dos bloques del mapa.
+ * @param sb superbloque
+ * @param bm mapa de bits
+ * @param goal bit preferido, o U64_MAX si da igual
+ * @param max longitud maxima de la racha
+ * @param reserved si la racha cubre bits ya apartados con assoofs_bitmap_reserve
+ * @param start primer bit asignado
+ * @param count numero de bits asignados, al menos 1
+ * @return 0 si todo sale bien o -ENOSPC si el mapa esta lleno
+ */
+int assoofs_bitmap_alloc_range(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t goal, uint64_t max, int reserved, uint64_t *start, uint64_t *count){
+    unsigned int bits_per_block = bm->words_per_block * 64;
+    uint64_t bit;
+    s64 avail;
+    int ret;
+
+    max = clamp_t(uint64_t, max, 1, ASSOOFS_MAX_ALLOC_RUN);
+    spin_lock(&bm->lock);
+    //Sin reserva previa no se pueden coger los bits apartados para otros
+    if(!reserved){
+        avail = assoofs_bitmap_available(bm, max);
+        if(avail <= 0){
+            spin_unlock(&bm->lock);
+            return -ENOSPC;
+        }
+        max = min_t(uint64_t, max, avail);
+    }
+    if(goal < bm->nbits && !test_bit_le(goal % bits_per_block, bm->bh[goal / bits_per_block]->b_data)){
+        bit = goal;
+    }else{
+        ret = assoofs_bitmap_find(bm, &bit);
+        if(ret){
+            spin_unlock(&bm->lock);
+            return ret;
+        }
+    }
+    *count = assoofs_bitmap_set_run(bm, bit, max);
+    spin_unlock(&bm->lock);
+
+    //El manejador abierto impide el commit hasta que apuntemos los bloques
+    *start = bit;
+    assoofs_journal_dirty(sb, bm->bh[bit / bits_per_block]);
+    if((bit + *count - 1) / bits_per_block != bit / bits_per_block)
+        assoofs_journal_dirty(sb, bm->bh[(bit + *count - 1) / bits_per_block]);
+    return 0;
+}
+
+/**
+ * Busca un bit libre en el mapa y lo marca como ocupado
+ * @param sb superbloque
+ * @param bm mapa de bits
+ * @param bit bit asignado
+ * @return 0 si todo sale bien o -ENOSPC si el mapa esta lleno
+ */
+int assoofs_bitmap_alloc(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t *bit){
+    uint64_t count;
+
+    return assoofs_bitmap_alloc_range(sb, bm, U64_MAX, 1, 0, bit, &count);
+}
+
+/**
+ * Aparta n bits libres sin elegir cuales, para asignarlos mas tarde. Solo
+ * se concede si despues siguen libres al menos margin bits sin apartar.
+ * Mientras sobra sitio no se coge el cerrojo; cerca del limite se coge para
+ * que dos reservas no se den a la vez los ultimos bits.
+ * @param bm mapa de bits
+ * @param n numero de bits
+ * @param margin bits que se dejan para los metadatos
+ * @return 0 si todo sale bien o -ENOSPC
+ */
+int assoofs_bitmap_reserve(struct assoofs_bitmap *bm, uint64_t n, uint64_t margin){
+    int ret = 0;
+
+    if(percpu_counter_read(&bm->free) - percpu_counter_read(&bm->reserved) >= (s64)(n + margin) + ASSOOFS_COUNTER_SLACK){
+        percpu_counter_add(&bm->reserved, n);
+        return 0;
+    }
+
+    spin_lock(&bm->lock);
+    if(assoofs_bitmap_available(bm, n + margin) < (s64)(n + margin))
+        ret = -ENOSPC;
+    else
+        percpu_counter_add(&bm->reserved, n);
+    spin_unlock(&bm->lock);
+    return ret;
+}
+
+/**
+ * Devuelve n bits apartados con assoofs_bitmap_reserve
+ * @param bm mapa de bits
+ * @param n numero de bits
+ */
+void assoofs_bitmap_unreserve(struct assoofs_bitmap *bm, uint64_t n){
+    percpu_counter_sub(&bm->reserved, n);
+}
+
+/**
+ * Marca un bit del mapa como libre
+ * @param sb superbloque
+ * @param bm mapa de bits
+ * @param bit bit a liberar
+ */
+void assoofs_bitmap_free(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t bit){
+    assoofs_bitmap_free_range(sb, bm, bit, 1);
+}
+
+/**
+ * Marca como libres count bits seguidos del mapa, de palabra en palabra y
+ * cogiendo el cerrojo una vez por cada bloque del mapa
+ * @param sb superbloque
+ * @param bm mapa de bits
+ * @param start primer bit a liberar
+ * @param count numero de bits
+ */
+void assoofs_bitmap_free_range(struct super_block *sb, struct assoofs_bitmap *bm, uint64_t start, uint64_t count){
+    unsigned int bits_per_block = bm->words_per_block * 64;
+    uint64_t bit = start, end = start + count, block_end, n, w;
+    struct buffer_head *bh;
+    __le64 *words;
+
+    while(bit < end){
+        bh = bm->bh[bit / bits_per_block];
+        words = (__le64 *)bh->b_data;
+        block_end = min(end, (bit / bits_per_block + 1) * bits_per_block);
+
+        spin_lock(&bm->lock);
+        //Preferimos reutilizar los huecos mas bajos para mantener el disco compacto
+        if(bit / 64 < bm->hint)
+            bm->hint = bit / 64;
+        percpu_counter_add(&bm->free, block_end - bit);
+        for(; bit < block_end; bit += n){
+            w = bit / 64;
+            n = min(block_end - bit, 64 - bit % 64);
+            words[w % bm->words_per_block] &= ~cpu_to_le64((n == 64 ? ~0ULL : (1ULL << n) - 1) << (bit % 64));
+            __clear_bit(w, bm->full);
+        }
+        spin_unlock(&bm->lock);
+        assoofs_journal_dirty(sb, bh);
+    }
+}
+
+/**
+ * Permite encontrar y asignar un bloque libre accediendo al mapa de bits
+ * @param sb superbloque
+ * @param block puntero al numero de bloque de un inodo
+ * @return 0 si todo salio bien o -ENOSPC si no quedan bloques
+ */
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
+	int ret;
+	ret = assoofs_bitmap_alloc(sb, &ASSOOFS_SB(sb)->block_bitmap, block);
+	if(!ret)
+		assoofs_stat_inc(sb, ASSOOFS_STAT_BLOCKS_ALLOCATED);
+	return ret;
+}
+
+/**
+ * Devuelve un bloque al mapa de bits de bloques libres
+ * @param sb superbloque
+ * @param block numero de bloque a liberar
+ */
+void assoofs_sb_put_a_freeblock(struct super_block *sb, uint64_t block){
+	assoofs_bitmap_free(sb, &ASSOOFS_SB(sb)->block_bitmap, block);
+	assoofs_stat_inc(sb, ASSOOFS_STAT_BLOCKS_FREED);
+}
+
+/**
+ * Actualiza la información persistente del superbloque
+ * @param vsb superbloque
+ */
+void assoofs_save_sb_info(struct super_block *vsb){
+    struct buffer_head *bh;
+	//El bloque del superbloque esta fijado en memoria desde el montaje
+	bh = ASSOOFS_SB(vsb)->sb_bh;
+	assoofs_journal_dirty(vsb, bh);
+}
+
+/**
+ * Localiza el registro de un inodo en la tabla de inodos. El inodo numero
+ * inode_no esta en el bloque inode_no / inodos_por_bloque de la tabla, en la
+ * posicion inode_no % inodos_por_bloque.
+ * @param sb superbloque
+ * @param inode_no numero de inodo
+ * @param bhp buffer del bloque de la tabla, que el llamante debe liberar
+ * @return puntero al registro del inodo o NULL si hay un error
+ */
+struct assoofs_disk_inode *assoofs_inode_table_slot(struct super_block *sb, uint64_t inode_no, struct buffer_head **bhp){
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct buffer_head *bh;
+
+	if(inode_no >= sbi->disk_sb->inodes_total){
+		printk(KERN_ERR "Numero de inodo fuera de la tabla\n");
+		return NULL;
+	}
+
+	bh = sb_bread(sb, sbi->disk_sb->inode_table_block + inode_no / sbi->inodes_per_block);
+	if(!bh)
+		return NULL;
+	*bhp = bh;
+	return (struct assoofs_disk_inode *)bh->b_data + inode_no % sbi->inodes_per_block;
+}
+
+/**
+ * Permite encontrar y asignar un numero de inodo libre accediendo al mapa de bits de inodos
+ * @param sb superbloque
+ * @param inode_no numero de inodo asignado
+ * @return 0 si todo salio bien o -ENOSPC si no quedan inodos
+ */
+int assoofs_sb_get_a_freeinode(struct super_block *sb, uint64_t *inode_no){
+	return assoofs_bitmap_alloc(sb, &ASSOOFS_SB(sb)->inode_bitmap, inode_no);
+}
+
+/**
+ * Guarda en disco la informacion persistente de un inodo nuevo
+ * @param sb superbloque
+ * @param inode informacion persistente del inodo
+ */
+void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+	//Escribimos el inodo en su posicion de la tabla
+	if(assoofs_save_inode_info(sb, inode))
+		return;
+
+	//Cambiamos el numero de inodos y guardamos la información del superbloque
+	spin_lock(&sbi->lock);
+	sbi->disk_sb->inodes_count++;
+	spin_unlock(&sbi->lock);
+	assoofs_save_sb_info(sb);
+}
+
+/**
+ * Copia en la informacion persistente los campos que el VFS mantiene en su
+ * inodo: modo, enlaces, propietario y tiempos
+ * @param inode_info informacion persistente, dentro de un struct assoofs_inode
+ */
+static void assoofs_inode_info_from_vfs(struct assoofs_inode_info *inode_info){
+	struct inode *inode = assoofs_info_inode(inode_info);
+
+	inode_info->mode = inode->i_mode;
+	inode_info->links_count = inode->i_nlink;
+	inode_info->uid = i_uid_read(inode);
+	inode_info->gid = i_gid_read(inode);
+	inode_info->atime.sec = inode->i_atime.tv_sec;
+	inode_info->atime.nsec = inode->i_atime.tv_nsec;
+	inode_info->mtime.sec = inode->i_mtime.tv_sec;
+	inode_info->mtime.nsec = inode->i_mtime.tv_nsec;
+	inode_info->ctime.sec = inode->i_ctime.tv_sec;
+	inode_info->ctime.nsec = inode->i_ctime.tv_nsec;
+}
+
+/**
+ * Actualizamos la informacion persistente del inodo en la tabla de inodos,
+ * dentro de la transaccion en curso
+ * @param sb superbloque
+ * @param inode_info informacion persistente del inodo
+ * @return 0 si todo sale bien y -EIO si se produce un error
+ */
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+	struct assoofs_disk_inode *inode_pos;
+	struct buffer_head *bh;
+
+	//Accedemos directamente a la posicion del inodo en la tabla
+	inode_pos = assoofs_inode_table_slot(sb, inode_info->inode_no, &bh);
+	if(inode_pos == NULL){
+		printk(KERN_ERR "Informacion del inodo no encontrado\n");
+		return -EIO;
+	}
+	assoofs_inode_info_from_vfs(inode_info);
+	assoofs_inode_to_disk(inode_info, inode_pos);
+	assoofs_journal_dirty(sb, bh);
+	brelse(bh);
+	return 0;
+}
+
+/**
+ * Los tamaños y los tramos van al journal en cuanto se modifican; aqui se
+ * apuntan los campos que el VFS ha cambiado sin avisar, como los tiempos. Si
+ * la escritura es sincrona ademas se hace commit.
+ * @param inode inodo
+ * @param wbc control de la escritura
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc){
+	struct super_block *sb = inode->i_sb;
+	struct assoofs_inode *ai = ASSOOFS_I(inode);
+	unsigned int nofs;
+
+	nofs = assoofs_journal_start(sb, 1);
+	down_write(&ai->data_sem);
+	assoofs_save_inode_info(sb, &ai->info);
+	up_write(&ai->data_sem);
+	assoofs_journal_stop(sb, 1, nofs);
+
+	if(wbc->sync_mode != WB_SYNC_ALL)
+		return 0;
+	return assoofs_journal_commit(sb, READ_ONCE(ASSOOFS_SB(sb)->journal.sequence));
+}
+
+/**
+ * Traduce una posicion del area circular del journal a bloque fisico
+ */
+static inline uint64_t assoofs_journal_block(struct assoofs_journal *j, uint64_t pos){
+	return j->first + 1 + pos % (j->blocks - 1);
+}
+
+/**
+ * Abre un manejador sobre la transaccion en curso reservando credits bloques.
+ * Si no caben se hace antes commit de la transaccion. Los manejadores no se
+ * pueden anidar.
+ * @param sb superbloque
+ * @param credits numero maximo de bloques que va a modificar la operacion
+ * @return estado de memalloc_nofs_save que hay que pasar a assoofs_journal_stop
+ */
+unsigned int assoofs_journal_start(struct super_block *sb, unsigned int credits){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+
+	for(;;){
+		down_read(&j->barrier);
+		spin_lock(&j->lock);
+		if(j->t_count + j->t_reserved + credits <= j->t_max){
+			j->t_reserved += credits;
+			spin_unlock(&j->lock);
+			return memalloc_nofs_save();
+		}
+		spin_unlock(&j->lock);
+		up_read(&j->barrier);
+		assoofs_journal_commit(sb, READ_ONCE(j->sequence));
+	}
+}
+
+/**
+ * Cierra un manejador y devuelve los bloques que se reservaron
+ * @param sb superbloque
+ * @param credits los mismos que en assoofs_journal_start
+ * @param nofs lo que devolvio assoofs_journal_start
+ */
+void assoofs_journal_stop(struct super_block *sb, unsigned int credits, unsigned int nofs){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+
+	memalloc_nofs_restore(nofs);
+	spin_lock(&j->lock);
+	j->t_reserved -= credits;
+	spin_unlock(&j->lock);
+	up_read(&j->barrier);
+}
+
+/**
+ * Apunta un bloque de metadatos modificado en la transaccion en curso. El
+ * bloque no se marca sucio: se queda fijado en memoria y solo se escribe en
+ * su sitio en el checkpoint, despues de estar en el journal.
+ * @param sb superbloque
+ * @param bh bloque modificado
+ */
+void assoofs_journal_dirty(struct super_block *sb, struct buffer_head *bh){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+
+	if(buffer_assoofs_logged(bh))
+		return;
+	spin_lock(&j->lock);
+	if(!test_set_buffer_assoofs_logged(bh)){
+		if(j->t_count < j->t_max){
+			get_bh(bh);
+			j->running[j->t_count++] = bh;
+		}else{
+			//Solo pasa si una operacion se queda corta de credits
+			WARN_ONCE(1, "assoofs: transaccion llena\n");
+			clear_buffer_assoofs_logged(bh);
+			mark_buffer_dirty(bh);
+		}
+	}
+	spin_unlock(&j->lock);
+}
+
+/**
+ * Libera una racha de bloques de metadatos despues del siguiente checkpoint.
+ * El journal no tiene registros de revocacion, asi que si el bloque se
+ * reutilizara antes para datos, al reaplicar el journal tras una caida se
+ * escribiria encima su contenido antiguo. El hueco se aparta antes con
+ * assoofs_journal_start_free.
+ * @param sb superbloque
+ * @param start primer bloque
+ * @param count numero de bloques
+ */
+void assoofs_journal_defer_free(struct super_block *sb, uint64_t start, uint64_t count){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+
+	spin_lock(&j->lock);
+	if(j->freed_count < j->freed_max){
+		j->freed[j->freed_count].start = start;
+		j->freed[j->freed_count].count = count;
+		j->freed_count++;
+	}else{
+		//Solo pasa si una operacion no aparta su hueco; el bloque se pierde hasta fsck
+		WARN_ONCE(1, "assoofs: lista de bloques liberados llena\n");
+	}
+	spin_unlock(&j->lock);
+}
+
+/**
+ * Abre un manejador para liberar bloques, apartando sitio para
+ * ASSOOFS_FREE_RUNS rachas y el bloque de tramos en la lista de bloques
+ * pendientes. Si la lista esta llena se hace antes un checkpoint, que la vacia.
+ * @param sb superbloque
+ * @param credits bloques que puede ensuciar el manejador
+ * @return lo mismo que assoofs_journal_start
+ */
+static unsigned int assoofs_journal_start_free(struct super_block *sb, unsigned int credits){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+
+	for(;;){
+		spin_lock(&j->lock);
+		if(j->freed_count + j->freed_reserved + ASSOOFS_FREE_RUNS + 1 <= j->freed_max){
+			j->freed_reserved += ASSOOFS_FREE_RUNS + 1;
+			spin_unlock(&j->lock);
+			break;
+		}
+		if(!j->freed_count){
+			//El sitio lo tienen apartado otros manejadores: esperamos a que acaben
+			spin_unlock(&j->lock);
+			schedule_timeout_uninterruptible(1);
+			continue;
+		}
+		spin_unlock(&j->lock);
+		mutex_lock(&j->commit_mutex);
+		assoofs_journal_checkpoint(sb);
+		mutex_unlock(&j->commit_mutex);
+	}
+	return assoofs_journal_start(sb, credits);
+}
+
+/**
+ * Cierra un manejador abierto con assoofs_journal_start_free
+ * @param sb superbloque
+ * @param credits los mismos que al abrirlo
+ * @param nofs lo que devolvio assoofs_journal_start_free
+ */
+static void assoofs_journal_stop_free(struct super_block *sb, unsigned int credits, unsigned int nofs){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+
+	spin_lock(&j->lock);
+	j->freed_reserved -= ASSOOFS_FREE_RUNS + 1;
+	spin_unlock(&j->lock);
+	assoofs_journal_stop(sb, credits, nofs);
+}
+
+/**
+ * Hace un checkpoint si hay bloques liberados esperandolo, para que se
+ * puedan volver a asignar. No se puede llamar dentro de un manejador.
+ * @param sb superbloque
+ * @return 1 si se han devuelto bloques al mapa, 0 si no
+ */
+static int assoofs_journal_release_freed(struct super_block *sb){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	int ret = 0;
+
+	mutex_lock(&j->commit_mutex);
+	if(READ_ONCE(j->freed_count))
+		ret = !assoofs_journal_checkpoint(sb);
+	mutex_unlock(&j->commit_mutex);
+	return ret;
+}
+
+/**
+ * Escribe un bloque del journal
+ */
+static void assoofs_journal_submit(struct buffer_head *bh, int op_flags){
+	lock_buffer(bh);
+	clear_buffer_dirty(bh);
+	get_bh(bh);
+	bh->b_end_io = end_buffer_write_sync;
+	submit_bh(REQ_OP_WRITE, op_flags, bh);
+}
+
+/**
+ * Copia los bloques de la transaccion en curso a bloques del journal y la
+ * cierra. Se llama con la barrera cogida en escritura, asi que no hay
+ * ninguna operacion modificando bloques, y al soltarla la siguiente
+ * transaccion puede empezar mientras esta se escribe.
+ * @param sb superbloque
+ * @param nio numero de bloques del journal que hay que escribir, contando el descriptor y el commit
+ * @return 0 si todo sale bien o -EIO
+ */
+static int assoofs_journal_snapshot(struct super_block *sb, unsigned int *nio){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	struct assoofs_journal_descriptor *desc;
+	struct assoofs_journal_commit *commit;
+	struct buffer_head *bh;
+	unsigned int i, count = j->t_count;
+	uint32_t crc;
+
+	*nio = 0;
+	if(!count)
+		return 0;
+
+	for(i = 0; i < count + 2; i++){
+		bh = sb_getblk(sb, assoofs_journal_block(j, j->head + i));
+		if(!bh){
+			while(i--)
+				brelse(j->io[i]);
+			return -EIO;
+		}
+		wait_on_buffer(bh);
+		lock_buffer(bh);
+		memset(bh->b_data, 0, bh->b_size);
+		j->io[i] = bh;
+	}
+
+	desc = (struct assoofs_journal_descriptor *)j->io[0]->b_data;
+	desc->header.magic = ASSOOFS_JOURNAL_MAGIC;
+	desc->header.type = ASSOOFS_JOURNAL_DESCRIPTOR;
+	desc->header.sequence = j->sequence;
+	desc->count = count;
+	for(i = 0; i < count; i++)
+		desc->blocks[i] = j->running[i]->b_blocknr;
+	crc = crc32_le(~0, j->io[0]->b_data, sb->s_blocksize);
+
+	//Las copias pasan al journal y los bloques originales al checkpoint
+	for(i = 0; i < count; i++){
+		bh = j->running[i];
+		memcpy(j->io[i + 1]->b_data, bh->b_data, sb->s_blocksize);
+		crc = crc32_le(crc, j->io[i + 1]->b_data, sb->s_blocksize);
+		clear_buffer_assoofs_logged(bh);
+		j->checkpoint[j->cp_count++] = bh;
+	}
+
+	commit = (struct assoofs_journal_commit *)j->io[count + 1]->b_data;
+	commit->header.magic = ASSOOFS_JOURNAL_MAGIC;
+	commit->header.type = ASSOOFS_JOURNAL_COMMIT;
+	commit->header.sequence = j->sequence;
+	commit->checksum = crc;
+
+	for(i = 0; i < count + 2; i++){
+		set_buffer_uptodate(j->io[i]);
+		unlock_buffer(j->io[i]);
+	}
+
+	j->head += count + 2;
+	j->sequence++;
+	j->t_count = 0;
+	*nio = count + 2;
+	return 0;
+}
+
+/**
+ * Escribe en el journal los bloques preparados por assoofs_journal_snapshot:
+ * primero el descriptor y las copias y, cuando estan en disco, el commit
+ * con FUA, que es el que hace valida la transaccion
+ * @param sb superbloque
+ * @param nio numero de bloques preparados
+ * @return 0 si todo sale bien o -EIO
+ */
+static int assoofs_journal_write(struct super_block *sb, unsigned int nio){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	unsigned int i;
+	int ret = 0;
+
+	if(!nio)
+		return 0;
+	for(i = 0; i < nio - 1; i++)
+		assoofs_journal_submit(j->io[i], 0);
+	for(i = 0; i < nio - 1; i++){
+		wait_on_buffer(j->io[i]);
+		if(!buffer_uptodate(j->io[i]))
+			ret = -EIO;
+	}
+	if(!ret){
+		assoofs_journal_submit(j->io[nio - 1], REQ_PREFLUSH | REQ_FUA);
+		wait_on_buffer(j->io[nio - 1]);
+		if(!buffer_uptodate(j->io[nio - 1]))
+			ret = -EIO;
+	}
+	for(i = 0; i < nio; i++)
+		brelse(j->io[i]);
+
+	if(ret)
+		printk(KERN_ERR "assoofs: error escribiendo el journal\n");
+	else
+		j->commit_sequence = j->sequence - 1;
+	return ret;
+}
+
+/**
+ * Escribe el superbloque del journal
+ */
+static int assoofs_journal_write_super(struct super_block *sb){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	struct assoofs_journal_super_block *jsb;
+	struct buffer_head *bh;
+	int ret;
+
+	bh = sb_bread(sb, j->first);
+	if(!bh)
+		return -EIO;
+	lock_buffer(bh);
+	jsb = (struct assoofs_journal_super_block *)bh->b_data;
+	jsb->header.magic = ASSOOFS_JOURNAL_MAGIC;
+	jsb->header.type = ASSOOFS_JOURNAL_SUPERBLOCK;
+	jsb->header.sequence = j->sequence;
+	jsb->start = j->head % (j->blocks - 1);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	ret = __sync_dirty_buffer(bh, REQ_SYNC | REQ_FUA);
+	brelse(bh);
+	return ret;
+}
+
+/**
+ * Lleva a su sitio todos los bloques que estan en el journal y lo vacia. Se
+ * hace con la barrera cogida en escritura y despues de escribir en el
+ * journal la transaccion en curso, de modo que el contenido de los bloques
+ * en memoria es exactamente el de las transacciones escritas.
+ * @param sb superbloque
+ * @return 0 si todo sale bien o -EIO
+ */
+static int assoofs_journal_checkpoint(struct super_block *sb){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	unsigned int i, nio;
+	int ret;
+
+	down_write(&j->barrier);
+	ret = assoofs_journal_snapshot(sb, &nio);
+	if(!ret)
+		ret = assoofs_journal_write(sb, nio);
+	if(ret)
+		goto out;
+
+	//Un bloque puede estar en varias transacciones, pero solo queda sucio una vez
+	for(i = 0; i < j->cp_count; i++)
+		mark_buffer_dirty(j->checkpoint[i]);
+	for(i = 0; i < j->cp_count; i++)
+		write_dirty_buffer(j->checkpoint[i], 0);
+	for(i = 0; i < j->cp_count; i++){
+		wait_on_buffer(j->checkpoint[i]);
+		if(buffer_write_io_error(j->checkpoint[i]))
+			ret = -EIO;
+	}
+	if(!ret)
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+	if(ret)
+		goto out;
+
+	j->tail = j->head;
+	ret = assoofs_journal_write_super(sb);
+	for(i = 0; i < j->cp_count; i++)
+		brelse(j->checkpoint[i]);
+	j->cp_count = 0;
+
+	//Ya no queda en el journal ninguna copia de los bloques liberados y se pueden reutilizar
+	if(!ret){
+		for(i = 0; i < j->freed_count; i++){
+			assoofs_bitmap_free_range(sb, &ASSOOFS_SB(sb)->block_bitmap, j->freed[i].start, j->freed[i].count);
+			assoofs_stat_add(sb, ASSOOFS_STAT_BLOCKS_FREED, j->freed[i].count);
+		}
+		j->freed_count = 0;
+	}
+out:
+	up_write(&j->barrier);
+	if(ret)
+		printk(KERN_ERR "assoofs: error en el checkpoint del journal\n");
+	return ret;
+}
+
+/**
+ * Hace commit de la transaccion sequence, y por tanto de las anteriores.
+ * Todas las operaciones que se han unido a la transaccion en curso van en
+ * un unico commit, y si al llegar aqui otro ya ha hecho el commit de
+ * sequence no se hace nada.
+ * @param sb superbloque
+ * @param sequence transaccion que tiene que quedar en disco
+ * @return 0 si todo sale bien o -EIO
+ */
+int assoofs_journal_commit(struct super_block *sb, uint64_t sequence){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	unsigned int nio = 0;
+	u64 start;
+	int ret;
+
+	mutex_lock(&j->commit_mutex);
+	if(j->commit_sequence >= sequence){
+		mutex_unlock(&j->commit_mutex);
+		return 0;
+	}
+	start = ktime_get_ns();
+
+	down_write(&j->barrier);
+	ret = assoofs_journal_snapshot(sb, &nio);
+	up_write(&j->barrier);
+	if(!ret)
+		ret = assoofs_journal_write(sb, nio);
+
+	//Siempre tiene que caber una transaccion completa y otra del checkpoint
+	if(!ret && (j->blocks - 1) - (j->head - j->tail) < 2 * (j->t_max + 2))
+		ret = assoofs_journal_checkpoint(sb);
+	assoofs_stat_inc(sb, ASSOOFS_STAT_JOURNAL_COMMITS);
+	trace_assoofs_journal_commit(sb, j->commit_sequence, nio, ret, ktime_get_ns() - start);
+	mutex_unlock(&j->commit_mutex);
+	return ret;
+}
+
+/**
+ * Comprueba una transaccion del journal
+ * @param sb superbloque
+ * @param pos posicion del descriptor en el area circular
+ * @param sequence secuencia esperada
+ * @param count numero de bloques de la transaccion
+ * @return buffer del descriptor si la transaccion esta completa o NULL
+ */
+static struct buffer_head *assoofs_journal_check(struct super_block *sb, uint64_t pos, uint64_t sequence, uint32_t *count){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	struct assoofs_journal_descriptor *desc;
+	struct assoofs_journal_commit *commit;
+	struct buffer_head *dbh, *bh;
+	uint64_t max = (sb->s_blocksize - sizeof(*desc)) / sizeof(uint64_t);
+	uint32_t crc, i;
+	int valid;
+
+	dbh = sb_bread(sb, assoofs_journal_block(j, pos));
+	if(!dbh)
+		return NULL;
+	desc = (struct assoofs_journal_descriptor *)dbh->b_data;
+	if(desc->header.magic != ASSOOFS_JOURNAL_MAGIC || desc->header.type != ASSOOFS_JOURNAL_DESCRIPTOR ||
+	   desc->header.sequence != sequence || !desc->count || desc->count > max || desc->count + 2 > j->blocks - 1)
+		goto invalid;
+
+	crc = crc32_le(~0, dbh->b_data, sb->s_blocksize);
+	for(i = 0; i < desc->count; i++){
+		bh = sb_bread(sb, assoofs_journal_block(j, pos + 1 + i));
+		if(!bh)
+			goto invalid;
+		crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+		brelse(bh);
+	}
+
+	bh = sb_bread(sb, assoofs_journal_block(j, pos + 1 + desc->count));
+	if(!bh)
+		goto invalid;
+	commit = (struct assoofs_journal_commit *)bh->b_data;
+	valid = commit->header.magic == ASSOOFS_JOURNAL_MAGIC && commit->header.type == ASSOOFS_JOURNAL_COMMIT &&
+		commit->header.sequence == sequence && commit->checksum == crc;
+	brelse(bh);
+	if(!valid)
+		goto invalid;
+
+	*count = desc->count;
+	return dbh;
+
+invalid:
+	brelse(dbh);
+	return NULL;
+}
+
+/**
+ * Prepara el journal al montar: reaplica las transacciones que quedaron
+ * escritas en el journal y no en su sitio y reserva la memoria del journal
+ * @param sb superbloque
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_journal_load(struct super_block *sb){
+	struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+	struct assoofs_journal *j = &sbi->journal;
+	struct assoofs_journal_super_block *jsb;
+	struct assoofs_journal_descriptor *desc;
+	struct buffer_head *bh, *dbh, *src, *dst;
+	uint64_t replayed = 0;
+	uint32_t count, i;
+	int ret;
+
+	j->first = sbi->disk_sb->journal_block;
+	j->blocks = sbi->disk_sb->journal_blocks;
+	j->t_max = min_t(uint64_t, (sb->s_blocksize - sizeof(*desc)) / sizeof(uint64_t), (j->blocks - 1) / 4 - 2);
+	if(j->blocks < ASSOOFS_JOURNAL_MIN_BLOCKS || j->t_max < ASSOOFS_MAX_CREDITS){
+		printk(KERN_ERR "assoofs: el journal es demasiado pequeño\n");
+		return -EINVAL;
+	}
+	init_rwsem(&j->barrier);
+	mutex_init(&j->commit_mutex);
+	spin_lock_init(&j->lock);
+
+	bh = sb_bread(sb, j->first);
+	if(!bh)
+		return -EIO;
+	jsb = (struct assoofs_journal_super_block *)bh->b_data;
+	if(jsb->header.magic != ASSOOFS_JOURNAL_MAGIC || jsb->header.type != ASSOOFS_JOURNAL_SUPERBLOCK){
+		printk(KERN_ERR "assoofs: superbloque del journal invalido\n");
+		brelse(bh);
+		return -EINVAL;
+	}
+	j->head = j->tail = jsb->start;
+	j->sequence = jsb->header.sequence;
+	brelse(bh);
+
+	//Reaplicamos en orden las transacciones completas
+	while((dbh = assoofs_journal_check(sb, j->head, j->sequence, &count))){
+		desc = (struct assoofs_journal_descriptor *)dbh->b_data;
+		for(i = 0; i < count; i++){
+			if(desc->blocks[i] >= sbi->disk_sb->blocks_count)
+				continue;
+			src = sb_bread(sb, assoofs_journal_block(j, j->head + 1 + i));
+			dst = sb_getblk(sb, desc->blocks[i]);
+			if(!src || !dst){
+				brelse(src);
+				brelse(dst);
+				brelse(dbh);
+				return -EIO;
+			}
+			lock_buffer(dst);
+			memcpy(dst->b_data, src->b_data, sb->s_blocksize);
+			set_buffer_uptodate(dst);
+			unlock_buffer(dst);
+			mark_buffer_dirty(dst);
+			brelse(dst);
+			brelse(src);
+		}
+		brelse(dbh);
+		j->head += count + 2;
+		j->sequence++;
+		replayed++;
+	}
+	j->commit_sequence = j->sequence - 1;
+
+	if(replayed){
+		printk(KERN_INFO "assoofs: reaplicadas %llu transacciones del journal\n", replayed);
+		ret = sync_blockdev(sb->s_bdev);
+		if(ret)
+			return ret;
+	}
+	//El journal queda vacio a partir de la siguiente transaccion
+	j->head %= j->blocks - 1;
+	j->tail = j->head;
+	if(replayed){
+		ret = assoofs_journal_write_super(sb);
+		if(ret)
+			return ret;
+	}
+
+	j->running = kcalloc(j->t_max, sizeof(*j->running), GFP_KERNEL);
+	j->io = kcalloc(j->t_max + 2, sizeof(*j->io), GFP_KERNEL);
+	j->checkpoint = kvcalloc(j->blocks, sizeof(*j->checkpoint), GFP_KERNEL);
+	//Cada racha liberada ensucia como mucho un bloque del mapa en la transaccion siguiente
+	j->freed_max = j->t_max / 2;
+	j->freed = kcalloc(j->freed_max, sizeof(*j->freed), GFP_KERNEL);
+	if(!j->running || !j->io || !j->checkpoint || !j->freed){
+		assoofs_journal_release(sb);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * Libera la memoria del journal. Al desmontar antes se hace el checkpoint
+ * para dejar el journal vacio.
+ * @param sb superbloque
+ */
+void assoofs_journal_release(struct super_block *sb){
+	struct assoofs_journal *j = &ASSOOFS_SB(sb)->journal;
+	unsigned int i;
+
+	for(i = 0; i < j->t_count; i++){
+		clear_buffer_assoofs_logged(j->running[i]);
+		brelse(j->running[i]);
+	}
+	for(i = 0; i < j->cp_count; i++)
+		brelse(j->checkpoint[i]);
+	j->t_count = j->cp_count = 0;
+	kfree(j->running);
+	kfree(j->io);
+	kvfree(j->checkpoint);
+	kfree(j->freed);
+	j->running = j->io = j->checkpoint = NULL;
+	j->freed = NULL;
+	j->freed_count = 0;
+}
+
+/**
+ * Permite crear inodos para directorios
+ * @param dir Directorio donde se creará el nuevo directorio
+ * @param dentry entrada del directorio en el padre
+ * @param mode modo del directorio
+ * @return 0 o -1 dependiendo de si sale bien
+ */
+static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
+    struct super_block *sb;
+    u64 start = ktime_get_ns();
+    int ret;
+    unsigned int nofs;
+
+    //Obtenemos un puntero al superbloque desde el directorio
+    sb = dir->i_sb;
+    //Toda la operacion va en una transaccion del journal, con sitio para
+    //devolver los bloques del directorio si no se puede enlazar
+    nofs = assoofs_journal_start_free(sb, ASSOOFS_MKDIR_CREDITS);
+    ret = assoofs_mkdir_locked(dir, dentry, mode);
+    assoofs_journal_stop_free(sb, ASSOOFS_MKDIR_CREDITS, nofs);
+    if(!ret && IS_DIRSYNC(dir))
+	    ret = assoofs_journal_commit(sb, READ_ONCE(ASSOOFS_SB(sb)->journal.sequence));
+    if(!ret)
+	    assoofs_stat_inc(sb, ASSOOFS_STAT_MKDIRS);
+    trace_assoofs_mkdir(dir, dentry, mode, ret, ktime_get_ns() - start);
+    return ret;
+}
+
+/**
+ * Crea el inodo de un directorio, su indice y su entrada en el directorio
+ * padre, dentro de la transaccion que ha abierto assoofs_mkdir
+ */
+static int assoofs_mkdir_locked(struct inode *dir, struct dentry *dentry, umode_t mode){
+    //Estructura del inodo
+    struct inode *inode;
+    //Estructura que guarda la informacion persistente del inodo
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_inode_info *parent_inode_info;
+    struct super_block *sb = dir->i_sb;
+    uint64_t ino;
+    int ret;
+
+    //Reservamos un numero de inodo libre en el mapa de bits de inodos
+    ret = assoofs_sb_get_a_freeinode(sb, &ino);
+    if(ret)
+	    return ret;
+    
+
+    //Creamos el nuevo inode y le asignamos sus atributos
+    inode = new_inode(sb);
+    if(!inode){
+	    assoofs_bitmap_free(sb, &ASSOOFS_SB(sb)->inode_bitmap, ino);
+	    return -ENOMEM;
+    }
+    inode->i_sb = sb;
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_ino = ino;
+    
+    //Rellenamos la informacion persistente, que va dentro del propio inodo
+    inode_info = &ASSOOFS_I(inode)->info;
+    inode_info->inode_no = inode->i_ino;
+    inode_info->mode = S_IFDIR | mode;
+    inode_info->dir_children_count = 0;
+
+    inode->i_fop = &assoofs_dir_operations;
+
+    inode_init_owner(inode, dir, S_IFDIR | mode);
+    //Un directorio tiene el enlace de su padre y el suyo propio '.'
+    set_nlink(inode, 2);
+    ret = assoofs_insert_new_inode(inode);
+    if(ret)
+	    return ret;
+
+    //Comprobamos si quedan espacios libres y creamos el indice y la primera hoja del directorio
+    ret = assoofs_dir_init(sb, inode_info);
+    if(ret != 0)
+	    goto out_undo;
+    inode->i_size = inode_info->file_size;
+
+    //Añadimos la informacion del inodo al directorio padre
+    parent_inode_info = &ASSOOFS_I(dir)->info;
+    ret = assoofs_dir_add_entry(sb, parent_inode_info, dentry->d_name.name, inode_info->inode_no, inode_info->mode);
+    if(ret)
+	    goto out_undo;
+
+    //Guardamos la informacion persistente en el disco
+    assoofs_add_inode_info(sb, inode_info);
+
+    //Actualizamos la informacion persistente del inodo padre, que gana el enlace '..' del nuevo directorio
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    down_write(&ASSOOFS_I(dir)->data_sem);
+    inc_nlink(dir);
+    parent_inode_info->dir_children_count++;
+    assoofs_save_inode_info(sb, parent_inode_info);
+    up_write(&ASSOOFS_I(dir)->data_sem);
+
+    d_instantiate_new(dentry, inode);
+    return 0;
+
+out_undo:
+    //Los bloques que haya cogido dir_init, como mucho dos, vuelven al mapa despues del checkpoint
+    down_write(&ASSOOFS_I(inode)->data_sem);
+    assoofs_free_extents(sb, inode_info, 0);
+    up_write(&ASSOOFS_I(inode)->data_sem);
+    assoofs_bitmap_free(sb, &ASSOOFS_SB(sb)->inode_bitmap, ino);
+    discard_new_inode(inode);
+    return ret;
+}
+
+/**
+ * Borra la entrada de un archivo de su directorio. El inodo y sus bloques se
+ * liberan en assoofs_evict_inode cuando se suelta la ultima referencia.
+ * @param dir inodo del directorio
+ * @param dentry entrada que se borra
+ * @return 0 si todo salio bien o un error
+ */
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry){
+    struct super_block *sb = dir->i_sb;
+    u64 start = ktime_get_ns();
+    int ret;
+    unsigned int nofs;
+
+    nofs = assoofs_journal_start(sb, ASSOOFS_UNLINK_CREDITS);
+    ret = assoofs_unlink_locked(dir, dentry);
+    assoofs_journal_stop(sb, ASSOOFS_UNLINK_CREDITS, nofs);
+    if(!ret && IS_DIRSYNC(dir))
+	    ret = assoofs_journal_commit(sb, READ_ONCE(ASSOOFS_SB(sb)->journal.sequence));
+    if(!ret)
+	    assoofs_stat_inc(sb, ASSOOFS_STAT_UNLINKS);
+    trace_assoofs_unlink(dir, dentry, ret, ktime_get_ns() - start);
+    return ret;
+}
+
+/**
+ * Borra un directorio vacio
+ * @param dir inodo del directorio padre
+ * @param dentry entrada del directorio que se borra
+ * @return 0 si todo salio bien, -ENOTEMPTY si tiene entradas o un error
+ */
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry){
+    struct super_block *sb = dir->i_sb;
+    u64 start = ktime_get_ns();
+    int ret = -ENOTEMPTY;
+    unsigned int nofs;
+
+    if(!ASSOOFS_I(d_inode(dentry))->info.dir_children_count){
+	    nofs = assoofs_journal_start(sb, ASSOOFS_UNLINK_CREDITS);
+	    ret = assoofs_unlink_locked(dir, dentry);
+	    assoofs_journal_stop(sb, ASSOOFS_UNLINK_CREDITS, nofs);
+	    if(!ret && IS_DIRSYNC(dir))
+		    ret = assoofs_journal_commit(sb, READ_ONCE(ASSOOFS_SB(sb)->journal.sequence));
+    }
+    if(!ret)
+	    assoofs_stat_inc(sb, ASSOOFS_STAT_RMDIRS);
+    trace_assoofs_rmdir(dir, dentry, ret, ktime_get_ns() - start);
+    return ret;
+}
+
+/**
+ * Quita la entrada del directorio padre y un enlace al inodo, dentro de la
+ * transaccion que ha abierto assoofs_unlink o assoofs_rmdir. Un directorio
+ * pierde los dos enlaces y su padre el de '..'.
+ */
+static int assoofs_unlink_locked(struct inode *dir, struct dentry *dentry){
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode_info *parent_inode_info = &ASSOOFS_I(dir)->info;
+    struct super_block *sb = dir->i_sb;
+    int ret;
+
+    ret = assoofs_dir_delete_entry(sb, parent_inode_info, dentry->d_name.name);
+    if(ret)
+	    return ret;
+
+    dir->i_mtime = dir->i_ctime = inode->i_ctime = current_time(dir);
+    down_write(&ASSOOFS_I(dir)->data_sem);
+    parent_inode_info->dir_children_count--;
+    if(S_ISDIR(inode->i_mode))
+	    drop_nlink(dir);
+    assoofs_save_inode_info(sb, parent_inode_info);
+    up_write(&ASSOOFS_I(dir)->data_sem);
+
+    down_write(&ASSOOFS_I(inode)->data_sem);
+    if(S_ISDIR(inode->i_mode))
+	    clear_nlink(inode);
+    else
+	    drop_nlink(inode);
+    assoofs_save_inode_info(sb, &ASSOOFS_I(inode)->info);
+    up_write(&ASSOOFS_I(inode)->data_sem);
+    return 0;
+}
+
+/**
+ * Mueve una entrada de directorio. Si el destino existe su entrada pasa a
+ * apuntar al inodo movido, en su sitio, y el inodo que habia pierde un
+ * enlace. Todo va en una sola transaccion.
+ * @param old_dir directorio de origen
+ * @param old_dentry entrada que se mueve
+ * @param new_dir directorio de destino
+ * @param new_dentry entrada de destino
+ * @param flags solo se admite RENAME_NOREPLACE, que ya comprueba el VFS
+ * @return 0 si todo salio bien o un error
+ */
+static int assoofs_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags){
+    struct super_block *sb = old_dir->i_sb;
+    struct inode *inode = d_inode(old_dentry);
+    struct inode *target = d_inode(new_dentry);
+    struct assoofs_inode_info *old_info = &ASSOOFS_I(old_dir)->info;
+    struct assoofs_inode_info *new_info = &ASSOOFS_I(new_dir)->info;
+    int is_dir = S_ISDIR(inode->i_mode);
+    u64 start = ktime_get_ns();
+    int ret;
+    unsigned int nofs;
+
+    if(flags & ~RENAME_NOREPLACE)
+	    return -EINVAL;
+    if(target && S_ISDIR(target->i_mode) && ASSOOFS_I(target)->info.dir_children_count)
+	    return -ENOTEMPTY;
+
+    nofs = assoofs_journal_start(sb, ASSOOFS_RENAME_CREDITS);
+    //Primero los dos cambios que pueden fallar; el resto ya no falla
+    if(target)
+	    ret = assoofs_dir_set_entry(sb, new_info, new_dentry->d_name.name, inode->i_ino, inode->i_mode);
+    else
+	    ret = assoofs_dir_add_entry(sb, new_info, new_dentry->d_name.name, inode->i_ino, inode->i_mode);
+    if(ret)
+	    goto out;
+    ret = assoofs_dir_delete_entry(sb, old_info, old_dentry->d_name.name);
+    if(ret){
+	    //Deshacemos el destino dentro del mismo manejador, sin reservar nada nuevo
+	    if((target && assoofs_dir_set_entry(sb, new_info, new_dentry->d_name.name, target->i_ino, target->i_mode)) ||
+	       (!target && assoofs_dir_delete_entry(sb, new_info, new_dentry->d_name.name)))
+		    printk(KERN_ERR "assoofs: no se puede deshacer el renombrado de %s\n", old_dentry->d_name.name);
+	    goto out;
+    }
+
+    if(target){
+	    target->i_ctime = current_time(target);
+	    down_write(&ASSOOFS_I(target)->data_sem);
+	    if(S_ISDIR(target->i_mode))
+		    clear_nlink(target);
+	    else
+		    drop_nlink(target);
+	    assoofs_save_inode_info(sb, &ASSOOFS_I(target)->info);
+	    up_write(&ASSOOFS_I(target)->data_sem);
+    }
+
+    old_dir->i_mtime = old_dir->i_ctime = current_time(old_dir);
+    new_dir->i_mtime = new_dir->i_ctime = old_dir->i_mtime;
+    inode->i_ctime = old_dir->i_mtime;
+
+    //El padre pierde la entrada y, si es un directorio, el enlace de su '..'
+    down_write(&ASSOOFS_I(old_dir)->data_sem);
+    old_info->dir_children_count--;
+    if(is_dir)
+	    drop_nlink(old_dir);
+    assoofs_save_inode_info(sb, old_info);
+    up_write(&ASSOOFS_I(old_dir)->data_sem);
+
+    //Un destino que existia se sustituye sin cambiar el numero de entradas ni de '..'
+    down_write(&ASSOOFS_I(new_dir)->data_sem);
+    if(!target){
+	    new_info->dir_children_count++;
+	    if(is_dir)
+		    inc_nlink(new_dir);
+    }
+    assoofs_save_inode_info(sb, new_info);
+    up_write(&ASSOOFS_I(new_dir)->data_sem);
+
+    down_write(&ASSOOFS_I(inode)->data_sem);
+    assoofs_save_inode_info(sb, &ASSOOFS_I(inode)->info);
+    up_write(&ASSOOFS_I(inode)->data_sem);
+out:
+    assoofs_journal_stop(sb, ASSOOFS_RENAME_CREDITS, nofs);
+    if(!ret && (IS_DIRSYNC(old_dir) || IS_DIRSYNC(new_dir)))
+	    ret = assoofs_journal_commit(sb, READ_ONCE(ASSOOFS_SB(sb)->journal.sequence));
+    if(!ret)
+	    assoofs_stat_inc(sb, ASSOOFS_STAT_RENAMES);
+    trace_assoofs_rename(old_dir, old_dentry, new_dir, new_dentry, ret, ktime_get_ns() - start);
+    return ret;
+}
+
+/*
+ *  Operaciones sobre el superbloque
+ */
+static struct inode *assoofs_alloc_inode(struct super_block *sb);
+static void assoofs_free_inode(struct inode *inode);
+static void assoofs_evict_inode(struct inode *inode);
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc);
+static int assoofs_sync_fs(struct super_block *sb, int wait);
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf);
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root);
+static void assoofs_put_super(struct super_block *sb);
+static const struct super_operations assoofs_sops = {
+    .alloc_inode = assoofs_alloc_inode,
+    .free_inode = assoofs_free_inode,
+    .evict_inode = assoofs_evict_inode,
+    .write_inode = assoofs_write_inode,
+    .sync_fs = assoofs_sync_fs,
+    .statfs = assoofs_statfs,
+    .show_options = assoofs_show_options,
+    .put_super = assoofs_put_super,
+};
+
+/**
+ * Reserva un inodo del slab, con la informacion persistente a continuacion
+ * @param sb superbloque
+ * @return inodo del VFS o NULL si no hay memoria
+ */
+static struct inode *assoofs_alloc_inode(struct super_block *sb){
+    struct assoofs_inode *ai;
+
+    ai = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
+    if(!ai)
+        return NULL;
+    memset(&ai->info, 0, sizeof(ai->info));
+    return &ai->vfs_inode;
+}
 
-	//Guardamos la informacion persistente del inodo
-	inode->i_private = inode_info;
+/**
+ * Devuelve un inodo al slab, una vez pasado el periodo de gracia de RCU
+ * @param inode inodo
+ */
+static void assoofs_free_inode(struct inode *inode){
+    kmem_cache_free(assoofs_inode_cache, ASSOOFS_I(inode));
+}
 
-	return inode;
+/**
+ * Libera como mucho ASSOOFS_FREE_RUNS rachas del final de un inodo, sin
+ * bajar del bloque logico from, dentro de un manejador abierto con
+ * assoofs_journal_start_free. Los bloques esperan al checkpoint: los de un
+ * directorio por si una transaccion sin escribir aun los usa, y los de un
+ * fichero porque hasta el commit el inodo en disco sigue apuntando a ellos,
+ * y tras una caida veria los datos que otro fichero hubiera escrito encima.
+ * @param sb superbloque
+ * @param inode_info datos del inodo, con data_sem cogido en escritura
+ * @param from primer bloque logico que se libera
+ * @return 1 si quedan bloques por liberar, 0 si no o -EIO
+ */
+static int assoofs_free_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t from){
+    struct assoofs_bitmap *bm = &ASSOOFS_SB(sb)->block_bitmap;
+    uint64_t bits_per_block = bm->words_per_block * 64;
+    struct buffer_head *bh = NULL;
+    struct assoofs_extent *overflow = NULL;
+    struct assoofs_extent *ext;
+    uint64_t last, keep, n;
+    unsigned int runs;
+    int more = 0;
+
+    if(inode_info->extent_block){
+        bh = sb_bread(sb, inode_info->extent_block);
+        if(!bh)
+            return -EIO;
+        overflow = (struct assoofs_extent *)bh->b_data;
+    }
 
+    for(runs = 0; runs < ASSOOFS_FREE_RUNS && inode_info->extent_count; runs++){
+        ext = assoofs_extent_at(inode_info, overflow, inode_info->extent_count - 1);
+        if((uint64_t)ext->ee_block + ext->ee_len <= from)
+            break;
+        //Cada racha cae dentro de un solo bloque del mapa
+        keep = from > ext->ee_block ? from - ext->ee_block : 0;
+        last = ext->ee_start + ext->ee_len - 1;
+        n = min_t(uint64_t, ext->ee_len - keep, last % bits_per_block + 1);
+        assoofs_journal_defer_free(sb, last + 1 - n, n);
+        ext->ee_len -= n;
+        if(!ext->ee_len){
+            memset(ext, 0, sizeof(*ext));
+            inode_info->extent_count--;
+        }
+    }
+    if(inode_info->extent_count){
+        ext = assoofs_extent_at(inode_info, overflow, inode_info->extent_count - 1);
+        more = (uint64_t)ext->ee_block + ext->ee_len > from;
+    }
+    if(inode_info->extent_block && inode_info->extent_count <= ASSOOFS_INLINE_EXTENTS){
+        assoofs_journal_defer_free(sb, inode_info->extent_block, 1);
+        inode_info->extent_block = 0;
+    }else if(bh){
+        assoofs_journal_dirty(sb, bh);
+    }
+    brelse(bh);
+    return more;
 }
+
 /**
- * Busca la entrada con el nombre (child_dentry->d_name.name) en el
- * directorio padre.
- * @param parent_inode contiene la informacion del directorio padre
- * @param child_dentry contiene la informacion de la entrada que se busca en el directorio padre
- * @param flags
- * @return NULL en cualquier caso
+ * Devuelve al mapa de bits todos los bloques de un inodo borrado, desde el
+ * ultimo tramo hacia atras y en varios manejadores, de modo que el inodo
+ * guardado nunca apunta a bloques ya libres
+ * @param inode inodo sin enlaces
  */
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+static void assoofs_free_inode_blocks(struct inode *inode){
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret;
+    unsigned int nofs;
 
-    struct assoofs_inode_info *parent_info = parent_inode->i_private;
-    struct super_block *sb = parent_inode->i_sb;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i;
+    if(assoofs_has_inline_data(ai))
+        return;
+    do{
+        nofs = assoofs_journal_start_free(sb, ASSOOFS_FREE_CREDITS);
+        down_write(&ai->data_sem);
+        ret = assoofs_free_extents(sb, &ai->info, 0);
+        if(ret >= 0)
+            assoofs_save_inode_info(sb, &ai->info);
+        up_write(&ai->data_sem);
+        assoofs_journal_stop_free(sb, ASSOOFS_FREE_CREDITS, nofs);
+    }while(ret > 0);
+    if(ret < 0){
+        //Los bloques se quedan ocupados hasta que fsck los recupere
+        printk(KERN_ERR "assoofs: no se pueden liberar los bloques del inodo %lu\n", inode->i_ino);
+    }
+}
 
-    printk(KERN_INFO "Lookup request\n");
+/**
+ * Cambia el tamaño de un fichero. Al recortarlo se ponen a cero los bytes
+ * que quedan fuera dentro del inodo o del ultimo bloque, y se liberan los
+ * bloques enteros desde el final, como al borrarlo.
+ * @param inode inodo del fichero, con su cerrojo cogido
+ * @param size nuevo tamaño
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_truncate(struct inode *inode, loff_t size){
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    uint64_t from;
+    size_t len;
+    int ret;
+    unsigned int nofs;
 
-    //Accedemos al bloque de disco apuntado por parent_inode
-    bh = sb_bread(sb, parent_info->data_block_number);
+    inode_dio_wait(inode);
 
-    //Recorremos el contenido buscando la entrada que corresponda al nombre
-    record = (struct assoofs_dir_record_entry *) bh->b_data;
-    for(i = 0; i < parent_info->dir_children_count; i++){
-	    if(!strcmp(record->filename, child_dentry->d_name.name)){
-		    struct inode *inode = assoofs_get_inode(sb, record->inode_no);
-		    inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);
-		    d_add(child_dentry, inode);
-		    printk(KERN_INFO "Se ha encontrado la entrada");
-		    return NULL;
-	    }
-	    record++;
+    if(assoofs_has_inline_data(ai)){
+        if(size <= ASSOOFS_INLINE_DATA_MAX){
+            truncate_setsize(inode, size);
+            nofs = assoofs_journal_start(sb, 1);
+            down_write(&ai->data_sem);
+            len = min_t(uint64_t, size, ai->info.file_size);
+            memset(ai->info.inline_data + len, 0, ASSOOFS_INLINE_DATA_MAX - len);
+            ai->info.file_size = size;
+            assoofs_save_inode_info(sb, &ai->info);
+            up_write(&ai->data_sem);
+            assoofs_journal_stop(sb, 1, nofs);
+            return 0;
+        }
+        ret = assoofs_convert_inline_data(inode, 0);
+        if(ret)
+            return ret;
     }
-    printk(KERN_INFO "No se ha encontrado la entrada");
-    return NULL;
+
+    if(size < i_size_read(inode)){
+        ret = block_truncate_page(inode->i_mapping, size, assoofs_get_block);
+        if(ret)
+            return ret;
+    }
+    //Invalida las paginas de fuera y con ellas las reservas de bloques diferidos
+    truncate_setsize(inode, size);
+
+    from = (size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+    do{
+        nofs = assoofs_journal_start_free(sb, ASSOOFS_FREE_CREDITS);
+        down_write(&ai->data_sem);
+        ret = assoofs_free_extents(sb, &ai->info, from);
+        ai->info.file_size = size;
+        assoofs_save_inode_info(sb, &ai->info);
+        up_write(&ai->data_sem);
+        assoofs_journal_stop_free(sb, ASSOOFS_FREE_CREDITS, nofs);
+    }while(ret > 0);
+    return ret;
 }
 
 /**
- * Permite crear inodos para archivos
- * @param dir inodo del directorio
- * @param dentry entrada del nuevo archivo
- * @param mode modo del nuevo archivo
- * @param excl
- * @return 0 si todo salio bien o sino devuelve un error
+ * Cambia los atributos de un inodo: dueño, permisos, tiempos y tamaño
+ * @param dentry entrada del inodo
+ * @param attr atributos que cambian
+ * @return 0 si todo sale bien o un error
  */
-static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
-    //Estructura del inodo
-    struct inode *inode;
-    //Estructura que guarda la informacion persistente del inodo
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    struct super_block *sb;
-    uint64_t count;
-    struct buffer_head *bh;
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr){
+    struct inode *inode = d_inode(dentry);
     int ret;
 
-    printk(KERN_INFO "New file request\n");
-    //Obtenemos un puntero al superbloque desde el directorio
-    sb = dir->i_sb;
-    //Obtenemos el numero de inodos en el sistema de archivos
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-    
+    ret = setattr_prepare(dentry, attr);
+    if(ret)
+        return ret;
 
-    //Creamos el nuevo inode y le asignamos sus atributos
-    inode = new_inode(sb);
-    inode->i_sb = sb;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_ino = count + 1;
-    if(inode->i_ino > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-	    printk(KERN_ERR "No se admiten mas inodos.\n");
-	    return -1;
+    if((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)){
+        ret = assoofs_truncate(inode, attr->ia_size);
+        if(ret)
+            return ret;
     }
-    
-    //Añadimos la informacion persistente al inodo
-    inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-    inode_info->inode_no = inode->i_ino;
-    inode_info->mode = mode;
-    inode_info->file_size = 0;
-    inode->i_private = inode_info;
+    setattr_copy(inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
 
-    //Asignamos operaciones de fichero al inodo
-    inode->i_fop = &assoofs_file_operations;
+/**
+ * Borra un inodo de la tabla y devuelve su numero al mapa de bits de inodos
+ * @param inode inodo sin enlaces y sin bloques
+ */
+static void assoofs_release_inode(struct inode *inode){
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_disk_inode *inode_pos;
+    struct buffer_head *bh;
+    unsigned int nofs;
 
-    //Asignamos propietario y permisos y añadimos al arbol de directorios el nuevo inodo
-    inode_init_owner(inode, dir, mode);
-    d_add(dentry, inode);
+    nofs = assoofs_journal_start(sb, ASSOOFS_FREE_CREDITS);
+    inode_pos = assoofs_inode_table_slot(sb, inode->i_ino, &bh);
+    if(inode_pos){
+        //Un registro a cero es un hueco libre de la tabla
+        memset(inode_pos, 0, sizeof(*inode_pos));
+        assoofs_journal_dirty(sb, bh);
+        brelse(bh);
+        assoofs_bitmap_free(sb, &sbi->inode_bitmap, inode->i_ino);
 
-    //Comprobamos si quedan espacios libres
-    ret = assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-    if(ret != 0){
-	    printk(KERN_ERR "No quedan bloques libres");
-	    return ret;
+        spin_lock(&sbi->lock);
+        sbi->disk_sb->inodes_count--;
+        spin_unlock(&sbi->lock);
+        assoofs_save_sb_info(sb);
     }
+    assoofs_journal_stop(sb, ASSOOFS_FREE_CREDITS, nofs);
+}
 
-    //Guardamos la informacion persistente en el disco
-    assoofs_add_inode_info(sb, inode_info);
+/**
+ * Saca un inodo de memoria cuando la cache de inodos lo descarta. Si ya no
+ * tiene enlaces se liberan sus bloques y su numero de inodo.
+ * @param inode inodo
+ */
+static void assoofs_evict_inode(struct inode *inode){
+    int delete = !inode->i_nlink && !is_bad_inode(inode);
 
-    //Añadimos la informacion del inodo al directorio padre
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no;
+    //Antes de liberar nada, porque al descartar las paginas se devuelven sus reservas
+    truncate_inode_pages_final(&inode->i_data);
+    if(delete){
+        assoofs_free_inode_blocks(inode);
+        assoofs_release_inode(inode);
+    }
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+}
 
-    strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+/**
+ * Constructor del slab: el inodo del VFS se inicializa una sola vez por objeto
+ */
+static void assoofs_inode_init_once(void *obj){
+    struct assoofs_inode *ai = obj;
 
-    //Actualizamos la informacion persistente del inodo padre
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
-    brelse(bh);
-    return 0;
+    init_rwsem(&ai->data_sem);
+    inode_init_once(&ai->vfs_inode);
 }
 
 /**
- * Permite encontrar y asignar un bloque libre accediendo al mapa de bits
- * @param sb superbloque
- * @param block puntero al numero de bloque de un inodo
- * @return 0 si todo salio bien sino devuelve -1
+ * Permite obtener la informacion persistente del inodo que esta el la posicion inode_no
+ * @param sb el superbloque
+ * @param inode_no numero de inodo en el almacen de inodos
+ * @param inode_info donde se copia la información persistente del inodo
+ * @return 0 si todo sale bien, -EIO si no se puede leer o -EUCLEAN si el registro no es valido
  */
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
-    //Asignamos a assoofs_sb la informacion persistente del superbloque
-	struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    int i;
-	printk(KERN_INFO "Get free block request\n");
-	//Se busca un bit que este a uno en el mapa de bits
-	for(i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++){
-		if(assoofs_sb->free_blocks & (1 << i))
-			break;
-	}
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info){
+    //Se accede a disco a la posicion del inodo en la tabla de inodos
+	struct assoofs_disk_inode *inode_pos;
+	struct buffer_head *bh;
+	int ret = 0;
 
-	//Se Comprueba el ultimo bloque para ver si quedan sitios libres
-	if(!(assoofs_sb->free_blocks & (1 << i))){
-		printk(KERN_ERR "No quedan bloques libres\n");
-		return -1;
-	}else {
-		printk(KERN_INFO "Existen bloques libres\n");
+	inode_pos = assoofs_inode_table_slot(sb, inode_no, &bh);
+	if(!inode_pos)
+		return -EIO;
+	if(le16_to_cpu(inode_pos->version) == ASSOOFS_INODE_VERSION){
+		assoofs_inode_from_disk(inode_pos, inode_info);
+	}else{
+		printk(KERN_ERR "Version del inodo %llu no soportada\n", inode_no);
+		ret = -EUCLEAN;
 	}
-	//Se asigna el numero de bloque
-	*block = i;
-	assoofs_sb->free_blocks &= ~(1 << i);
-	assoofs_save_sb_info(sb);
-	return 0;
+
+	//Se liberan los recursos
+	brelse(bh);
+	return ret;
 }
 
 /**
- * Actualiza la información persistente del superbloque
- * @param vsb superbloque
+ * Copia en el superbloque los contadores de bloques e inodos libres. Solo se
+ * hace en los commit periodicos, en sync y al desmontar, y si no han cambiado
+ * no se toca el journal.
+ * @param sb superbloque
  */
-void assoofs_save_sb_info(struct super_block *vsb){
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *sb;
-    printk(KERN_INFO "Save superblock info request\n");
-	sb = vsb->s_fs_info;
-	bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-	bh->b_data = (char *)sb;
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-	printk(KERN_INFO "Guardado informacion persistente del sb en disco\n");
+static void assoofs_save_free_counts(struct super_block *sb){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t blocks = percpu_counter_sum_positive(&sbi->block_bitmap.free);
+    uint64_t inodes = percpu_counter_sum_positive(&sbi->inode_bitmap.free);
+    unsigned int nofs;
+
+    if(READ_ONCE(sbi->disk_sb->free_blocks) == blocks && READ_ONCE(sbi->disk_sb->free_inodes) == inodes)
+        return;
+    nofs = assoofs_journal_start(sb, 1);
+    spin_lock(&sbi->lock);
+    sbi->disk_sb->free_blocks = blocks;
+    sbi->disk_sb->free_inodes = inodes;
+    spin_unlock(&sbi->lock);
+    assoofs_save_sb_info(sb);
+    assoofs_journal_stop(sb, 1, nofs);
 }
 
 /**
- * Guarda en disco la informacion persistente del inodo
+ * Al sincronizar el sistema de ficheros se hace commit de la transaccion en curso
  * @param sb superbloque
- * @param inode informacion persistente del inodo
+ * @param wait si hay que esperar a que acaben las escrituras
+ * @return 0 si todo sale bien o un error
  */
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+static int assoofs_sync_fs(struct super_block *sb, int wait){
+    if(!wait)
+        return 0;
+    assoofs_save_free_counts(sb);
+    return assoofs_journal_commit(sb, READ_ONCE(ASSOOFS_SB(sb)->journal.sequence));
+}
 
-    struct assoofs_super_block_info *assoofs_sb_info = sb->s_fs_info;
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
+/**
+ * Informa del espacio libre a statfs. Se lee de los contadores por CPU sin
+ * coger ningun cerrojo ni sumar las copias de cada CPU, asi que se puede
+ * consultar tan a menudo como se quiera; el resultado puede desviarse en
+ * unos pocos bloques por CPU. Los bloques apartados por la asignacion
+ * retrasada cuentan como ocupados, y los ASSOOFS_META_RESERVE que se dejan
+ * para los metadatos no estan disponibles para los usuarios.
+ * @param dentry cualquier entrada del sistema de ficheros
+ * @param buf estadisticas a rellenar
+ * @return 0
+ */
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf){
+    struct super_block *sb = dentry->d_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    s64 bfree;
 
-	printk(KERN_INFO "Add inode info request\n");
+    bfree = percpu_counter_read_positive(&sbi->block_bitmap.free) -
+        percpu_counter_read_positive(&sbi->block_bitmap.reserved);
+    buf->f_type = ASSOOFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = sbi->disk_sb->blocks_count;
+    buf->f_bfree = max_t(s64, bfree, 0);
+    buf->f_bavail = max_t(s64, bfree - ASSOOFS_META_RESERVE, 0);
+    buf->f_files = sbi->disk_sb->inodes_total;
+    buf->f_ffree = percpu_counter_read_positive(&sbi->inode_bitmap.free);
+    buf->f_namelen = ASSOOFS_FILENAME_MAXLEN;
+    buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+    return 0;
+}
 
-	//Leemos el bloque de los inodos en disco
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+/**
+ * Hace commit del journal cada commit segundos, de modo que como mucho se
+ * pierden los metadatos de los ultimos commit segundos
+ */
+static void assoofs_commit_work(struct work_struct *work){
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, commit_work);
 
-	//Obtenemos un puntero al almacen y colocamos al final el nuevo inodo
-	inode_info = (struct assoofs_inode_info *) bh->b_data;
-	inode_info += assoofs_sb_info->inodes_count;
-	memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+    assoofs_save_free_counts(sbi->sb);
+    assoofs_journal_commit(sbi->sb, READ_ONCE(sbi->journal.sequence));
+    schedule_delayed_work(&sbi->commit_work, sbi->commit_interval * HZ);
+}
 
-	//Lo marcamos como sucio y lo sincronizamos con el disco
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+enum {
+    Opt_commit, Opt_readahead, Opt_err
+};
 
-	//Cambiamos el numero de inodos y guardamos la información del superbloque
-	assoofs_sb_info->inodes_count++;
-	assoofs_save_sb_info(sb);
-	printk(KERN_INFO "Añadido la informacion persistente a disco\n");
-}
+static const match_table_t assoofs_tokens = {
+    {Opt_commit, "commit=%u"},
+    {Opt_readahead, "readahead=%u"},
+    {Opt_err, NULL}
+};
 
 /**
- * Actualizamos la informacion persistente del inodo
- * @param sb superbloque
- * @param inode_info informacion persistente del inodo
- * @return 0 si todo sale bien y -1 si se produce un error
+ * Interpreta las opciones de montaje. sync y dirsync las trata el VFS.
+ * @param data cadena de opciones separadas por comas
+ * @param sbi informacion del superbloque en memoria
+ * @return 0 si todo sale bien o -EINVAL
  */
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
-	struct assoofs_inode_info *inode_pos;
-	struct assoofs_inode_info *inode_disk;
-	struct buffer_head *bh;
-	printk(KERN_INFO "Save inode info request\n");
+static int assoofs_parse_options(char *data, struct assoofs_sb_info *sbi){
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int option;
 
-	//Accedemos al almacen de inodos en disco
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-	inode_disk = (struct assoofs_inode_info *)bh->b_data;
-	//Buscamos el puntero a la informacion persistente del inodo en disco
-	inode_pos = assoofs_search_inode_info(sb, inode_disk, inode_info);
-	if(inode_pos == NULL){
-		printk(KERN_ERR "Informacion del inodo no encontrado\n");
-		return -1;
-	}
-	//Actualizamos el inodo y marcamos el bloque a sucio y lo sincronizamos
-	memcpy(inode_pos, inode_info, sizeof(*inode_pos));
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+    sbi->commit_interval = ASSOOFS_DEFAULT_COMMIT_INTERVAL;
+    if(!data)
+        return 0;
 
-	printk(KERN_INFO "Guardado informacion persistente del nodo\n");
-	brelse(bh);
-	return 0;
+    while((p = strsep(&data, ",")) != NULL){
+        if(!*p)
+            continue;
+        switch(match_token(p, assoofs_tokens, args)){
+        case Opt_commit:
+            if(match_int(&args[0], &option) || option < 0)
+                return -EINVAL;
+            sbi->commit_interval = option;
+            break;
+        case Opt_readahead:
+            //En KiB, como read_ahead_kb del dispositivo
+            if(match_int(&args[0], &option) || option <= 0)
+                return -EINVAL;
+            sbi->ra_pages = max_t(unsigned long, option / (PAGE_SIZE / 1024), 1);
+            break;
+        default:
+            printk(KERN_ERR "Opcion de montaje desconocida: %s\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
 }
 
 /**
- * Buscamos el puntero a la informacion persistente de inodo
- * @param sb superbloque
- * @param start inodo donde empieza
- * @param search inodo que se busca
- * @return puntero a la informacion persistente del inodo
+ * Muestra en /proc/mounts las opciones que no tienen el valor por defecto
  */
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
-	uint64_t count = 0;
-	uint64_t inodes_count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-	printk(KERN_INFO "Search inode info request\n");
-	//Buscamos el inodo que tenga el mismo número de inodo
-	while(start->inode_no != search->inode_no && count < inodes_count){
-		count++;
-		start++;
-	}
-	//Devolvemos el puntero si se ha encontrado el inodo que se busca
-	if(start->inode_no == search->inode_no) {
-	    printk(KERN_INFO "Se ha encontrado el inodo");
-	    return start;
-	}else {
-	    printk(KERN_INFO "No se ha encontrado el inodo");
-	    return NULL;
-	}
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(root->d_sb);
+
+    if(sbi->commit_interval != ASSOOFS_DEFAULT_COMMIT_INTERVAL)
+        seq_printf(seq, ",commit=%lu", sbi->commit_interval);
+    if(sbi->ra_pages)
+        seq_printf(seq, ",readahead=%lu", sbi->ra_pages * (PAGE_SIZE / 1024));
+    return 0;
 }
 
-/**
- * Permite crear inodos para directorios
- * @param dir Directorio donde se creará el nuevo directorio
- * @param dentry entrada del directorio en el padre
- * @param mode modo del directorio
- * @return 0 o -1 dependiendo de si sale bien
+/*
+ *  Estadisticas en /sys/fs/assoofs/<dispositivo>/, un fichero por contador
  */
-static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
+static struct kset *assoofs_kset;
 
-    //Estructura del inodo
-    struct inode *inode;
-    //Estructura que guarda la informacion persistente del inodo
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    struct super_block *sb;
-    uint64_t count;
-    struct buffer_head *bh;
-    int ret;
+struct assoofs_stat_attr {
+    struct attribute attr;
+    enum assoofs_stat stat;
+};
 
-    printk(KERN_INFO "New directory request\n");
-    //Obtenemos un puntero al superbloque desde el directorio
-    sb = dir->i_sb;
-    //Obtenemos el numero de inodos en el sistema de archivos
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
-    
+#define ASSOOFS_STAT_ATTR(_name, _stat)                 \
+static struct assoofs_stat_attr assoofs_attr_##_name = { \
+    .attr = { .name = #_name, .mode = 0444 },           \
+    .stat = _stat,                                      \
+}
 
-    //Creamos el nuevo inode y le asignamos sus atributos
-    inode = new_inode(sb);
-    inode->i_sb = sb;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_ino = count + 1;
-    if(inode->i_ino > ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-	    printk(KERN_ERR "No se admiten mas inodos.\n");
-	    return -1;
-    }
-    
-    //Añadimos la informacion persistente al inodo
-    inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-    inode_info->inode_no = inode->i_ino;
-    inode_info->mode = S_IFDIR | mode;
-    inode_info->dir_children_count = 0;
-    inode->i_private = inode_info;
+ASSOOFS_STAT_ATTR(reads, ASSOOFS_STAT_READS);
+ASSOOFS_STAT_ATTR(read_bytes, ASSOOFS_STAT_READ_BYTES);
+ASSOOFS_STAT_ATTR(writes, ASSOOFS_STAT_WRITES);
+ASSOOFS_STAT_ATTR(write_bytes, ASSOOFS_STAT_WRITE_BYTES);
+ASSOOFS_STAT_ATTR(lookups, ASSOOFS_STAT_LOOKUPS);
+ASSOOFS_STAT_ATTR(lookup_misses, ASSOOFS_STAT_LOOKUP_MISSES);
+ASSOOFS_STAT_ATTR(icache_hits, ASSOOFS_STAT_ICACHE_HITS);
+ASSOOFS_STAT_ATTR(icache_misses, ASSOOFS_STAT_ICACHE_MISSES);
+ASSOOFS_STAT_ATTR(creates, ASSOOFS_STAT_CREATES);
+ASSOOFS_STAT_ATTR(mkdirs, ASSOOFS_STAT_MKDIRS);
+ASSOOFS_STAT_ATTR(unlinks, ASSOOFS_STAT_UNLINKS);
+ASSOOFS_STAT_ATTR(rmdirs, ASSOOFS_STAT_RMDIRS);
+ASSOOFS_STAT_ATTR(renames, ASSOOFS_STAT_RENAMES);
+ASSOOFS_STAT_ATTR(readdirs, ASSOOFS_STAT_READDIRS);
+ASSOOFS_STAT_ATTR(block_allocs, ASSOOFS_STAT_BLOCK_ALLOCS);
+ASSOOFS_STAT_ATTR(blocks_allocated, ASSOOFS_STAT_BLOCKS_ALLOCATED);
+ASSOOFS_STAT_ATTR(blocks_freed, ASSOOFS_STAT_BLOCKS_FREED);
+ASSOOFS_STAT_ATTR(journal_commits, ASSOOFS_STAT_JOURNAL_COMMITS);
 
-    inode->i_fop = &assoofs_dir_operations;
+static struct attribute *assoofs_attrs[] = {
+    &assoofs_attr_reads.attr,
+    &assoofs_attr_read_bytes.attr,
+    &assoofs_attr_writes.attr,
+    &assoofs_attr_write_bytes.attr,
+    &assoofs_attr_lookups.attr,
+    &assoofs_attr_lookup_misses.attr,
+    &assoofs_attr_icache_hits.attr,
+    &assoofs_attr_icache_misses.attr,
+    &assoofs_attr_creates.attr,
+    &assoofs_attr_mkdirs.attr,
+    &assoofs_attr_unlinks.attr,
+    &assoofs_attr_rmdirs.attr,
+    &assoofs_attr_renames.attr,
+    &assoofs_attr_readdirs.attr,
+    &assoofs_attr_block_allocs.attr,
+    &assoofs_attr_blocks_allocated.attr,
+    &assoofs_attr_blocks_freed.attr,
+    &assoofs_attr_journal_commits.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(assoofs);
 
-    inode_init_owner(inode, dir, S_IFDIR | mode);
-    d_add(dentry, inode);
+/**
+ * Muestra un contador sumando las copias de todas las CPUs
+ */
+static ssize_t assoofs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf){
+    struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, kobj);
+    struct assoofs_stat_attr *a = container_of(attr, struct assoofs_stat_attr, attr);
+    u64 sum = 0;
+    int cpu;
 
-    //Comprobamos si quedan espacios libres
-    ret = assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-    if(ret != 0){
-	    printk(KERN_ERR "No quedan bloques libres");
-	    return ret;
-    }
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(sbi->stats, cpu)->count[a->stat];
+    return sysfs_emit(buf, "%llu\n", sum);
+}
 
-    //Guardamos la informacion persistente en el disco
-    assoofs_add_inode_info(sb, inode_info);
+static const struct sysfs_ops assoofs_attr_ops = {
+    .show = assoofs_attr_show,
+};
 
-    //Añadimos la informacion del inodo al directorio padre
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no;
-
-    //Marcamos el bloque como sucio y sincronizamos
-    strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+static void assoofs_sb_release(struct kobject *kobj){
+    struct assoofs_sb_info *sbi = container_of(kobj, struct assoofs_sb_info, kobj);
 
-    //Actualizamos la informacion persistente del inodo padre
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
-    return 0;
+    complete(&sbi->kobj_unregister);
 }
 
-/*
- *  Operaciones sobre el superbloque
- */
-static const struct super_operations assoofs_sops = {
-    .drop_inode = generic_delete_inode,
+static struct kobj_type assoofs_sb_ktype = {
+    .default_groups = assoofs_groups,
+    .sysfs_ops = &assoofs_attr_ops,
+    .release = assoofs_sb_release,
 };
 
 /**
- * Permite obtener la informacion persistente del inodo que esta el la posicion inode_no
- * @param sb el superbloque
- * @param inode_no numero de inodo en el almacen de inodos
- * @return assofs_inode_info con la información persistente del inodo
+ * Crea el directorio del montaje en /sys/fs/assoofs, con el nombre del
+ * dispositivo
+ * @param sb superbloque
+ * @return 0 si todo sale bien o un error
  */
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
-    //Se accede a disco al almacen de inodos para conseguir la informacion de los inodos
-	struct assoofs_inode_info *inode_info = NULL;
-	struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb;
-    struct assoofs_inode_info *buffer;
-    int i;
+static int assoofs_sysfs_register(struct super_block *sb){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    int ret;
+
+    sbi->kobj.kset = assoofs_kset;
+    init_completion(&sbi->kobj_unregister);
+    ret = kobject_init_and_add(&sbi->kobj, &assoofs_sb_ktype, NULL, "%s", sb->s_id);
+    if(ret){
+        kobject_put(&sbi->kobj);
+        wait_for_completion(&sbi->kobj_unregister);
+    }
+    return ret;
+}
 
-	bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-	inode_info = (struct assoofs_inode_info *) bh->b_data;
+/**
+ * Quita el directorio del montaje de /sys/fs/assoofs y espera a que nadie
+ * lo este leyendo, porque el kobject va dentro de la informacion del
+ * superbloque
+ * @param sb superbloque
+ */
+static void assoofs_sysfs_unregister(struct super_block *sb){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
 
-	//Se recorre el almacén de inodos para encontrar el inodo con numero de inodo igual a inode_no
-	afs_sb = sb->s_fs_info;
-	buffer = NULL;
+    kobject_del(&sbi->kobj);
+    kobject_put(&sbi->kobj);
+    wait_for_completion(&sbi->kobj_unregister);
+}
 
-	for(i = 0; i < afs_sb->inodes_count; i++){
-		if(inode_info->inode_no == inode_no){
-			buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-			memcpy(buffer, inode_info, sizeof(*buffer));
-			break;
-		}
-		inode_info++;
-	}
+/**
+ * Comprueba que las zonas del disco que describe el superbloque caben en el
+ * dispositivo, no se pisan y son lo bastante grandes para los bloques y los
+ * inodos que cuentan. Se hace antes de reaplicar el journal o leer los
+ * mapas, que escriben y leen en esas zonas sin mas comprobaciones.
+ * @param sb superbloque del VFS
+ * @param disk_sb superbloque leido del disco
+ * @return 0 si todo sale bien o -EINVAL
+ */
+static int assoofs_check_layout(struct super_block *sb, struct assoofs_super_block_info *disk_sb){
+    uint64_t dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+    uint64_t bits_per_block = sb->s_blocksize * 8;
+    uint64_t inodes_per_block = sb->s_blocksize / sizeof(struct assoofs_disk_inode);
+    struct {
+        const char *name;
+        uint64_t start;
+        uint64_t count;
+    } areas[] = {
+        { "superbloque", ASSOOFS_SUPERBLOCK_BLOCK_NUMBER, 1 },
+        { "mapa de bloques", ASSOOFS_BITMAP_BLOCK_NUMBER, disk_sb->bitmap_blocks },
+        { "mapa de inodos", disk_sb->inode_bitmap_block, disk_sb->inode_bitmap_blocks },
+        { "tabla de inodos", disk_sb->inode_table_block, disk_sb->inode_table_blocks },
+        { "journal", disk_sb->journal_block, disk_sb->journal_blocks },
+    };
+    int i, k;
 
-	//Se liberan los recursos y se devuelve la información del inodo
-	brelse(bh);
-	return buffer;
+    if(disk_sb->blocks_count > dev_blocks){
+	    printk(KERN_ERR "assoofs: el sistema de ficheros tiene %llu bloques pero el dispositivo solo %llu\n", disk_sb->blocks_count, dev_blocks);
+	    return -EINVAL;
+    }
+    for(i = 0; i < ARRAY_SIZE(areas); i++){
+	    if(!areas[i].count || areas[i].start >= disk_sb->blocks_count || areas[i].count > disk_sb->blocks_count - areas[i].start){
+		    printk(KERN_ERR "assoofs: %s (%llu bloques desde el %llu) fuera de los %llu bloques\n", areas[i].name, areas[i].count, areas[i].start, disk_sb->blocks_count);
+		    return -EINVAL;
+	    }
+	    for(k = 0; k < i; k++){
+		    if(areas[i].start < areas[k].start + areas[k].count && areas[k].start < areas[i].start + areas[i].count){
+			    printk(KERN_ERR "assoofs: %s y %s se solapan\n", areas[k].name, areas[i].name);
+			    return -EINVAL;
+		    }
+	    }
+    }
+    //Las zonas caben en el dispositivo, asi que estos productos no desbordan
+    if(disk_sb->bitmap_blocks * bits_per_block < disk_sb->blocks_count){
+	    printk(KERN_ERR "assoofs: el mapa de bloques no cubre los %llu bloques\n", disk_sb->blocks_count);
+	    return -EINVAL;
+    }
+    if(disk_sb->inodes_total <= ASSOOFS_ROOTDIR_INODE_NUMBER ||
+       disk_sb->inode_bitmap_blocks * bits_per_block < disk_sb->inodes_total ||
+       disk_sb->inode_table_blocks * inodes_per_block < disk_sb->inodes_total){
+	    printk(KERN_ERR "assoofs: el mapa o la tabla de inodos no cubren los %llu inodos\n", disk_sb->inodes_total);
+	    return -EINVAL;
+    }
+    return 0;
 }
 
 /*
@@ -581,52 +4095,171 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
 int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb;
+    struct assoofs_sb_info *sbi;
     struct inode *root_inode;
+    uint64_t block_size;
+    int ret = -EPERM;
 
 
-    printk(KERN_INFO "assoofs_fill_super request\n");
-    // 1.- Leer la información persistente del superbloque del dispositivo de bloques
+    // 1.- Leer la información persistente del superbloque del dispositivo de bloques.
+    //Los campos caben en el bloque mas pequeño, asi que se lee primero con el
+    //menor tamaño que admita el dispositivo y despues con el del sistema de ficheros
+    if(!sb_min_blocksize(sb, ASSOOFS_MIN_BLOCK_SIZE)){
+	    printk(KERN_ERR "El dispositivo no admite el tamaño de bloque\n");
+	    return -EINVAL;
+    }
 
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    if(!bh)
+	    return -EIO;
     assoofs_sb = (struct assoofs_super_block_info *) bh->b_data;
     
 
     // 2.- Comprobar los parámetros del superbloque
-    if(assoofs_sb->magic == ASSOOFS_MAGIC){
-	    printk(KERN_INFO "Numero magico de assoofs valido\n");
-    }else{
+    if(assoofs_sb->magic != ASSOOFS_MAGIC){
 	    printk(KERN_ERR "Numero magico invalido\n");
-	    return -EPERM;
+	    goto out_brelse;
     }
 
-    if(assoofs_sb->block_size == ASSOOFS_DEFAULT_BLOCK_SIZE){
-	    printk(KERN_INFO "Tamaño de bloque correcto\n");
-    }else {
-	    printk(KERN_ERR "Tamaño de bloque incorrecto\n");
-	    return -EPERM;
+    block_size = assoofs_sb->block_size;
+    if(block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE || (block_size & (block_size - 1))){
+	    printk(KERN_ERR "Tamaño de bloque %llu incorrecto\n", block_size);
+	    ret = -EINVAL;
+	    goto out_brelse;
+    }
+
+    if(sb->s_blocksize != block_size){
+	    brelse(bh);
+	    //Los bloques mayores que una pagina no se pueden montar
+	    if(!sb_set_blocksize(sb, block_size)){
+		    printk(KERN_ERR "assoofs: el dispositivo no admite bloques de %llu bytes\n", block_size);
+		    return -EINVAL;
+	    }
+	    bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+	    if(!bh)
+		    return -EIO;
+	    assoofs_sb = (struct assoofs_super_block_info *) bh->b_data;
+	    if(assoofs_sb->magic != ASSOOFS_MAGIC || assoofs_sb->block_size != block_size){
+		    printk(KERN_ERR "assoofs: el superbloque ha cambiado al releerlo\n");
+		    ret = -EINVAL;
+		    goto out_brelse;
+	    }
     }
 
+    //Las zonas del disco tienen que caber y no pisarse antes de tocar ninguna
+    ret = assoofs_check_layout(sb, assoofs_sb);
+    if(ret)
+	    goto out_brelse;
+
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
+    sbi = kzalloc(sizeof(struct assoofs_sb_info), GFP_KERNEL);
+    if(!sbi){
+	    ret = -ENOMEM;
+	    goto out_brelse;
+    }
+    spin_lock_init(&sbi->lock);
+    sbi->stats = alloc_percpu(struct assoofs_stats);
+    if(!sbi->stats){
+	    ret = -ENOMEM;
+	    goto out_free;
+    }
+    sbi->sb_bh = bh;
+    sbi->disk_sb = assoofs_sb;
+    sbi->sb = sb;
+    INIT_DELAYED_WORK(&sbi->commit_work, assoofs_commit_work);
+    ret = assoofs_parse_options(data, sbi);
+    if(ret)
+	    goto out_free;
+    sb->s_fs_info = sbi;
+
+    //Antes de leer ningun otro metadato se reaplica el journal
+    ret = assoofs_journal_load(sb);
+    if(ret)
+	    goto out_free;
+
+    //Cargamos los mapas de bits de bloques y de inodos ocupados
+    ret = assoofs_bitmap_load(sb, &sbi->block_bitmap, ASSOOFS_BITMAP_BLOCK_NUMBER, assoofs_sb->blocks_count);
+    if(ret)
+	    goto out_journal;
+    ret = assoofs_bitmap_load(sb, &sbi->inode_bitmap, assoofs_sb->inode_bitmap_block, assoofs_sb->inodes_total);
+    if(ret)
+	    goto out_block_bitmap;
+    sbi->inodes_per_block = sb->s_blocksize / sizeof(struct assoofs_disk_inode);
+    ret = assoofs_sysfs_register(sb);
+    if(ret)
+	    goto out_bitmap;
+
     sb->s_magic = assoofs_sb->magic;
-    sb->s_maxbytes = assoofs_sb->block_size;
+    sb->s_maxbytes = ASSOOFS_MAX_FILE_BLOCKS * assoofs_sb->block_size;
     sb->s_op = &assoofs_sops;
-    sb->s_fs_info = assoofs_sb;
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
 
-    root_inode = new_inode(sb);
+    root_inode = assoofs_iget(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if(IS_ERR(root_inode)){
+	    ret = PTR_ERR(root_inode);
+	    goto out_sysfs;
+    }
+    if(!S_ISDIR(root_inode->i_mode)){
+	    printk(KERN_ERR "El inodo raiz no es un directorio\n");
+	    iput(root_inode);
+	    ret = -EUCLEAN;
+	    goto out_sysfs;
+    }
 
-    inode_init_owner(root_inode, NULL, S_IFDIR);
-    
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode->i_sb = sb;
-    root_inode->i_op = &assoofs_inode_ops;
-    root_inode->i_fop = &assoofs_dir_operations;
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode);
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
-    
     sb->s_root = d_make_root(root_inode);
-    brelse(bh);
+    if(!sb->s_root){
+	    ret = -ENOMEM;
+	    goto out_sysfs;
+    }
+
+    //Con commit=0 solo se hace commit en sync, fsync o cuando se llena la transaccion
+    if(sbi->commit_interval)
+	    schedule_delayed_work(&sbi->commit_work, sbi->commit_interval * HZ);
     return 0;
+
+out_sysfs:
+    assoofs_sysfs_unregister(sb);
+out_bitmap:
+    assoofs_bitmap_release(&sbi->inode_bitmap);
+out_block_bitmap:
+    assoofs_bitmap_release(&sbi->block_bitmap);
+out_journal:
+    assoofs_journal_release(sb);
+out_free:
+    sb->s_fs_info = NULL;
+    free_percpu(sbi->stats);
+    kfree(sbi);
+out_brelse:
+    brelse(bh);
+    return ret;
+}
+
+/**
+ * Libera la informacion del superbloque en memoria al desmontar
+ * @param sb superbloque
+ */
+static void assoofs_put_super(struct super_block *sb){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    cancel_delayed_work_sync(&sbi->commit_work);
+    //Dejamos todos los bloques en su sitio y el journal vacio
+    mutex_lock(&sbi->journal.commit_mutex);
+    //Un primer checkpoint devuelve al mapa los bloques de metadatos liberados
+    if(sbi->journal.freed_count)
+        assoofs_journal_checkpoint(sb);
+    mutex_unlock(&sbi->journal.commit_mutex);
+    assoofs_save_free_counts(sb);
+    mutex_lock(&sbi->journal.commit_mutex);
+    assoofs_journal_checkpoint(sb);
+    mutex_unlock(&sbi->journal.commit_mutex);
+    assoofs_sysfs_unregister(sb);
+    assoofs_journal_release(sb);
+    assoofs_bitmap_release(&sbi->inode_bitmap);
+    assoofs_bitmap_release(&sbi->block_bitmap);
+    brelse(sbi->sb_bh);
+    free_percpu(sbi->stats);
+    kfree(sbi);
+    sb->s_fs_info = NULL;
 }
 
 /*
@@ -634,7 +4267,6 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
  */
 static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
     struct dentry *ret;
-    printk(KERN_INFO "assoofs_mount request\n");
     //TODO: ver si funciona el cambio a direccion assofs_fill_super argumento
     ret = mount_bdev(fs_type, flags, dev_name, data, &assoofs_fill_super);
     // Control de errores a partir del valor de ret. En este caso se puede utilizar la macro IS_ERR: if (IS_ERR(ret)) ...
@@ -648,24 +4280,36 @@ static struct file_system_type assoofs_type = {
     .owner   = THIS_MODULE,
     .name    = "assoofs",
     .mount   = assoofs_mount,
-    .kill_sb = kill_litter_super,
+    .kill_sb = kill_block_super,
 };
 
 static int __init assoofs_init(void) {
     int ret;
-    printk(KERN_INFO "assoofs_init request\n");
+    BUILD_BUG_ON(sizeof(struct assoofs_disk_inode) != ASSOOFS_INODE_SIZE);
+    //Inicializar cache, antes de registrar el sistema de ficheros porque los montajes reservan de ella
+    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT), assoofs_inode_init_once);
+    if(!assoofs_inode_cache)
+        return -ENOMEM;
+    assoofs_kset = kset_create_and_add("assoofs", NULL, fs_kobj);
+    if(!assoofs_kset){
+        kmem_cache_destroy(assoofs_inode_cache);
+        return -ENOMEM;
+    }
     ret = register_filesystem(&assoofs_type);
-    //Inicializar cache
-    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD), NULL);
     // Control de errores a partir del valor de ret
+    if(ret){
+        kset_unregister(assoofs_kset);
+        kmem_cache_destroy(assoofs_inode_cache);
+    }
     return ret;
 }
 
 static void __exit assoofs_exit(void) {
     int ret;
-    printk(KERN_INFO "assoofs_exit request\n");
     ret = unregister_filesystem(&assoofs_type);
-    //Liberar caché
+    kset_unregister(assoofs_kset);
+    //Liberar caché, esperando a los inodos que todavia se liberan por RCU
+    rcu_barrier();
     kmem_cache_destroy(assoofs_inode_cache);
     // Control de errores a partir del valor de ret
 }
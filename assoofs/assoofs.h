@@ -1,43 +1,483 @@
 #define ASSOOFS_MAGIC 0x20200406
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
+#define ASSOOFS_MIN_BLOCK_SIZE 1024
+#define ASSOOFS_MAX_BLOCK_SIZE 65536
 #define ASSOOFS_FILENAME_MAXLEN 255
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
+#define ASSOOFS_DEFAULT_COMMIT_INTERVAL 5
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
-const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
-const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
-const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
+#define ASSOOFS_SUPERBLOCK_BLOCK_NUMBER 0
+#define ASSOOFS_BITMAP_BLOCK_NUMBER 1
+#define ASSOOFS_ROOTDIR_INODE_NUMBER 1
 
+#ifndef __KERNEL__
+//mkassoofs usa los mismos nombres que el kernel para pasar a little endian
+#include <endian.h>
+#define cpu_to_le16(x) htole16(x)
+#define cpu_to_le32(x) htole32(x)
+#define cpu_to_le64(x) htole64(x)
+#define le16_to_cpu(x) le16toh(x)
+#define le32_to_cpu(x) le32toh(x)
+#define le64_to_cpu(x) le64toh(x)
+#endif
+
+#ifdef __KERNEL__
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Rubén Junior Dos Reis Do Rosario");
 
 //Cache de inodos
 static struct kmem_cache *assoofs_inode_cache;
+#endif
 
-//Semáforos
-static DEFINE_MUTEX(assoofs_sb_lock);
-
+/*
+ * Disposicion del disco: superbloque, bitmap_blocks bloques del mapa de bits
+ * de bloques ocupados (un bit por bloque, a uno si esta ocupado) a partir de
+ * ASSOOFS_BITMAP_BLOCK_NUMBER, mapa de bits de inodos ocupados, tabla de
+ * inodos indexada por numero de inodo, journal de metadatos y bloques de
+ * datos.
+ *
+ * free_blocks y free_inodes se guardan de forma perezosa: el modulo los
+ * actualiza en los commit periodicos, en sync y al desmontar, y al montar los
+ * vuelve a contar en los mapas de bits, asi que despues de una caida pueden
+ * estar desfasados.
+ */
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;    
     uint64_t inodes_count;
+    uint64_t blocks_count;
+    uint64_t bitmap_blocks;
+    uint64_t inodes_total;
+    uint64_t inode_bitmap_block;
+    uint64_t inode_bitmap_blocks;
+    uint64_t inode_table_block;
+    uint64_t inode_table_blocks;
+    uint64_t journal_block;
+    uint64_t journal_blocks;
     uint64_t free_blocks;
-    char padding[4056];
+    uint64_t free_inodes;
+    char padding[3976];
+};
+
+/*
+ * Journal de metadatos. El primer bloque es el superbloque del journal y el
+ * resto un area circular de transacciones: un bloque descriptor con los
+ * bloques de destino, una copia de cada bloque y un bloque de commit con el
+ * crc32 del descriptor y de las copias. Al montar se reaplican, desde start,
+ * las transacciones consecutivas con secuencia creciente y commit valido.
+ */
+#define ASSOOFS_JOURNAL_MAGIC 0x4c4e524a
+#define ASSOOFS_JOURNAL_SUPERBLOCK 1
+#define ASSOOFS_JOURNAL_DESCRIPTOR 2
+#define ASSOOFS_JOURNAL_COMMIT 3
+#define ASSOOFS_JOURNAL_DEFAULT_BLOCKS 1024
+#define ASSOOFS_JOURNAL_MIN_BLOCKS 256
+
+struct assoofs_journal_header {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+};
+
+struct assoofs_journal_super_block {
+    struct assoofs_journal_header header;
+    uint64_t start;
 };
 
+struct assoofs_journal_descriptor {
+    struct assoofs_journal_header header;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t blocks[];
+};
+
+struct assoofs_journal_commit {
+    struct assoofs_journal_header header;
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+/*
+ * Los directorios se indexan por el hash del nombre. El bloque logico 0 es
+ * la raiz del indice: una cabecera y entradas (hash, bloque) ordenadas por
+ * hash, donde cada entrada cubre los nombres con hash desde el suyo hasta el
+ * de la siguiente. Si levels es 1 las entradas de la raiz apuntan a bloques
+ * de indice intermedios y estos a las hojas; si es 0 apuntan directamente a
+ * las hojas, que guardan las entradas del directorio.
+ */
+#define ASSOOFS_DIR_INDEX_MAGIC 0x58444e49
+#define ASSOOFS_DIR_LEAF_MAGIC 0x46414544
+#define ASSOOFS_DIR_MAX_LEVELS 1
+
+struct assoofs_dir_block_header {
+    uint32_t magic;
+    uint16_t count;
+    uint8_t levels;
+    uint8_t reserved;
+};
+
+struct assoofs_dx_entry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+/*
+ * Las hojas guardan entradas de longitud variable a continuacion de la
+ * cabecera. rec_len es la distancia hasta la siguiente entrada, siempre
+ * multiplo de 4, y la ultima entrada llega hasta el final del bloque, de modo
+ * que el hueco que queda detras de una entrada se reutiliza para insertar
+ * otra. Las entradas libres tienen inode_no 0. El nombre no acaba en '\0'.
+ */
+#define ASSOOFS_FT_UNKNOWN 0
+#define ASSOOFS_FT_REG_FILE 1
+#define ASSOOFS_FT_DIR 2
+
+#define ASSOOFS_DIR_REC_LEN(name_len) (((name_len) + 8 + 3) & ~3)
+
 struct assoofs_dir_record_entry {
-    char filename[ASSOOFS_FILENAME_MAXLEN];
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+    uint32_t inode_no;
+    char filename[];
+};
+
+static inline uint8_t assoofs_mode_to_ftype(mode_t mode) {
+    if (S_ISDIR(mode))
+        return ASSOOFS_FT_DIR;
+    if (S_ISREG(mode))
+        return ASSOOFS_FT_REG_FILE;
+    return ASSOOFS_FT_UNKNOWN;
+}
+
+/*
+ * Hash FNV-1a de 32 bits de un nombre. Se guarda en disco, asi que no puede
+ * depender de la arquitectura ni de la version del kernel.
+ */
+static inline uint32_t assoofs_name_hash(const char *name, unsigned int len) {
+    uint32_t hash = 2166136261u;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Posicion de readdir: el hash de la entrada y cuantas entradas con ese mismo
+ * hash, por orden de nombre, van delante. No depende de la hoja ni del sitio
+ * de la entrada en la hoja, asi que sobrevive a las particiones y a la
+ * compactacion. Las posiciones 0 y 1 son '.' y '..'.
+ */
+#define ASSOOFS_DIR_POS_MINOR_BITS 30
+#define ASSOOFS_DIR_POS(hash, minor) ((((int64_t)(hash) << ASSOOFS_DIR_POS_MINOR_BITS) | (minor)) + 2)
+#define ASSOOFS_DIR_POS_HASH(pos) ((uint32_t)(((pos) - 2) >> ASSOOFS_DIR_POS_MINOR_BITS))
+#define ASSOOFS_DIR_POS_MINOR(pos) ((uint32_t)(((pos) - 2) & ((1 << ASSOOFS_DIR_POS_MINOR_BITS) - 1)))
+#define ASSOOFS_DIR_POS_LAST ASSOOFS_DIR_POS(0xffffffffU, (1 << ASSOOFS_DIR_POS_MINOR_BITS) - 1)
+#define ASSOOFS_DIR_EOF 0x7fffffffffffffffLL
+
+#define ASSOOFS_INLINE_EXTENTS 4
+#define ASSOOFS_MAX_FILE_BLOCKS 0xFFFFFFFFULL
+
+/*
+ * Tramo de bloques contiguos de un fichero: los ee_len bloques logicos que
+ * empiezan en ee_block estan en los bloques fisicos que empiezan en ee_start.
+ */
+struct assoofs_extent {
+    uint32_t ee_block;
+    uint32_t ee_len;
+    uint64_t ee_start;
+};
+
+/*
+ * Registro de un inodo en la tabla de inodos: ASSOOFS_INODE_SIZE bytes
+ * empaquetados y en little endian, igual en el modulo y en mkassoofs, que
+ * solo lo leen y escriben con assoofs_inode_from_disk/assoofs_inode_to_disk.
+ * El tamaño es multiplo de la linea de cache, asi que ningun registro cruza
+ * mas lineas de las necesarias, y la primera linea lleva todo lo que
+ * necesita stat. Las posiciones libres de la tabla tienen version 0.
+ * Los primeros ASSOOFS_INLINE_EXTENTS tramos se guardan en el propio inodo y
+ * el resto en el bloque extent_block, ordenados por ee_block.
+ * Los ficheros de hasta ASSOOFS_INLINE_DATA_MAX bytes tienen el flag
+ * ASSOOFS_INODE_INLINE_DATA y guardan sus datos en el sitio de los tramos,
+ * sin ningun bloque de datos. Al crecer por encima se pasan a bloques.
+ */
+#define ASSOOFS_INODE_SIZE 256
+#define ASSOOFS_INODE_VERSION 1
+#define ASSOOFS_INODE_INLINE_DATA 0x1
+#define ASSOOFS_INLINE_DATA_MAX (ASSOOFS_INODE_SIZE - 96)
+
+struct assoofs_disk_extent {
+    uint32_t ee_block;
+    uint32_t ee_len;
+    uint64_t ee_start;
+} __attribute__((packed));
+
+struct assoofs_disk_inode {
+    uint16_t version;
+    uint16_t mode;
+    uint16_t links_count;
+    uint16_t flags;
+    uint32_t uid;
+    uint32_t gid;
     uint64_t inode_no;
+    uint64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t atime_nsec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t extent_count;
+    uint64_t extent_block;
+    uint64_t dir_children_count;
+    uint8_t reserved[8];
+    union {
+        struct assoofs_disk_extent extents[ASSOOFS_INLINE_EXTENTS];
+        char inline_data[ASSOOFS_INLINE_DATA_MAX];
+    };
+} __attribute__((packed));
+
+struct assoofs_time {
+    int64_t sec;
+    uint32_t nsec;
 };
 
+//Informacion persistente del inodo en memoria, en el orden de bytes de la CPU
 struct assoofs_inode_info {
     mode_t mode;
+    uint32_t extent_count;
     uint64_t inode_no;
-    uint64_t data_block_number;
+    uint64_t extent_block;
+    uint64_t file_size;
+    uint64_t dir_children_count;
+    uint32_t flags;
+    uint32_t links_count;
+    uint32_t uid;
+    uint32_t gid;
+    struct assoofs_time atime;
+    struct assoofs_time mtime;
+    struct assoofs_time ctime;
     union {
-        uint64_t file_size;
-        uint64_t dir_children_count;
+        struct assoofs_extent extents[ASSOOFS_INLINE_EXTENTS];
+        char inline_data[ASSOOFS_INLINE_DATA_MAX];
     };
 };
+
+static inline void assoofs_inode_to_disk(const struct assoofs_inode_info *info, struct assoofs_disk_inode *di) {
+    unsigned int i;
+
+    memset(di, 0, sizeof(*di));
+    di->version = cpu_to_le16(ASSOOFS_INODE_VERSION);
+    di->mode = cpu_to_le16(info->mode);
+    di->links_count = cpu_to_le16(info->links_count);
+    di->flags = cpu_to_le16(info->flags);
+    di->uid = cpu_to_le32(info->uid);
+    di->gid = cpu_to_le32(info->gid);
+    di->inode_no = cpu_to_le64(info->inode_no);
+    di->size = cpu_to_le64(info->file_size);
+    di->atime = cpu_to_le64(info->atime.sec);
+    di->mtime = cpu_to_le64(info->mtime.sec);
+    di->ctime = cpu_to_le64(info->ctime.sec);
+    di->atime_nsec = cpu_to_le32(info->atime.nsec);
+    di->mtime_nsec = cpu_to_le32(info->mtime.nsec);
+    di->ctime_nsec = cpu_to_le32(info->ctime.nsec);
+    di->extent_count = cpu_to_le32(info->extent_count);
+    di->extent_block = cpu_to_le64(info->extent_block);
+    di->dir_children_count = cpu_to_le64(info->dir_children_count);
+    if (info->flags & ASSOOFS_INODE_INLINE_DATA) {
+        memcpy(di->inline_data, info->inline_data, ASSOOFS_INLINE_DATA_MAX);
+        return;
+    }
+    for (i = 0; i < ASSOOFS_INLINE_EXTENTS; i++) {
+        di->extents[i].ee_block = cpu_to_le32(info->extents[i].ee_block);
+        di->extents[i].ee_len = cpu_to_le32(info->extents[i].ee_len);
+        di->extents[i].ee_start = cpu_to_le64(info->extents[i].ee_start);
+    }
+}
+
+static inline void assoofs_inode_from_disk(const struct assoofs_disk_inode *di, struct assoofs_inode_info *info) {
+    unsigned int i;
+
+    memset(info, 0, sizeof(*info));
+    info->mode = le16_to_cpu(di->mode);
+    info->links_count = le16_to_cpu(di->links_count);
+    info->flags = le16_to_cpu(di->flags);
+    info->uid = le32_to_cpu(di->uid);
+    info->gid = le32_to_cpu(di->gid);
+    info->inode_no = le64_to_cpu(di->inode_no);
+    info->file_size = le64_to_cpu(di->size);
+    info->atime.sec = le64_to_cpu(di->atime);
+    info->mtime.sec = le64_to_cpu(di->mtime);
+    info->ctime.sec = le64_to_cpu(di->ctime);
+    info->atime.nsec = le32_to_cpu(di->atime_nsec);
+    info->mtime.nsec = le32_to_cpu(di->mtime_nsec);
+    info->ctime.nsec = le32_to_cpu(di->ctime_nsec);
+    info->extent_count = le32_to_cpu(di->extent_count);
+    info->extent_block = le64_to_cpu(di->extent_block);
+    info->dir_children_count = le64_to_cpu(di->dir_children_count);
+    if (info->flags & ASSOOFS_INODE_INLINE_DATA) {
+        memcpy(info->inline_data, di->inline_data, ASSOOFS_INLINE_DATA_MAX);
+        return;
+    }
+    for (i = 0; i < ASSOOFS_INLINE_EXTENTS; i++) {
+        info->extents[i].ee_block = le32_to_cpu(di->extents[i].ee_block);
+        info->extents[i].ee_len = le32_to_cpu(di->extents[i].ee_len);
+        info->extents[i].ee_start = le64_to_cpu(di->extents[i].ee_start);
+    }
+}
+
+#ifdef __KERNEL__
+/*
+ * Mapa de bits cargado en memoria. Los bloques del mapa se quedan fijados en
+ * la cache de buffers y el resumen tiene un bit por cada palabra de 64 bits
+ * del mapa que esta completamente ocupada, de modo que las busquedas saltan
+ * 64 bloques ocupados por cada bit del resumen. free cuenta los bits libres
+ * y reserved los que estan apartados para escrituras cuya asignacion se ha
+ * retrasado; son contadores por CPU para que statfs y las reservas de cada
+ * escritura no se peleen por el cerrojo. El cerrojo protege el mapa, el
+ * resumen y la pista, y solo se coge mientras se busca el bit o cuando
+ * quedan tan pocos bits libres que hay que sumar los contadores exactos.
+ */
+struct assoofs_bitmap {
+    spinlock_t lock;
+    struct buffer_head **bh;
+    unsigned long *full;
+    uint64_t nbits;
+    uint64_t nwords;
+    uint64_t hint;
+    struct percpu_counter free;
+    struct percpu_counter reserved;
+    unsigned int words_per_block;
+};
+
+//Racha de bloques de metadatos liberados, en un solo bloque del mapa de bits
+struct assoofs_freed_run {
+    uint64_t start;
+    uint64_t count;
+};
+
+/*
+ * Journal en memoria. head y tail son posiciones que solo crecen dentro del
+ * area circular: entre tail y head estan las transacciones escritas cuyos
+ * bloques aun no se han llevado a su sitio, y esos bloques se quedan fijados
+ * en checkpoint. running son los bloques de la transaccion en curso, a la
+ * que se unen todas las operaciones hasta que se hace commit. freed son los
+ * bloques de metadatos liberados que no vuelven al mapa de bits hasta el
+ * siguiente checkpoint, y freed_reserved los huecos de freed apartados por
+ * los manejadores abiertos.
+ */
+struct assoofs_journal {
+    uint64_t first;
+    uint64_t blocks;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t sequence;
+    uint64_t commit_sequence;
+    struct rw_semaphore barrier;
+    struct mutex commit_mutex;
+    spinlock_t lock;
+    struct buffer_head **running;
+    unsigned int t_count;
+    unsigned int t_reserved;
+    unsigned int t_max;
+    struct buffer_head **io;
+    struct buffer_head **checkpoint;
+    unsigned int cp_count;
+    struct assoofs_freed_run *freed;
+    unsigned int freed_count;
+    unsigned int freed_reserved;
+    unsigned int freed_max;
+};
+
+//Bit de estado de los buffers que ya estan en la transaccion en curso
+enum assoofs_state_bits {
+    BH_AssoofsLogged = BH_PrivateStart,
+};
+BUFFER_FNS(AssoofsLogged, assoofs_logged)
+TAS_BUFFER_FNS(AssoofsLogged, assoofs_logged)
+
+/*
+ * Estadisticas de un montaje. Cada CPU suma en su copia sin cerrojos y
+ * /sys/fs/assoofs/<dispositivo>/ muestra la suma de todas.
+ */
+enum assoofs_stat {
+    ASSOOFS_STAT_READS,
+    ASSOOFS_STAT_READ_BYTES,
+    ASSOOFS_STAT_WRITES,
+    ASSOOFS_STAT_WRITE_BYTES,
+    ASSOOFS_STAT_LOOKUPS,
+    ASSOOFS_STAT_LOOKUP_MISSES,
+    ASSOOFS_STAT_ICACHE_HITS,
+    ASSOOFS_STAT_ICACHE_MISSES,
+    ASSOOFS_STAT_CREATES,
+    ASSOOFS_STAT_MKDIRS,
+    ASSOOFS_STAT_UNLINKS,
+    ASSOOFS_STAT_RMDIRS,
+    ASSOOFS_STAT_RENAMES,
+    ASSOOFS_STAT_READDIRS,
+    ASSOOFS_STAT_BLOCK_ALLOCS,
+    ASSOOFS_STAT_BLOCKS_ALLOCATED,
+    ASSOOFS_STAT_BLOCKS_FREED,
+    ASSOOFS_STAT_JOURNAL_COMMITS,
+    ASSOOFS_STAT_NR
+};
+
+struct assoofs_stats {
+    u64 count[ASSOOFS_STAT_NR];
+};
+
+//Informacion del superbloque en memoria. lock protege los contadores de disk_sb
+struct assoofs_sb_info {
+    spinlock_t lock;
+    struct buffer_head *sb_bh;
+    struct assoofs_super_block_info *disk_sb;
+    struct assoofs_bitmap block_bitmap;
+    struct assoofs_bitmap inode_bitmap;
+    unsigned int inodes_per_block;
+    struct super_block *sb;
+    unsigned long commit_interval;
+    unsigned long ra_pages;
+    struct delayed_work commit_work;
+    struct assoofs_journal journal;
+    struct assoofs_stats __percpu *stats;
+    struct kobject kobj;
+    struct completion kobj_unregister;
+};
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb){
+    return sb->s_fs_info;
+}
+
+static inline void assoofs_stat_add(struct super_block *sb, enum assoofs_stat stat, u64 n){
+    this_cpu_add(ASSOOFS_SB(sb)->stats->count[stat], n);
+}
+
+static inline void assoofs_stat_inc(struct super_block *sb, enum assoofs_stat stat){
+    assoofs_stat_add(sb, stat, 1);
+}
+
+/*
+ * Inodo en memoria: la informacion persistente junto al inodo del VFS,
+ * reservados del slab assoofs_inode_cache. data_sem protege los tramos y el
+ * tamaño de info: se coge para leer al traducir bloques y para escribir al
+ * asignarlos o al cambiar el tamaño, siempre despues de abrir el manejador
+ * del journal. Las entradas de un directorio las protege el cerrojo del
+ * inodo del VFS, que ya coge el VFS en create, mkdir y lookup.
+ */
+struct assoofs_inode {
+    struct rw_semaphore data_sem;
+    struct assoofs_inode_info info;
+    struct inode vfs_inode;
+};
+
+static inline struct assoofs_inode *ASSOOFS_I(struct inode *inode){
+    return container_of(inode, struct assoofs_inode, vfs_inode);
+}
+
+static inline struct inode *assoofs_info_inode(struct assoofs_inode_info *info){
+    return &container_of(info, struct assoofs_inode, info)->vfs_inode;
+}
+#endif
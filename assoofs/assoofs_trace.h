@@ -0,0 +1,270 @@
+/*
+ * Puntos de traza de assoofs. Se activan en
+ * /sys/kernel/tracing/events/assoofs/ y no cuestan nada mientras estan
+ * apagados. Los tiempos son en nanosegundos.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM assoofs
+
+#if !defined(_ASSOOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASSOOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(assoofs_io_class,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret, int direct, u64 latency),
+    TP_ARGS(inode, pos, len, ret, direct, latency),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(ssize_t, ret)
+        __field(int, direct)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->direct = direct;
+        __entry->latency = latency;
+    ),
+    TP_printk("dev %d,%d ino %lu pos %lld len %zu ret %zd direct %d latency %llu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        __entry->pos, __entry->len, __entry->ret, __entry->direct, __entry->latency)
+);
+
+DEFINE_EVENT(assoofs_io_class, assoofs_read,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret, int direct, u64 latency),
+    TP_ARGS(inode, pos, len, ret, direct, latency)
+);
+
+DEFINE_EVENT(assoofs_io_class, assoofs_write,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret, int direct, u64 latency),
+    TP_ARGS(inode, pos, len, ret, direct, latency)
+);
+
+TRACE_EVENT(assoofs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, uint64_t ino, int ret, u64 latency),
+    TP_ARGS(dir, dentry, ino, ret, latency),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __string(name, dentry->d_name.name)
+        __field(u64, ino)
+        __field(int, ret)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->ino = ino;
+        __entry->ret = ret;
+        __entry->latency = latency;
+    ),
+    TP_printk("dev %d,%d dir %lu name %s ino %llu ret %d latency %llu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __get_str(name), __entry->ino, __entry->ret, __entry->latency)
+);
+
+DECLARE_EVENT_CLASS(assoofs_new_inode_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode, int ret, u64 latency),
+    TP_ARGS(dir, dentry, mode, ret, latency),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __string(name, dentry->d_name.name)
+        __field(ino_t, ino)
+        __field(umode_t, mode)
+        __field(int, ret)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->ino = d_really_is_positive(dentry) ? d_inode(dentry)->i_ino : 0;
+        __entry->mode = mode;
+        __entry->ret = ret;
+        __entry->latency = latency;
+    ),
+    TP_printk("dev %d,%d dir %lu name %s ino %lu mode 0%o ret %d latency %llu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __get_str(name), (unsigned long)__entry->ino, __entry->mode, __entry->ret,
+        __entry->latency)
+);
+
+DEFINE_EVENT(assoofs_new_inode_class, assoofs_create,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode, int ret, u64 latency),
+    TP_ARGS(dir, dentry, mode, ret, latency)
+);
+
+DEFINE_EVENT(assoofs_new_inode_class, assoofs_mkdir,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode, int ret, u64 latency),
+    TP_ARGS(dir, dentry, mode, ret, latency)
+);
+
+DECLARE_EVENT_CLASS(assoofs_remove_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret, u64 latency),
+    TP_ARGS(dir, dentry, ret, latency),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __string(name, dentry->d_name.name)
+        __field(ino_t, ino)
+        __field(int, ret)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->ino = d_really_is_positive(dentry) ? d_inode(dentry)->i_ino : 0;
+        __entry->ret = ret;
+        __entry->latency = latency;
+    ),
+    TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d latency %llu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __get_str(name), (unsigned long)__entry->ino, __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(assoofs_remove_class, assoofs_unlink,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret, u64 latency),
+    TP_ARGS(dir, dentry, ret, latency)
+);
+
+DEFINE_EVENT(assoofs_remove_class, assoofs_rmdir,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret, u64 latency),
+    TP_ARGS(dir, dentry, ret, latency)
+);
+
+TRACE_EVENT(assoofs_rename,
+    TP_PROTO(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry,
+             int ret, u64 latency),
+    TP_ARGS(old_dir, old_dentry, new_dir, new_dentry, ret, latency),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, old_dir)
+        __string(old_name, old_dentry->d_name.name)
+        __field(ino_t, new_dir)
+        __string(new_name, new_dentry->d_name.name)
+        __field(ino_t, ino)
+        __field(int, ret)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->dev = old_dir->i_sb->s_dev;
+        __entry->old_dir = old_dir->i_ino;
+        __assign_str(old_name, old_dentry->d_name.name);
+        __entry->new_dir = new_dir->i_ino;
+        __assign_str(new_name, new_dentry->d_name.name);
+        __entry->ino = d_inode(old_dentry)->i_ino;
+        __entry->ret = ret;
+        __entry->latency = latency;
+    ),
+    TP_printk("dev %d,%d ino %lu from %lu/%s to %lu/%s ret %d latency %llu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        (unsigned long)__entry->old_dir, __get_str(old_name), (unsigned long)__entry->new_dir,
+        __get_str(new_name), __entry->ret, __entry->latency)
+);
+
+TRACE_EVENT(assoofs_iterate,
+    TP_PROTO(struct inode *dir, loff_t start, loff_t end, int ret, u64 latency),
+    TP_ARGS(dir, start, end, ret, latency),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(loff_t, start)
+        __field(loff_t, end)
+        __field(int, ret)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->start = start;
+        __entry->end = end;
+        __entry->ret = ret;
+        __entry->latency = latency;
+    ),
+    TP_printk("dev %d,%d dir %lu pos %lld-%lld ret %d latency %llu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __entry->start, __entry->end, __entry->ret, __entry->latency)
+);
+
+TRACE_EVENT(assoofs_iget,
+    TP_PROTO(struct super_block *sb, uint64_t ino, int cached),
+    TP_ARGS(sb, ino, cached),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+        __field(int, cached)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->cached = cached;
+    ),
+    TP_printk("dev %d,%d ino %llu cached %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->cached)
+);
+
+TRACE_EVENT(assoofs_alloc_blocks,
+    TP_PROTO(struct super_block *sb, uint64_t ino, uint64_t iblock, uint64_t max, uint64_t pblock, uint64_t count, int ret),
+    TP_ARGS(sb, ino, iblock, max, pblock, count, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+        __field(u64, iblock)
+        __field(u64, max)
+        __field(u64, pblock)
+        __field(u64, count)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->iblock = iblock;
+        __entry->max = max;
+        __entry->pblock = pblock;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d ino %llu iblock %llu max %llu pblock %llu count %llu ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->iblock,
+        __entry->max, __entry->pblock, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(assoofs_journal_commit,
+    TP_PROTO(struct super_block *sb, uint64_t sequence, unsigned int blocks, int ret, u64 latency),
+    TP_ARGS(sb, sequence, blocks, ret, latency),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, sequence)
+        __field(unsigned int, blocks)
+        __field(int, ret)
+        __field(u64, latency)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->sequence = sequence;
+        __entry->blocks = blocks;
+        __entry->ret = ret;
+        __entry->latency = latency;
+    ),
+    TP_printk("dev %d,%d sequence %llu blocks %u ret %d latency %llu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->sequence, __entry->blocks,
+        __entry->ret, __entry->latency)
+);
+
+#endif /* _ASSOOFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE assoofs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,914 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "libassoofs.h"
+
+/*
+ * Comprueba y repara un sistema de ficheros assoofs desmontado. La imagen se
+ * abre con libassoofs, que reaplica el journal como al montar, y se revisa
+ * en tres fases:
+ *
+ *  1. La tabla de inodos, repartida entre los hilos por trozos: tipo,
+ *     tamaño y tramos de cada inodo. Los bloques de cada tramo se marcan en
+ *     un mapa de bits propio con operaciones atomicas, de modo que un bloque
+ *     que ya estaba marcado es un bloque asignado dos veces. Un inodo sin
+ *     enlaces es un borrado que una caida dejo a medias y se libera. Las
+ *     posiciones libres en el mapa de inodos no se miran: pueden tener
+ *     registros viejos de un formato anterior.
+ *  2. Los directorios, tambien repartidos entre los hilos: indice, hojas y
+ *     entradas. Cada entrada suma una referencia a su inodo. Si una entrada
+ *     apunta a una posicion libre en el mapa, al acabar se revisa ese inodo
+ *     como en la fase 1 y despues la entrada; el mapa se corrige en la 3.
+ *  3. Con todo lo anterior y ya en un solo hilo se comparan los mapas de
+ *     bits del disco con lo que se ha encontrado, se llevan a /lost+found
+ *     los inodos a los que no apunta nadie y se corrigen los enlaces, el
+ *     numero de entradas de cada directorio y el de inodos del superbloque.
+ *
+ * Las dos primeras fases solo leen la imagen y apuntan lo que hay que
+ * arreglar; todas las reparaciones se hacen en la tercera, en orden. Con -n
+ * la imagen se abre en solo lectura y solo se informa.
+ */
+#define FSCK_CHUNK 4096
+
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_ERROR 8
+
+enum fsck_state {
+    FSCK_FREE,
+    FSCK_REG,
+    FSCK_DIR,
+    FSCK_BAD,
+    FSCK_UNMARKED,
+};
+
+struct fsck_inode {
+    uint32_t refs;
+    uint32_t subdirs;
+    uint32_t entries;
+    uint32_t parent;
+    uint8_t state;
+    uint8_t reach;
+};
+
+enum fsck_fix_type {
+    FIX_CLEAR_INODE,
+    FIX_INODE_NO,
+    FIX_TRUNCATE_EXTENTS,
+    FIX_REINIT_LEAF,
+    FIX_REMOVE_ENTRY,
+    FIX_FILE_TYPE,
+};
+
+struct fsck_fix {
+    enum fsck_fix_type type;
+    uint64_t ino;
+    uint64_t lblk;
+    uint32_t offset;
+    uint32_t arg;
+};
+
+struct fsck {
+    struct assoofs_img img;
+    int repair;
+    int verbose;
+    unsigned int threads;
+    uint64_t data_start;
+    uint64_t max_extents;
+    struct fsck_inode *inodes;
+    uint64_t *used;
+    uint64_t *dirs;
+    uint64_t ndirs;
+    uint64_t next;
+    pthread_mutex_t lock;
+    struct fsck_fix *fixes;
+    size_t nfixes;
+    size_t fixes_size;
+    struct fsck_fix *deferred;
+    size_t ndeferred;
+    size_t deferred_size;
+    uint64_t dup_blocks;
+    uint64_t fixed;
+    uint64_t unfixed;
+};
+
+/*
+ *  Informes y reparaciones pendientes
+ */
+
+/**
+ * Informa de un problema. Se puede llamar desde cualquier hilo.
+ * @param fs estado de la comprobacion
+ * @param fixable 1 si se sabe reparar
+ * @return 1 si hay que repararlo
+ */
+static int problem(struct fsck *fs, int fixable, const char *fmt, ...) {
+    int fix = fixable && fs->repair;
+    va_list ap;
+
+    pthread_mutex_lock(&fs->lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    if (fix) {
+        printf(": fixed.\n");
+        fs->fixed++;
+    } else {
+        printf(fixable ? ": not fixed.\n" : ".\n");
+        fs->unfixed++;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return fix;
+}
+
+//Se llama con fs->lock cogido
+static int push_fix(struct fsck_fix **list, size_t *n, size_t *size, struct fsck_fix fix) {
+    struct fsck_fix *grown;
+
+    if (*n == *size) {
+        grown = realloc(*list, (*size * 2 + 64) * sizeof(*grown));
+        if (!grown)
+            return -ENOMEM;
+        *list = grown;
+        *size = *size * 2 + 64;
+    }
+    (*list)[(*n)++] = fix;
+    return 0;
+}
+
+static void add_fix(struct fsck *fs, enum fsck_fix_type type, uint64_t ino, uint64_t lblk, uint32_t offset,
+                    uint32_t arg) {
+    pthread_mutex_lock(&fs->lock);
+    //Sin memoria no se puede reparar, pero la comprobacion sigue
+    if (push_fix(&fs->fixes, &fs->nfixes, &fs->fixes_size, (struct fsck_fix){ type, ino, lblk, offset, arg }))
+        fs->repair = 0;
+    pthread_mutex_unlock(&fs->lock);
+}
+
+/*
+ *  Fase 1: tabla de inodos
+ */
+
+static struct assoofs_disk_inode *inode_slot(struct fsck *fs, uint64_t ino) {
+    return (struct assoofs_disk_inode *)assoofs_img_block(&fs->img, fs->img.sb->inode_table_block +
+                                                          ino / fs->img.inodes_per_block) +
+           ino % fs->img.inodes_per_block;
+}
+
+static void report_dups(struct fsck *fs, uint64_t ino, uint64_t word, uint64_t bits) {
+    while (bits) {
+        problem(fs, 0, "Block %llu of inode %llu is also used by another inode",
+                (unsigned long long)(word * 64 + __builtin_ctzll(bits)), (unsigned long long)ino);
+        __atomic_add_fetch(&fs->dup_blocks, 1, __ATOMIC_RELAXED);
+        bits &= bits - 1;
+    }
+}
+
+//Marca una racha de bloques como usada, de palabra en palabra
+static void mark_blocks(struct fsck *fs, uint64_t ino, uint64_t start, uint64_t len) {
+    uint64_t bit = start, end = start + len, n, mask, old;
+
+    while (bit < end) {
+        n = 64 - bit % 64;
+        if (n > end - bit)
+            n = end - bit;
+        mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << (bit % 64);
+        old = __atomic_fetch_or(&fs->used[bit / 64], mask, __ATOMIC_RELAXED);
+        if (old & mask)
+            report_dups(fs, ino, bit / 64, old & mask);
+        bit += n;
+    }
+}
+
+static int valid_data_block(const struct fsck *fs, uint64_t block) {
+    return block >= fs->data_start && block < fs->img.sb->blocks_count;
+}
+
+static int inode_marked(const struct fsck *fs, uint64_t ino) {
+    return fs->img.inode_bitmap.map[ino / 8] >> (ino % 8) & 1;
+}
+
+/**
+ * Comprueba el registro de un inodo de la tabla y marca sus bloques
+ * @param fs estado de la comprobacion
+ * @param ino numero de inodo
+ */
+static void check_inode_record(struct fsck *fs, uint64_t ino) {
+    struct fsck_inode *fi = &fs->inodes[ino];
+    struct assoofs_disk_inode *di = inode_slot(fs, ino);
+    struct assoofs_extent *overflow = NULL, *ext;
+    struct assoofs_inode_info info;
+    uint64_t prev_end = 0;
+    uint32_t i, count;
+
+    fi->state = FSCK_FREE;
+    if (!di->version)
+        return;
+    assoofs_inode_from_disk(di, &info);
+
+    if (ino == 0 || (!S_ISREG(info.mode) && !S_ISDIR(info.mode))) {
+        if (problem(fs, ino != ASSOOFS_ROOTDIR_INODE_NUMBER, "Inode %llu has an invalid mode 0%o, cleared",
+                    (unsigned long long)ino, info.mode))
+            add_fix(fs, FIX_CLEAR_INODE, ino, 0, 0, 0);
+        fi->state = FSCK_BAD;
+        return;
+    }
+    if (info.inode_no != ino && problem(fs, 1, "Inode %llu says it is inode %llu", (unsigned long long)ino,
+                                        (unsigned long long)info.inode_no))
+        add_fix(fs, FIX_INODE_NO, ino, 0, 0, 0);
+
+    //Sin enlaces es un inodo borrado que no se llego a liberar antes de una caida: sus bloques quedan libres
+    if (!info.links_count && ino != ASSOOFS_ROOTDIR_INODE_NUMBER) {
+        if (problem(fs, 1, "Inode %llu was deleted but not released, cleared", (unsigned long long)ino))
+            add_fix(fs, FIX_CLEAR_INODE, ino, 0, 0, 0);
+        return;
+    }
+
+    if (S_ISDIR(info.mode) && ((info.flags & ASSOOFS_INODE_INLINE_DATA) ||
+                               info.file_size & (fs->img.block_size - 1) || info.file_size < 2 * fs->img.block_size)) {
+        if (problem(fs, ino != ASSOOFS_ROOTDIR_INODE_NUMBER, "Directory %llu has an invalid size %llu, cleared",
+                    (unsigned long long)ino, (unsigned long long)info.file_size))
+            add_fix(fs, FIX_CLEAR_INODE, ino, 0, 0, 0);
+        fi->state = FSCK_BAD;
+        return;
+    }
+    fi->state = S_ISDIR(info.mode) ? FSCK_DIR : FSCK_REG;
+
+    if (info.flags & ASSOOFS_INODE_INLINE_DATA) {
+        if (info.file_size > ASSOOFS_INLINE_DATA_MAX) {
+            if (problem(fs, 1, "Inode %llu has %llu bytes of inline data, cleared", (unsigned long long)ino,
+                        (unsigned long long)info.file_size))
+                add_fix(fs, FIX_CLEAR_INODE, ino, 0, 0, 0);
+            fi->state = FSCK_BAD;
+        }
+        return;
+    }
+
+    //Los tramos que no valen se quitan desde el primero, junto con los que le siguen
+    count = info.extent_count;
+    if (count > fs->max_extents)
+        count = fs->max_extents;
+    if (count > ASSOOFS_INLINE_EXTENTS) {
+        if (valid_data_block(fs, info.extent_block)) {
+            mark_blocks(fs, ino, info.extent_block, 1);
+            overflow = (struct assoofs_extent *)assoofs_img_block(&fs->img, info.extent_block);
+        } else {
+            count = ASSOOFS_INLINE_EXTENTS;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        ext = i < ASSOOFS_INLINE_EXTENTS ? &info.extents[i] : &overflow[i - ASSOOFS_INLINE_EXTENTS];
+        if (!ext->ee_len || ext->ee_block < prev_end || !valid_data_block(fs, ext->ee_start) ||
+            ext->ee_len > fs->img.sb->blocks_count - ext->ee_start ||
+            (uint64_t)ext->ee_block + ext->ee_len > ASSOOFS_MAX_FILE_BLOCKS)
+            break;
+        mark_blocks(fs, ino, ext->ee_start, ext->ee_len);
+        prev_end = (uint64_t)ext->ee_block + ext->ee_len;
+    }
+    if (i < info.extent_count) {
+        //Un directorio sin parte de sus bloques no se puede arreglar quitando tramos
+        if (problem(fs, fi->state == FSCK_REG, "Inode %llu has an invalid extent %u of %u%s", (unsigned long long)ino,
+                    i, info.extent_count, fi->state == FSCK_REG ? ", extents dropped from there" : ""))
+            add_fix(fs, FIX_TRUNCATE_EXTENTS, ino, 0, 0, i);
+    }
+}
+
+/**
+ * Comprueba un inodo de la tabla si el mapa de inodos lo da por ocupado. La
+ * raiz se comprueba siempre.
+ * @param fs estado de la comprobacion
+ * @param ino numero de inodo
+ */
+static void check_inode(struct fsck *fs, uint64_t ino) {
+    if (ino && ino != ASSOOFS_ROOTDIR_INODE_NUMBER && !inode_marked(fs, ino)) {
+        fs->inodes[ino].state = inode_slot(fs, ino)->version ? FSCK_UNMARKED : FSCK_FREE;
+        return;
+    }
+    check_inode_record(fs, ino);
+}
+
+static void *inode_worker(void *arg) {
+    struct fsck *fs = arg;
+    uint64_t total = fs->img.sb->inodes_total, start, ino;
+
+    for (;;) {
+        start = __atomic_fetch_add(&fs->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (start >= total)
+            break;
+        for (ino = start; ino < start + FSCK_CHUNK && ino < total; ino++)
+            check_inode(fs, ino);
+    }
+    return NULL;
+}
+
+/*
+ *  Fase 2: directorios
+ */
+
+static char *dir_block(struct fsck *fs, const struct assoofs_inode_info *dir, uint64_t lblk) {
+    uint64_t pblock, count;
+
+    if (assoofs_img_map_blocks(&fs->img, dir, lblk, 1, &pblock, &count) || !valid_data_block(fs, pblock))
+        return NULL;
+    return assoofs_img_block(&fs->img, pblock);
+}
+
+//Solo la raiz empieza en el hash 0; un bloque intermedio empieza donde le toca
+static int check_index(struct fsck *fs, char *blk, uint64_t nblocks, int root) {
+    struct assoofs_dir_block_header *hdr = (struct assoofs_dir_block_header *)blk;
+    struct assoofs_dx_entry *entries = (struct assoofs_dx_entry *)(hdr + 1);
+    unsigned int capacity = (fs->img.block_size - sizeof(*hdr)) / sizeof(*entries);
+    unsigned int i;
+
+    if (hdr->magic != ASSOOFS_DIR_INDEX_MAGIC || !hdr->count || hdr->count > capacity ||
+        hdr->levels > (root ? ASSOOFS_DIR_MAX_LEVELS : 0) || (root && entries[0].hash))
+        return -1;
+    for (i = 0; i < hdr->count; i++) {
+        if (!entries[i].block || entries[i].block >= nblocks || (i && entries[i].hash < entries[i - 1].hash))
+            return -1;
+    }
+    return 0;
+}
+
+//Lo mismo que assoofs_img_leaf_check en la biblioteca
+static int check_leaf(struct fsck *fs, char *blk) {
+    struct assoofs_dir_block_header *hdr = (struct assoofs_dir_block_header *)blk;
+    struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)(hdr + 1);
+    char *limit = blk + fs->img.block_size;
+    unsigned int count = 0;
+
+    while ((char *)record < limit) {
+        if (record->rec_len < ASSOOFS_DIR_REC_LEN(0) || record->rec_len & 3 || limit - (char *)record < record->rec_len)
+            return -1;
+        if (record->inode_no) {
+            if (!record->name_len || record->rec_len < ASSOOFS_DIR_REC_LEN(record->name_len))
+                return -1;
+            count++;
+        }
+        record = (struct assoofs_dir_record_entry *)((char *)record + record->rec_len);
+    }
+    return count == hdr->count ? 0 : -1;
+}
+
+static void check_entry(struct fsck *fs, uint64_t ino, uint64_t lblk, char *blk,
+                        struct assoofs_dir_record_entry *record) {
+    struct fsck_inode *dir = &fs->inodes[ino], *child;
+    uint32_t offset = (char *)record - blk;
+    uint8_t file_type;
+
+    if (memchr(record->filename, '/', record->name_len) || memchr(record->filename, '\0', record->name_len)) {
+        if (problem(fs, 1, "Directory %llu has an entry with an invalid name '%.*s', removed",
+                    (unsigned long long)ino, record->name_len, record->filename))
+            add_fix(fs, FIX_REMOVE_ENTRY, ino, lblk, offset, 0);
+        return;
+    }
+    if (record->inode_no < fs->img.sb->inodes_total && fs->inodes[record->inode_no].state == FSCK_UNMARKED) {
+        //Puede ser un inodo de verdad al que le falta el bit: se decide al acabar la fase
+        pthread_mutex_lock(&fs->lock);
+        if (push_fix(&fs->deferred, &fs->ndeferred, &fs->deferred_size,
+                     (struct fsck_fix){ FIX_REMOVE_ENTRY, ino, lblk, offset, 0 }))
+            fs->repair = 0;
+        pthread_mutex_unlock(&fs->lock);
+        return;
+    }
+    if (record->inode_no >= fs->img.sb->inodes_total || record->inode_no == ASSOOFS_ROOTDIR_INODE_NUMBER ||
+        fs->inodes[record->inode_no].state == FSCK_FREE || fs->inodes[record->inode_no].state == FSCK_BAD) {
+        if (problem(fs, 1, "Entry '%.*s' of directory %llu points to free or invalid inode %u, removed",
+                    record->name_len, record->filename, (unsigned long long)ino, record->inode_no))
+            add_fix(fs, FIX_REMOVE_ENTRY, ino, lblk, offset, 0);
+        return;
+    }
+
+    child = &fs->inodes[record->inode_no];
+    //Un directorio solo puede tener un padre: las demas entradas sobran
+    if (__atomic_add_fetch(&child->refs, 1, __ATOMIC_RELAXED) > 1 && child->state == FSCK_DIR) {
+        __atomic_sub_fetch(&child->refs, 1, __ATOMIC_RELAXED);
+        if (problem(fs, 1, "Directory %u has a second entry '%.*s' in directory %llu, removed", record->inode_no,
+                    record->name_len, record->filename, (unsigned long long)ino))
+            add_fix(fs, FIX_REMOVE_ENTRY, ino, lblk, offset, 0);
+        return;
+    }
+
+    file_type = child->state == FSCK_DIR ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG_FILE;
+    if (record->file_type != file_type &&
+        problem(fs, 1, "Entry '%.*s' of directory %llu has the wrong file type %u", record->name_len,
+                record->filename, (unsigned long long)ino, record->file_type))
+        add_fix(fs, FIX_FILE_TYPE, ino, lblk, offset, file_type);
+
+    //Solo el hilo que revisa el directorio toca sus contadores
+    if (child->state == FSCK_DIR) {
+        child->parent = ino;
+        dir->subdirs++;
+    }
+    dir->entries++;
+}
+
+static void check_dir(struct fsck *fs, uint64_t ino) {
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dir_block_header *hdr;
+    struct assoofs_inode_info dir;
+    uint64_t lblk, nblocks;
+    char *blk, *limit;
+
+    if (assoofs_img_read_inode(&fs->img, ino, &dir))
+        return;
+    nblocks = dir.file_size >> fs->img.blocksize_bits;
+
+    //Sin indice no se encuentra nada por nombre, pero las hojas se recorren igual
+    blk = dir_block(fs, &dir, 0);
+    if (!blk || check_index(fs, blk, nblocks, 1))
+        problem(fs, 0, "Directory %llu has a corrupted index", (unsigned long long)ino);
+
+    for (lblk = 1; lblk < nblocks; lblk++) {
+        blk = dir_block(fs, &dir, lblk);
+        if (!blk) {
+            problem(fs, 0, "Directory %llu has no block %llu", (unsigned long long)ino, (unsigned long long)lblk);
+            continue;
+        }
+        hdr = (struct assoofs_dir_block_header *)blk;
+        if (hdr->magic == ASSOOFS_DIR_INDEX_MAGIC) {
+            if (check_index(fs, blk, nblocks, 0))
+                problem(fs, 0, "Directory %llu has a corrupted index block %llu", (unsigned long long)ino,
+                        (unsigned long long)lblk);
+            continue;
+        }
+        //Una hoja rota se vacia: lo que colgaba de ella acaba en /lost+found
+        if (hdr->magic != ASSOOFS_DIR_LEAF_MAGIC || check_leaf(fs, blk)) {
+            if (problem(fs, 1, "Directory %llu has a corrupted block %llu, emptied", (unsigned long long)ino,
+                        (unsigned long long)lblk))
+                add_fix(fs, FIX_REINIT_LEAF, ino, lblk, 0, 0);
+            continue;
+        }
+
+        limit = blk + fs->img.block_size;
+        for (record = (struct assoofs_dir_record_entry *)(hdr + 1); (char *)record < limit;
+             record = (struct assoofs_dir_record_entry *)((char *)record + record->rec_len)) {
+            if (record->inode_no)
+                check_entry(fs, ino, lblk, blk, record);
+        }
+    }
+}
+
+static void *dir_worker(void *arg) {
+    struct fsck *fs = arg;
+    uint64_t i;
+
+    for (;;) {
+        i = __atomic_fetch_add(&fs->next, 1, __ATOMIC_RELAXED);
+        if (i >= fs->ndirs)
+            break;
+        check_dir(fs, fs->dirs[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Revisa los inodos libres en el mapa a los que apunta alguna entrada y
+ * despues esas entradas. Si alguno es un directorio se recorre tambien, lo
+ * que puede llevar a otros, asi que se repite hasta que no quedan.
+ * @param fs estado de la comprobacion
+ */
+static void check_unmarked(struct fsck *fs) {
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_inode_info dir;
+    struct fsck_fix *list;
+    size_t i, n, first;
+    char *blk;
+
+    while (fs->ndeferred) {
+        list = fs->deferred;
+        n = fs->ndeferred;
+        fs->deferred = NULL;
+        fs->ndeferred = fs->deferred_size = 0;
+        first = fs->ndirs;
+
+        for (i = 0; i < 2 * n; i++) {
+            if (assoofs_img_read_inode(&fs->img, list[i % n].ino, &dir))
+                continue;
+            blk = dir_block(fs, &dir, list[i % n].lblk);
+            if (!blk)
+                continue;
+            record = (struct assoofs_dir_record_entry *)(blk + list[i % n].offset);
+            if (i >= n) {
+                check_entry(fs, list[i % n].ino, list[i % n].lblk, blk, record);
+                continue;
+            }
+            //Primero todos los inodos, para que las entradas repetidas se cuenten igual
+            if (fs->inodes[record->inode_no].state != FSCK_UNMARKED)
+                continue;
+            check_inode_record(fs, record->inode_no);
+            if (fs->inodes[record->inode_no].state == FSCK_DIR)
+                fs->dirs[fs->ndirs++] = record->inode_no;
+        }
+        free(list);
+
+        for (i = first; i < fs->ndirs; i++)
+            check_dir(fs, fs->dirs[i]);
+    }
+}
+
+static int run_phase(struct fsck *fs, void *(*worker)(void *)) {
+    pthread_t *tids;
+    unsigned int i, started;
+
+    tids = calloc(fs->threads, sizeof(*tids));
+    if (!tids)
+        return -ENOMEM;
+    fs->next = 0;
+    for (started = 0; started < fs->threads; started++) {
+        if (pthread_create(&tids[started], NULL, worker, fs))
+            break;
+    }
+    //Si no se ha podido lanzar ninguno, este hilo hace todo el trabajo
+    if (!started)
+        worker(fs);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return 0;
+}
+
+/*
+ *  Fase 3: reparaciones y comprobaciones globales
+ */
+
+static void apply_fixes(struct fsck *fs) {
+    struct assoofs_dir_block_header *hdr;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_inode_info info;
+    struct fsck_fix *fix;
+    char *blk;
+    size_t i;
+
+    for (i = 0; i < fs->nfixes; i++) {
+        fix = &fs->fixes[i];
+        switch (fix->type) {
+        case FIX_CLEAR_INODE:
+            memset(inode_slot(fs, fix->ino), 0, sizeof(struct assoofs_disk_inode));
+            break;
+        case FIX_INODE_NO:
+            assoofs_inode_from_disk(inode_slot(fs, fix->ino), &info);
+            info.inode_no = fix->ino;
+            assoofs_img_write_inode(&fs->img, &info);
+            break;
+        case FIX_TRUNCATE_EXTENTS:
+            assoofs_inode_from_disk(inode_slot(fs, fix->ino), &info);
+            if (fix->arg <= ASSOOFS_INLINE_EXTENTS && info.extent_count > ASSOOFS_INLINE_EXTENTS) {
+                //El bloque de tramos ya no hace falta
+                if (valid_data_block(fs, info.extent_block))
+                    fs->used[info.extent_block / 64] &= ~(1ULL << (info.extent_block % 64));
+                info.extent_block = 0;
+            }
+            if (fix->arg < ASSOOFS_INLINE_EXTENTS)
+                memset(&info.extents[fix->arg], 0, (ASSOOFS_INLINE_EXTENTS - fix->arg) * sizeof(info.extents[0]));
+            info.extent_count = fix->arg;
+            assoofs_img_write_inode(&fs->img, &info);
+            break;
+        case FIX_REINIT_LEAF:
+        case FIX_REMOVE_ENTRY:
+        case FIX_FILE_TYPE:
+            if (assoofs_img_read_inode(&fs->img, fix->ino, &info))
+                break;
+            blk = dir_block(fs, &info, fix->lblk);
+            if (!blk)
+                break;
+            hdr = (struct assoofs_dir_block_header *)blk;
+            record = (struct assoofs_dir_record_entry *)(blk + fix->offset);
+            if (fix->type == FIX_REINIT_LEAF) {
+                memset(blk, 0, fs->img.block_size);
+                hdr->magic = ASSOOFS_DIR_LEAF_MAGIC;
+                record = (struct assoofs_dir_record_entry *)(hdr + 1);
+                record->rec_len = fs->img.block_size - sizeof(*hdr);
+            } else if (fix->type == FIX_REMOVE_ENTRY) {
+                record->inode_no = 0;
+                hdr->count--;
+            } else {
+                record->file_type = fix->arg;
+            }
+            break;
+        }
+    }
+}
+
+static void check_inode_bitmap(struct fsck *fs) {
+    struct assoofs_img_bitmap *bm = &fs->img.inode_bitmap;
+    uint64_t ino, lost = 0, leaked = 0;
+    int used, marked;
+
+    //El inodo 0 no existe y siempre esta ocupado
+    for (ino = 0; ino < fs->img.sb->inodes_total; ino++) {
+        used = ino == 0 || fs->inodes[ino].state == FSCK_REG || fs->inodes[ino].state == FSCK_DIR;
+        marked = bm->map[ino / 8] >> (ino % 8) & 1;
+        if (used == marked)
+            continue;
+        if (used)
+            lost++;
+        else
+            leaked++;
+        if (fs->verbose)
+            printf("Inode %llu is %s in the inode bitmap.\n", (unsigned long long)ino, used ? "free" : "used");
+        if (fs->repair)
+            assoofs_img_bitmap_set(bm, ino, used);
+    }
+    if (lost)
+        problem(fs, 1, "%llu inodes in use are marked free in the inode bitmap", (unsigned long long)lost);
+    if (leaked)
+        problem(fs, 1, "%llu free inodes are marked in use in the inode bitmap", (unsigned long long)leaked);
+}
+
+static void check_block_bitmap(struct fsck *fs) {
+    struct assoofs_img_bitmap *bm = &fs->img.block_bitmap;
+    const uint64_t *disk = (const uint64_t *)bm->map;
+    uint64_t w, word, diff, bit, lost = 0, leaked = 0;
+
+    for (w = 0; w < bm->nwords; w++) {
+        word = le64toh(disk[w]);
+        diff = word ^ fs->used[w];
+        //Los bits de relleno del final del mapa estan a uno
+        if (w == bm->nwords - 1 && bm->nbits % 64)
+            diff &= (1ULL << (bm->nbits % 64)) - 1;
+        lost += __builtin_popcountll(diff & fs->used[w]);
+        leaked += __builtin_popcountll(diff & word);
+        for (; diff; diff &= diff - 1) {
+            bit = w * 64 + __builtin_ctzll(diff);
+            if (fs->verbose)
+                printf("Block %llu is %s in the block bitmap.\n", (unsigned long long)bit,
+                       fs->used[w] >> (bit % 64) & 1 ? "free" : "used");
+            if (fs->repair)
+                assoofs_img_bitmap_set(bm, bit, fs->used[w] >> (bit % 64) & 1);
+        }
+    }
+    if (lost)
+        problem(fs, 1, "%llu blocks in use are marked free in the block bitmap", (unsigned long long)lost);
+    if (leaked)
+        problem(fs, 1, "%llu unused blocks are marked in use in the block bitmap", (unsigned long long)leaked);
+}
+
+/**
+ * Devuelve /lost+found, creandolo si no existe
+ * @return 0 si todo sale bien o un error
+ */
+static int lost_found(struct fsck *fs, struct assoofs_inode_info *lf) {
+    struct assoofs_inode_info root;
+    uint64_t ino;
+    int ret;
+
+    ret = assoofs_img_read_inode(&fs->img, ASSOOFS_ROOTDIR_INODE_NUMBER, &root);
+    if (ret)
+        return ret;
+    if (!assoofs_img_lookup(&fs->img, &root, "lost+found", &ino)) {
+        if (fs->inodes[ino].state != FSCK_DIR)
+            return -ENOTDIR;
+        return assoofs_img_read_inode(&fs->img, ino, lf);
+    }
+
+    ret = assoofs_img_create(&fs->img, &root, "lost+found", S_IFDIR | 0700, 0, 0, lf);
+    if (ret)
+        return ret;
+    fs->inodes[lf->inode_no] = (struct fsck_inode){ .refs = 1, .parent = ASSOOFS_ROOTDIR_INODE_NUMBER,
+                                                    .state = FSCK_DIR };
+    fs->inodes[ASSOOFS_ROOTDIR_INODE_NUMBER].subdirs++;
+    fs->inodes[ASSOOFS_ROOTDIR_INODE_NUMBER].entries++;
+    //Sus bloques ya salen bien en el mapa de bits, que se ha reparado antes
+    return 0;
+}
+
+static void reconnect_orphans(struct fsck *fs) {
+    struct assoofs_inode_info lf, info;
+    struct fsck_inode *fi;
+    char name[32];
+    uint64_t ino;
+    int ret, have_lf = 0;
+
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER + 1; ino < fs->img.sb->inodes_total; ino++) {
+        fi = &fs->inodes[ino];
+        if ((fi->state != FSCK_REG && fi->state != FSCK_DIR) || fi->refs)
+            continue;
+        if (!problem(fs, 1, "Inode %llu is not in any directory, moved to /lost+found", (unsigned long long)ino))
+            continue;
+        if (!have_lf) {
+            ret = lost_found(fs, &lf);
+            if (ret) {
+                printf("Error creating /lost+found: %s.\n", strerror(-ret));
+                fs->repair = 0;
+                fs->fixed--;
+                fs->unfixed++;
+                return;
+            }
+            have_lf = 1;
+        }
+
+        snprintf(name, sizeof(name), "#%llu", (unsigned long long)ino);
+        assoofs_img_read_inode(&fs->img, ino, &info);
+        //assoofs_img_link le suma el enlace que le da la nueva entrada
+        if (fi->state == FSCK_REG)
+            info.links_count = 0;
+        ret = assoofs_img_link(&fs->img, &lf, name, &info);
+        if (ret) {
+            printf("Error linking inode %llu into /lost+found: %s.\n", (unsigned long long)ino, strerror(-ret));
+            fs->fixed--;
+            fs->unfixed++;
+            continue;
+        }
+        fi->refs = 1;
+        fs->inodes[lf.inode_no].entries++;
+        if (fi->state == FSCK_DIR) {
+            fi->parent = lf.inode_no;
+            fs->inodes[lf.inode_no].subdirs++;
+        }
+    }
+}
+
+/*
+ * Un directorio con padre puede seguir sin colgar de la raiz si forma un
+ * ciclo con otros. Se sube por los padres marcando el camino: 1 es alcanzable,
+ * 2 esta en el camino actual.
+ */
+static void check_reachable(struct fsck *fs) {
+    uint64_t ino, cur;
+    uint8_t result;
+
+    fs->inodes[ASSOOFS_ROOTDIR_INODE_NUMBER].reach = 1;
+    for (ino = 0; ino < fs->img.sb->inodes_total; ino++) {
+        if (fs->inodes[ino].state != FSCK_DIR || fs->inodes[ino].reach)
+            continue;
+        for (cur = ino; fs->inodes[cur].state == FSCK_DIR && !fs->inodes[cur].reach && fs->inodes[cur].refs;
+             cur = fs->inodes[cur].parent)
+            fs->inodes[cur].reach = 2;
+        result = fs->inodes[cur].reach == 1 ? 1 : 3;
+        for (cur = ino; fs->inodes[cur].reach == 2; cur = fs->inodes[cur].parent)
+            fs->inodes[cur].reach = result;
+        if (result == 3)
+            problem(fs, 0, "Directory %llu is not reachable from the root directory", (unsigned long long)ino);
+    }
+}
+
+static void check_counts(struct fsck *fs) {
+    struct assoofs_inode_info info;
+    struct fsck_inode *fi;
+    uint64_t ino, used = 0, links;
+    int dirty;
+
+    for (ino = 1; ino < fs->img.sb->inodes_total; ino++) {
+        fi = &fs->inodes[ino];
+        if (fi->state != FSCK_REG && fi->state != FSCK_DIR)
+            continue;
+        used++;
+        //Un huerfano que no se ha llevado a /lost+found ya se ha contado
+        if (!fi->refs)
+            continue;
+        if (assoofs_img_read_inode(&fs->img, ino, &info))
+            continue;
+
+        dirty = 0;
+        //Un directorio tiene la entrada de su padre, su '.' y el '..' de cada subdirectorio
+        links = fi->state == FSCK_DIR ? 2 + fi->subdirs : fi->refs;
+        if (info.links_count != links && problem(fs, 1, "Inode %llu has %u links instead of %llu",
+                                                 (unsigned long long)ino, info.links_count, (unsigned long long)links)) {
+            info.links_count = links;
+            dirty = 1;
+        }
+        if (fi->state == FSCK_DIR && info.dir_children_count != fi->entries &&
+            problem(fs, 1, "Directory %llu counts %llu entries instead of %u", (unsigned long long)ino,
+                    (unsigned long long)info.dir_children_count, fi->entries)) {
+            info.dir_children_count = fi->entries;
+            dirty = 1;
+        }
+        if (dirty)
+            assoofs_img_write_inode(&fs->img, &info);
+    }
+
+    if (fs->img.sb->inodes_count != used &&
+        problem(fs, 1, "The superblock counts %llu inodes instead of %llu",
+                (unsigned long long)fs->img.sb->inodes_count, (unsigned long long)used))
+        fs->img.sb->inodes_count = used;
+}
+
+/*
+ *  Arranque
+ */
+
+static int fsck_init(struct fsck *fs) {
+    struct assoofs_super_block_info *sb = fs->img.sb;
+    uint64_t ino;
+
+    fs->data_start = sb->journal_block + sb->journal_blocks;
+    if (sb->bitmap_blocks * fs->img.block_size * 8 < sb->blocks_count ||
+        sb->inode_bitmap_blocks * fs->img.block_size * 8 < sb->inodes_total ||
+        sb->inode_bitmap_block != ASSOOFS_BITMAP_BLOCK_NUMBER + sb->bitmap_blocks ||
+        sb->inode_table_block != sb->inode_bitmap_block + sb->inode_bitmap_blocks ||
+        sb->journal_block != sb->inode_table_block + sb->inode_table_blocks || fs->data_start >= sb->blocks_count ||
+        sb->inodes_total <= ASSOOFS_ROOTDIR_INODE_NUMBER) {
+        printf("The superblock describes an impossible layout.\n");
+        return -EUCLEAN;
+    }
+    fs->max_extents = ASSOOFS_INLINE_EXTENTS + fs->img.block_size / sizeof(struct assoofs_extent);
+
+    fs->inodes = calloc(sb->inodes_total, sizeof(*fs->inodes));
+    fs->used = calloc((sb->blocks_count + 63) / 64, sizeof(*fs->used));
+    if (!fs->inodes || !fs->used)
+        return -ENOMEM;
+    //Superbloque, mapas de bits, tabla de inodos y journal
+    mark_blocks(fs, 0, 0, fs->data_start);
+
+    run_phase(fs, inode_worker);
+
+    if (fs->inodes[ASSOOFS_ROOTDIR_INODE_NUMBER].state != FSCK_DIR) {
+        printf("The root directory is missing.\n");
+        return -EUCLEAN;
+    }
+    fs->dirs = malloc(sb->inodes_total * sizeof(*fs->dirs));
+    if (!fs->dirs)
+        return -ENOMEM;
+    for (ino = 0; ino < sb->inodes_total; ino++) {
+        if (fs->inodes[ino].state == FSCK_DIR)
+            fs->dirs[fs->ndirs++] = ino;
+    }
+    fs->inodes[ASSOOFS_ROOTDIR_INODE_NUMBER].refs = 1;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n] [-v] [-j threads] <device>\n", prog);
+    fprintf(stderr, "  -n  only check, never write to the device\n");
+    fprintf(stderr, "  -v  list every inode and block whose bitmap bit is wrong\n");
+    fprintf(stderr, "  -j  threads for the inode table and directory passes (default: one per CPU)\n");
+    fprintf(stderr, "Exit status: 0 clean, 1 errors fixed, 4 errors left, 8 operational error.\n");
+    exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[]) {
+    static struct fsck fs;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t inodes, blocks, total;
+    int opt, ret;
+
+    fs.repair = 1;
+    fs.threads = ncpus > 0 ? ncpus : 1;
+    pthread_mutex_init(&fs.lock, NULL);
+
+    while ((opt = getopt(argc, argv, "nvj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            fs.repair = 0;
+            break;
+        case 'v':
+            fs.verbose = 1;
+            break;
+        case 'j':
+            fs.threads = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !fs.threads)
+        usage(argv[0]);
+
+    ret = assoofs_img_open(&fs.img, argv[optind], fs.repair ? 0 : ASSOOFS_IMG_RDONLY);
+    if (ret) {
+        fprintf(stderr, "Error opening %s: %s\n", argv[optind], strerror(-ret));
+        return FSCK_ERROR;
+    }
+
+    ret = fsck_init(&fs);
+    if (ret) {
+        if (ret == -ENOMEM)
+            fprintf(stderr, "Not enough memory to check %s\n", argv[optind]);
+        assoofs_img_close(&fs.img);
+        return ret == -ENOMEM ? FSCK_ERROR : FSCK_UNFIXED;
+    }
+    run_phase(&fs, dir_worker);
+    check_unmarked(&fs);
+
+    //Primero lo que apuntaron los hilos y despues los mapas de bits, para que
+    //lost+found se cree con ellos ya bien; los contadores al final
+    if (fs.repair)
+        apply_fixes(&fs);
+    check_inode_bitmap(&fs);
+    check_block_bitmap(&fs);
+    reconnect_orphans(&fs);
+    check_reachable(&fs);
+    check_counts(&fs);
+
+    inodes = fs.img.sb->inodes_count;
+    blocks = fs.img.sb->blocks_count - fs.img.block_bitmap.free;
+    total = fs.img.sb->blocks_count;
+    if (assoofs_img_close(&fs.img)) {
+        fprintf(stderr, "Error writing back %s\n", argv[optind]);
+        return FSCK_ERROR;
+    }
+
+    printf("%s: %llu inodes, %llu of %llu blocks in use. %llu problems fixed, %llu left.\n", argv[optind],
+           (unsigned long long)inodes, (unsigned long long)blocks, (unsigned long long)total,
+           (unsigned long long)fs.fixed, (unsigned long long)fs.unfixed);
+    if (fs.unfixed)
+        return FSCK_UNFIXED;
+    return fs.fixed ? FSCK_FIXED : FSCK_OK;
+}
@@ -0,0 +1,1517 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "libassoofs.h"
+
+/*
+ * Esta es la misma logica que assoofs.c, escrita sobre bloques proyectados
+ * en memoria en lugar de buffer_heads. Los nombres de las funciones son los
+ * del modulo cambiando assoofs_ por assoofs_img_ para que se puedan
+ * comparar.
+ */
+
+/*
+ *  Mapas de bits
+ */
+
+/**
+ * Prepara un mapa de bits de la imagen y cuenta sus bits libres
+ * @param img imagen
+ * @param bm mapa de bits
+ * @param start primer bloque del mapa
+ * @param nbits numero de bits validos
+ */
+static void assoofs_img_bitmap_load(struct assoofs_img *img, struct assoofs_img_bitmap *bm, uint64_t start,
+                                    uint64_t nbits) {
+    const uint64_t *words;
+    uint64_t w, word;
+
+    bm->map = (unsigned char *)assoofs_img_block(img, start);
+    bm->nbits = nbits;
+    bm->nwords = (nbits + 63) / 64;
+    bm->hint = 0;
+    bm->free = nbits;
+    words = (const uint64_t *)bm->map;
+    for (w = 0; w < bm->nwords; w++) {
+        word = le64toh(words[w]);
+        if (w == bm->nwords - 1 && nbits % 64)
+            word &= (1ULL << (nbits % 64)) - 1;
+        bm->free -= __builtin_popcountll(word);
+    }
+}
+
+static inline int assoofs_img_test_bit(const struct assoofs_img_bitmap *bm, uint64_t bit) {
+    return bm->map[bit / 8] >> (bit % 8) & 1;
+}
+
+/**
+ * Busca el primer bit libre desde la palabra de la pista, dando la vuelta
+ * @param bm mapa de bits
+ * @param bit bit libre encontrado
+ * @return 0 si todo sale bien o -ENOSPC si el mapa esta lleno
+ */
+static int assoofs_img_bitmap_find(struct assoofs_img_bitmap *bm, uint64_t *bit) {
+    const uint64_t *words = (const uint64_t *)bm->map;
+    uint64_t w, word, start = bm->hint;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (w = start; w < bm->nwords; w++) {
+            word = le64toh(words[w]);
+            if (word == ~0ULL)
+                continue;
+            *bit = w * 64 + __builtin_ctzll(~word);
+            //Los bits de relleno del final del mapa no son validos
+            if (*bit < bm->nbits)
+                return 0;
+        }
+        start = 0;
+    }
+    return -ENOSPC;
+}
+
+/**
+ * Reserva una racha de bits libres seguidos, empezando en goal si esta libre
+ * o si no en el primer bit libre
+ * @param bm mapa de bits
+ * @param goal bit preferido, o UINT64_MAX si da igual
+ * @param max longitud maxima de la racha
+ * @param start primer bit asignado
+ * @param count numero de bits asignados, al menos 1
+ * @return 0 si todo sale bien o -ENOSPC si el mapa esta lleno
+ */
+static int assoofs_img_bitmap_alloc_range(struct assoofs_img_bitmap *bm, uint64_t goal, uint64_t max,
+                                          uint64_t *start, uint64_t *count) {
+    uint64_t bit, n;
+    int ret;
+
+    if (!bm->free)
+        return -ENOSPC;
+    if (goal < bm->nbits && !assoofs_img_test_bit(bm, goal)) {
+        bit = goal;
+    } else {
+        ret = assoofs_img_bitmap_find(bm, &bit);
+        if (ret)
+            return ret;
+    }
+
+    if (!max)
+        max = 1;
+    for (n = 0; n < max && bit + n < bm->nbits && !assoofs_img_test_bit(bm, bit + n); n++)
+        bm->map[(bit + n) / 8] |= 1 << ((bit + n) % 8);
+    bm->hint = (bit + n - 1) / 64;
+    bm->free -= n;
+    *start = bit;
+    *count = n;
+    return 0;
+}
+
+/**
+ * Marca un bit del mapa como libre
+ * @param bm mapa de bits
+ * @param bit bit a liberar
+ */
+static void assoofs_img_bitmap_free(struct assoofs_img_bitmap *bm, uint64_t bit) {
+    bm->map[bit / 8] &= ~(1 << (bit % 8));
+    //Preferimos reutilizar los huecos mas bajos para mantener el disco compacto
+    if (bit / 64 < bm->hint)
+        bm->hint = bit / 64;
+    bm->free++;
+}
+
+/**
+ * Marca un bit del mapa como ocupado o libre, manteniendo la cuenta de
+ * libres. Es para herramientas como fsck.assoofs, que reconstruyen los mapas.
+ * @param bm mapa de bits
+ * @param bit bit a cambiar
+ * @param used 1 para ocuparlo o 0 para liberarlo
+ */
+void assoofs_img_bitmap_set(struct assoofs_img_bitmap *bm, uint64_t bit, int used) {
+    if (bit >= bm->nbits || assoofs_img_test_bit(bm, bit) == !!used)
+        return;
+    if (!used) {
+        assoofs_img_bitmap_free(bm, bit);
+        return;
+    }
+    bm->map[bit / 8] |= 1 << (bit % 8);
+    bm->free--;
+}
+
+/*
+ *  Journal
+ */
+
+//crc32_le del kernel: polinomio 0xedb88320 sin invertir el resultado
+static uint32_t assoofs_img_crc32(uint32_t crc, const unsigned char *p, size_t len) {
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return crc;
+}
+
+static inline uint64_t assoofs_img_journal_block(const struct assoofs_img *img, uint64_t pos) {
+    return img->sb->journal_block + 1 + pos % (img->sb->journal_blocks - 1);
+}
+
+/**
+ * Comprueba si en la posicion pos del journal hay una transaccion completa
+ * con la secuencia esperada, igual que assoofs_journal_check
+ * @return descriptor de la transaccion o NULL si no la hay
+ */
+static struct assoofs_journal_descriptor *assoofs_img_journal_check(struct assoofs_img *img, uint64_t pos,
+                                                                    uint64_t sequence) {
+    struct assoofs_journal_descriptor *desc;
+    struct assoofs_journal_commit *commit;
+    uint64_t max = (img->block_size - sizeof(*desc)) / sizeof(uint64_t);
+    uint32_t crc, i;
+
+    desc = (struct assoofs_journal_descriptor *)assoofs_img_block(img, assoofs_img_journal_block(img, pos));
+    if (desc->header.magic != ASSOOFS_JOURNAL_MAGIC || desc->header.type != ASSOOFS_JOURNAL_DESCRIPTOR ||
+        desc->header.sequence != sequence || !desc->count || desc->count > max ||
+        desc->count + 2 > img->sb->journal_blocks - 1)
+        return NULL;
+
+    crc = assoofs_img_crc32(~0, (unsigned char *)desc, img->block_size);
+    for (i = 0; i < desc->count; i++)
+        crc = assoofs_img_crc32(crc, (unsigned char *)assoofs_img_block(img, assoofs_img_journal_block(img, pos + 1 + i)),
+                                img->block_size);
+
+    commit = (struct assoofs_journal_commit *)assoofs_img_block(img, assoofs_img_journal_block(img, pos + 1 + desc->count));
+    if (commit->header.magic != ASSOOFS_JOURNAL_MAGIC || commit->header.type != ASSOOFS_JOURNAL_COMMIT ||
+        commit->header.sequence != sequence || commit->checksum != crc)
+        return NULL;
+    return desc;
+}
+
+/**
+ * Reaplica las transacciones que quedaron en el journal, como al montar, y
+ * lo deja vacio. Despues ya se puede modificar la imagen en su sitio.
+ * @param img imagen
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_img_journal_replay(struct assoofs_img *img) {
+    struct assoofs_super_block_info *sb = img->sb;
+    struct assoofs_journal_super_block *jsb;
+    struct assoofs_journal_descriptor *desc;
+    uint64_t head, sequence, replayed = 0;
+    uint32_t i;
+
+    if (sb->journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS || sb->journal_block + sb->journal_blocks > sb->blocks_count)
+        return -EUCLEAN;
+    jsb = (struct assoofs_journal_super_block *)assoofs_img_block(img, sb->journal_block);
+    if (jsb->header.magic != ASSOOFS_JOURNAL_MAGIC || jsb->header.type != ASSOOFS_JOURNAL_SUPERBLOCK)
+        return -EUCLEAN;
+
+    head = jsb->start;
+    sequence = jsb->header.sequence;
+    while ((desc = assoofs_img_journal_check(img, head, sequence))) {
+        for (i = 0; i < desc->count; i++) {
+            if (desc->blocks[i] >= sb->blocks_count)
+                continue;
+            memcpy(assoofs_img_block(img, desc->blocks[i]),
+                   assoofs_img_block(img, assoofs_img_journal_block(img, head + 1 + i)), img->block_size);
+        }
+        head += desc->count + 2;
+        sequence++;
+        replayed++;
+    }
+
+    if (replayed) {
+        jsb->header.sequence = sequence;
+        jsb->start = head % (sb->journal_blocks - 1);
+    }
+    return 0;
+}
+
+/*
+ *  Imagen
+ */
+
+/**
+ * Abre una imagen o un dispositivo de assoofs y lo proyecta en memoria
+ * @param img imagen a rellenar
+ * @param path ruta de la imagen
+ * @param flags ASSOOFS_IMG_RDONLY o 0
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_open(struct assoofs_img *img, const char *path, int flags) {
+    struct assoofs_super_block_info *sb;
+    struct stat st;
+    uint64_t size;
+    int ret, prot = PROT_READ | PROT_WRITE;
+    int shared = flags & ASSOOFS_IMG_RDONLY ? MAP_PRIVATE : MAP_SHARED;
+
+    memset(img, 0, sizeof(*img));
+    img->flags = flags;
+    img->fd = open(path, flags & ASSOOFS_IMG_RDONLY ? O_RDONLY : O_RDWR);
+    if (img->fd == -1)
+        return -errno;
+    if (fstat(img->fd, &st) == -1)
+        goto fail_errno;
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(img->fd, BLKGETSIZE64, &size) == -1)
+        goto fail_errno;
+    if (size < ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    //Con la proyeccion privada el journal se reaplica solo en memoria
+    img->size = size;
+    img->map = mmap(NULL, img->size, prot, shared, img->fd, 0);
+    if (img->map == MAP_FAILED) {
+        img->map = NULL;
+        goto fail_errno;
+    }
+
+    sb = (struct assoofs_super_block_info *)img->map;
+    //El modulo solo monta ASSOOFS_DEFAULT_BLOCK_SIZE, pero aqui vale cualquier tamaño que admita mkassoofs
+    if (sb->magic != ASSOOFS_MAGIC || sb->block_size < ASSOOFS_MIN_BLOCK_SIZE ||
+        sb->block_size > ASSOOFS_MAX_BLOCK_SIZE || (sb->block_size & (sb->block_size - 1))) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    img->sb = sb;
+    img->block_size = sb->block_size;
+    img->blocksize_bits = __builtin_ctzll(sb->block_size);
+    img->inodes_per_block = img->block_size / sizeof(struct assoofs_disk_inode);
+    if (sb->blocks_count > img->size / img->block_size ||
+        sb->inode_bitmap_block + sb->inode_bitmap_blocks > sb->blocks_count ||
+        sb->inode_table_block + sb->inode_table_blocks > sb->blocks_count ||
+        sb->inodes_total > sb->inode_table_blocks * img->inodes_per_block) {
+        ret = -EUCLEAN;
+        goto fail;
+    }
+
+    ret = assoofs_img_journal_replay(img);
+    if (ret)
+        goto fail;
+
+    assoofs_img_bitmap_load(img, &img->block_bitmap, ASSOOFS_BITMAP_BLOCK_NUMBER, sb->blocks_count);
+    assoofs_img_bitmap_load(img, &img->inode_bitmap, sb->inode_bitmap_block, sb->inodes_total);
+    return 0;
+
+fail_errno:
+    ret = -errno;
+fail:
+    if (img->map)
+        munmap(img->map, img->size);
+    close(img->fd);
+    return ret;
+}
+
+/**
+ * Lleva a disco todas las modificaciones hechas en la imagen
+ * @param img imagen
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_sync(struct assoofs_img *img) {
+    if (img->flags & ASSOOFS_IMG_RDONLY)
+        return 0;
+    //Los contadores del superbloque solo se ponen al dia al guardar, como en el modulo
+    img->sb->free_blocks = img->block_bitmap.free;
+    img->sb->free_inodes = img->inode_bitmap.free;
+    if (msync(img->map, img->size, MS_SYNC) == -1 || fsync(img->fd) == -1)
+        return -errno;
+    return 0;
+}
+
+/**
+ * Guarda y cierra la imagen
+ * @param img imagen
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_close(struct assoofs_img *img) {
+    int ret;
+
+    ret = assoofs_img_sync(img);
+    munmap(img->map, img->size);
+    close(img->fd);
+    return ret;
+}
+
+/*
+ *  Inodos
+ */
+
+static struct assoofs_disk_inode *assoofs_img_inode_table_slot(struct assoofs_img *img, uint64_t inode_no) {
+    if (inode_no >= img->sb->inodes_total)
+        return NULL;
+    return (struct assoofs_disk_inode *)assoofs_img_block(img, img->sb->inode_table_block + inode_no / img->inodes_per_block) +
+           inode_no % img->inodes_per_block;
+}
+
+/**
+ * Lee la informacion persistente de un inodo de la tabla de inodos
+ * @param img imagen
+ * @param inode_no numero de inodo
+ * @param info informacion del inodo
+ * @return 0 si todo sale bien, -ENOENT si la posicion esta libre o -EINVAL
+ */
+int assoofs_img_read_inode(struct assoofs_img *img, uint64_t inode_no, struct assoofs_inode_info *info) {
+    struct assoofs_disk_inode *di = assoofs_img_inode_table_slot(img, inode_no);
+
+    if (!di)
+        return -EINVAL;
+    if (!di->version)
+        return -ENOENT;
+    assoofs_inode_from_disk(di, info);
+    return 0;
+}
+
+/**
+ * Guarda la informacion persistente de un inodo en su posicion de la tabla
+ * @param img imagen
+ * @param info informacion del inodo
+ * @return 0 si todo sale bien o -EINVAL
+ */
+int assoofs_img_write_inode(struct assoofs_img *img, const struct assoofs_inode_info *info) {
+    struct assoofs_disk_inode *di = assoofs_img_inode_table_slot(img, info->inode_no);
+
+    if (!di)
+        return -EINVAL;
+    assoofs_inode_to_disk(info, di);
+    return 0;
+}
+
+static void assoofs_img_now(struct assoofs_time *t) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t->sec = ts.tv_sec;
+    t->nsec = ts.tv_nsec;
+}
+
+/*
+ *  Tramos
+ */
+
+static struct assoofs_extent *assoofs_img_extent_at(struct assoofs_inode_info *info, struct assoofs_extent *overflow,
+                                                    uint32_t i) {
+    if (i < ASSOOFS_INLINE_EXTENTS)
+        return &info->extents[i];
+    return &overflow[i - ASSOOFS_INLINE_EXTENTS];
+}
+
+/**
+ * Traduce un rango de bloques logicos a la racha de bloques fisicos seguidos
+ * que empieza en iblock, como assoofs_map_blocks
+ * @param img imagen
+ * @param info informacion del inodo
+ * @param iblock primer bloque logico
+ * @param max numero maximo de bloques a traducir
+ * @param pblock bloque fisico de iblock
+ * @param count numero de bloques seguidos a partir de pblock o, si iblock es
+ * un hueco, longitud del hueco
+ * @return 0 si el bloque esta asignado o -ENOENT si es un hueco
+ */
+int assoofs_img_map_blocks(struct assoofs_img *img, const struct assoofs_inode_info *info, uint64_t iblock,
+                           uint64_t max, uint64_t *pblock, uint64_t *count) {
+    struct assoofs_inode_info *ii = (struct assoofs_inode_info *)info;
+    struct assoofs_extent *overflow = NULL;
+    struct assoofs_extent *ext;
+    uint64_t next = 0;
+    uint32_t i;
+    int ret = -ENOENT;
+
+    *count = max;
+    if (info->extent_count > ASSOOFS_INLINE_EXTENTS)
+        overflow = (struct assoofs_extent *)assoofs_img_block(img, info->extent_block);
+
+    for (i = 0; i < info->extent_count; i++) {
+        ext = assoofs_img_extent_at(ii, overflow, i);
+        if (ret == 0) {
+            if (ext->ee_block != iblock + *count || ext->ee_start != next)
+                break;
+            *count += ext->ee_len;
+        } else {
+            if (iblock < ext->ee_block) {
+                *count = ext->ee_block - iblock;
+                break;
+            }
+            if (iblock >= (uint64_t)ext->ee_block + ext->ee_len)
+                continue;
+            *pblock = ext->ee_start + (iblock - ext->ee_block);
+            *count = (uint64_t)ext->ee_len - (iblock - ext->ee_block);
+            ret = 0;
+        }
+        next = ext->ee_start + ext->ee_len;
+        if (*count >= max)
+            break;
+    }
+
+    if (*count > max)
+        *count = max;
+    return ret;
+}
+
+/**
+ * Asigna bloques fisicos seguidos a partir del bloque logico iblock, que no
+ * tiene bloque, sin pasar del siguiente tramo y prefiriendo el bloque que
+ * sigue al tramo anterior, como assoofs_alloc_blocks. El llamante debe
+ * guardar despues el inodo.
+ * @param img imagen
+ * @param info informacion del inodo
+ * @param iblock bloque logico
+ * @param max numero maximo de bloques a asignar
+ * @param pblock primer bloque fisico asignado
+ * @param count numero de bloques asignados
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_alloc_blocks(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t iblock,
+                             uint64_t max, uint64_t *pblock, uint64_t *count) {
+    struct assoofs_img_bitmap *bm = &img->block_bitmap;
+    struct assoofs_extent *overflow = NULL;
+    struct assoofs_extent *ext, *next;
+    uint32_t max_extents = ASSOOFS_INLINE_EXTENTS + img->block_size / sizeof(struct assoofs_extent);
+    uint64_t block, goal = UINT64_MAX, n;
+    uint32_t pos, i;
+    int ret;
+
+    if (iblock >= ASSOOFS_MAX_FILE_BLOCKS)
+        return -EFBIG;
+    if (max > ASSOOFS_MAX_FILE_BLOCKS - iblock)
+        max = ASSOOFS_MAX_FILE_BLOCKS - iblock;
+
+    //Si hacen falta tramos fuera del inodo reservamos antes su bloque
+    if (info->extent_count >= ASSOOFS_INLINE_EXTENTS) {
+        if (!info->extent_block) {
+            ret = assoofs_img_bitmap_alloc_range(bm, UINT64_MAX, 1, &info->extent_block, &n);
+            if (ret)
+                return ret;
+            memset(assoofs_img_block(img, info->extent_block), 0, img->block_size);
+        }
+        overflow = (struct assoofs_extent *)assoofs_img_block(img, info->extent_block);
+    }
+
+    for (pos = 0; pos < info->extent_count; pos++) {
+        if (assoofs_img_extent_at(info, overflow, pos)->ee_block > iblock)
+            break;
+    }
+    if (pos < info->extent_count) {
+        next = assoofs_img_extent_at(info, overflow, pos);
+        if (max > next->ee_block - iblock)
+            max = next->ee_block - iblock;
+    }
+    if (pos > 0) {
+        ext = assoofs_img_extent_at(info, overflow, pos - 1);
+        goal = ext->ee_start + ext->ee_len;
+    }
+
+    ret = assoofs_img_bitmap_alloc_range(bm, goal, max, &block, count);
+    if (ret)
+        return ret;
+
+    //Intentamos alargar el tramo anterior
+    if (pos > 0) {
+        ext = assoofs_img_extent_at(info, overflow, pos - 1);
+        if ((uint64_t)ext->ee_block + ext->ee_len == iblock && ext->ee_start + ext->ee_len == block) {
+            ext->ee_len += *count;
+            *pblock = block;
+            return 0;
+        }
+    }
+
+    if (info->extent_count >= max_extents) {
+        for (n = 0; n < *count; n++)
+            assoofs_img_bitmap_free(bm, block + n);
+        return -EFBIG;
+    }
+
+    for (i = info->extent_count; i > pos; i--)
+        *assoofs_img_extent_at(info, overflow, i) = *assoofs_img_extent_at(info, overflow, i - 1);
+    ext = assoofs_img_extent_at(info, overflow, pos);
+    ext->ee_block = iblock;
+    ext->ee_len = *count;
+    ext->ee_start = block;
+    info->extent_count++;
+    *pblock = block;
+    return 0;
+}
+
+/*
+ *  Directorios indexados por hash
+ */
+struct assoofs_img_dx_frame {
+    char *blk;
+    struct assoofs_dir_block_header *hdr;
+    struct assoofs_dx_entry *entries;
+    uint16_t pos;
+};
+
+#define assoofs_img_dir_header(b) ((struct assoofs_dir_block_header *)(b))
+#define assoofs_img_dx_entries(b) ((struct assoofs_dx_entry *)((b) + sizeof(struct assoofs_dir_block_header)))
+#define assoofs_img_dir_records(b) ((struct assoofs_dir_record_entry *)((b) + sizeof(struct assoofs_dir_block_header)))
+#define assoofs_img_dir_next(record) ((struct assoofs_dir_record_entry *)((char *)(record) + (record)->rec_len))
+
+static inline struct assoofs_dir_record_entry *assoofs_img_dir_limit(const struct assoofs_img *img, char *blk) {
+    return (struct assoofs_dir_record_entry *)(blk + img->block_size);
+}
+
+static inline unsigned int assoofs_img_dx_capacity(const struct assoofs_img *img) {
+    return (img->block_size - sizeof(struct assoofs_dir_block_header)) / sizeof(struct assoofs_dx_entry);
+}
+
+static void assoofs_img_leaf_init(const struct assoofs_img *img, char *blk) {
+    struct assoofs_dir_record_entry *record = assoofs_img_dir_records(blk);
+
+    assoofs_img_dir_header(blk)->count = 0;
+    memset(record, 0, sizeof(*record));
+    record->rec_len = img->block_size - sizeof(struct assoofs_dir_block_header);
+}
+
+/**
+ * Comprueba que las entradas de una hoja se encadenan hasta el final del
+ * bloque y que su numero coincide con el de la cabecera
+ * @return 0 si la hoja es correcta o -EUCLEAN
+ */
+static int assoofs_img_leaf_check(const struct assoofs_img *img, char *blk) {
+    struct assoofs_dir_record_entry *record = assoofs_img_dir_records(blk);
+    struct assoofs_dir_record_entry *limit = assoofs_img_dir_limit(img, blk);
+    unsigned int count = 0;
+
+    while (record < limit) {
+        if (record->rec_len < ASSOOFS_DIR_REC_LEN(0) || record->rec_len & 3 ||
+            (char *)limit - (char *)record < record->rec_len)
+            return -EUCLEAN;
+        if (record->inode_no) {
+            if (!record->name_len || record->rec_len < ASSOOFS_DIR_REC_LEN(record->name_len))
+                return -EUCLEAN;
+            count++;
+        }
+        record = assoofs_img_dir_next(record);
+    }
+    return count == assoofs_img_dir_header(blk)->count ? 0 : -EUCLEAN;
+}
+
+static char *assoofs_img_dir_block(struct assoofs_img *img, const struct assoofs_inode_info *dir, uint64_t lblk) {
+    uint64_t pblock, count;
+
+    if (assoofs_img_map_blocks(img, dir, lblk, 1, &pblock, &count) || pblock >= img->sb->blocks_count)
+        return NULL;
+    return assoofs_img_block(img, pblock);
+}
+
+/**
+ * Añade un bloque vacio al final de un directorio
+ * @param img imagen
+ * @param dir informacion del directorio
+ * @param magic tipo de bloque, indice u hoja
+ * @param lblk bloque logico asignado
+ * @param blkp contenido del nuevo bloque
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_img_dir_new_block(struct assoofs_img *img, struct assoofs_inode_info *dir, uint32_t magic,
+                                     uint32_t *lblk, char **blkp) {
+    uint64_t pblock, count;
+    char *blk;
+    int ret;
+
+    *lblk = dir->file_size / img->block_size;
+    ret = assoofs_img_alloc_blocks(img, dir, *lblk, 1, &pblock, &count);
+    if (ret)
+        return ret;
+    dir->file_size += img->block_size;
+
+    blk = assoofs_img_block(img, pblock);
+    memset(blk, 0, img->block_size);
+    assoofs_img_dir_header(blk)->magic = magic;
+    if (magic == ASSOOFS_DIR_LEAF_MAGIC)
+        assoofs_img_leaf_init(img, blk);
+    *blkp = blk;
+    return 0;
+}
+
+/**
+ * Inicializa un directorio vacio: la raiz del indice y una hoja que cubre
+ * todos los hashes
+ */
+static int assoofs_img_dir_init(struct assoofs_img *img, struct assoofs_inode_info *dir) {
+    uint32_t root_lblk, leaf_lblk;
+    char *root, *leaf;
+    int ret;
+
+    ret = assoofs_img_dir_new_block(img, dir, ASSOOFS_DIR_INDEX_MAGIC, &root_lblk, &root);
+    if (ret)
+        return ret;
+    ret = assoofs_img_dir_new_block(img, dir, ASSOOFS_DIR_LEAF_MAGIC, &leaf_lblk, &leaf);
+    if (ret)
+        return ret;
+
+    assoofs_img_dir_header(root)->count = 1;
+    assoofs_img_dx_entries(root)[0].hash = 0;
+    assoofs_img_dx_entries(root)[0].block = leaf_lblk;
+    return 0;
+}
+
+static uint16_t assoofs_img_dx_search(struct assoofs_dx_entry *entries, uint16_t count, uint32_t hash) {
+    uint16_t lo = 1, hi = count, mid;
+
+    //La primera entrada cubre desde el hash 0
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (entries[mid].hash <= hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/**
+ * Baja por el indice de un directorio hasta la hoja que cubre un hash
+ * @param img imagen
+ * @param dir informacion del directorio
+ * @param hash hash del nombre
+ * @param frames bloques de indice recorridos
+ * @param nframes numero de bloques de indice recorridos
+ * @param leafp hoja
+ * @return 0 si todo sale bien o -EUCLEAN si el indice esta corrupto
+ */
+static int assoofs_img_dx_probe(struct assoofs_img *img, const struct assoofs_inode_info *dir, uint32_t hash,
+                                struct assoofs_img_dx_frame *frames, int *nframes, char **leafp) {
+    struct assoofs_img_dx_frame *frame;
+    uint8_t levels;
+    char *blk;
+    int level;
+
+    *nframes = 0;
+    blk = assoofs_img_dir_block(img, dir, 0);
+    if (!blk)
+        return -EUCLEAN;
+    levels = assoofs_img_dir_header(blk)->levels;
+    if (levels > ASSOOFS_DIR_MAX_LEVELS)
+        return -EUCLEAN;
+
+    for (level = 0;; level++) {
+        if (assoofs_img_dir_header(blk)->magic != ASSOOFS_DIR_INDEX_MAGIC || !assoofs_img_dir_header(blk)->count)
+            return -EUCLEAN;
+        frame = &frames[level];
+        frame->blk = blk;
+        frame->hdr = assoofs_img_dir_header(blk);
+        frame->entries = assoofs_img_dx_entries(blk);
+        frame->pos = assoofs_img_dx_search(frame->entries, frame->hdr->count, hash);
+        *nframes = level + 1;
+
+        blk = assoofs_img_dir_block(img, dir, frame->entries[frame->pos].block);
+        if (!blk)
+            return -EUCLEAN;
+        if (level == levels)
+            break;
+    }
+
+    if (assoofs_img_dir_header(blk)->magic != ASSOOFS_DIR_LEAF_MAGIC || assoofs_img_leaf_check(img, blk))
+        return -EUCLEAN;
+    *leafp = blk;
+    return 0;
+}
+
+static struct assoofs_dir_record_entry *assoofs_img_leaf_find(const struct assoofs_img *img, char *blk, const char *name,
+                                                              unsigned int len) {
+    struct assoofs_dir_record_entry *record = assoofs_img_dir_records(blk);
+    struct assoofs_dir_record_entry *limit = assoofs_img_dir_limit(img, blk);
+
+    for (; record < limit; record = assoofs_img_dir_next(record)) {
+        if (record->inode_no && record->name_len == len && !memcmp(record->filename, name, len))
+            return record;
+    }
+    return NULL;
+}
+
+/**
+ * Añade una entrada a una hoja, en una entrada libre o en el hueco que queda
+ * detras de una ocupada
+ * @return 0 si todo sale bien o -ENOSPC si no cabe en la hoja
+ */
+static int assoofs_img_leaf_insert(const struct assoofs_img *img, char *blk, const char *name, unsigned int len,
+                                   uint64_t inode_no, uint8_t file_type) {
+    struct assoofs_dir_record_entry *record = assoofs_img_dir_records(blk);
+    struct assoofs_dir_record_entry *limit = assoofs_img_dir_limit(img, blk);
+    struct assoofs_dir_record_entry *slot;
+    unsigned int need = ASSOOFS_DIR_REC_LEN(len), used;
+
+    for (; record < limit; record = assoofs_img_dir_next(record)) {
+        if (!record->inode_no) {
+            if (record->rec_len >= need)
+                break;
+            continue;
+        }
+        used = ASSOOFS_DIR_REC_LEN(record->name_len);
+        if (record->rec_len >= used + need) {
+            slot = (struct assoofs_dir_record_entry *)((char *)record + used);
+            slot->rec_len = record->rec_len - used;
+            record->rec_len = used;
+            record = slot;
+            break;
+        }
+    }
+    if (record >= limit)
+        return -ENOSPC;
+
+    record->name_len = len;
+    record->file_type = file_type;
+    record->inode_no = inode_no;
+    memcpy(record->filename, name, len);
+    assoofs_img_dir_header(blk)->count++;
+    return 0;
+}
+
+static int assoofs_img_hash_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Elige el hash por el que partir una hoja llena: el de la mediana, o el mas
+ * cercano a ella que no deje el mismo hash a ambos lados del corte
+ * @return 0 si todo sale bien o -ENOSPC si todas las entradas tienen el mismo hash
+ */
+static int assoofs_img_leaf_split_point(const struct assoofs_img *img, char *blk, uint32_t *split_hash) {
+    struct assoofs_dir_record_entry *record = assoofs_img_dir_records(blk);
+    struct assoofs_dir_record_entry *limit = assoofs_img_dir_limit(img, blk);
+    uint16_t count = assoofs_img_dir_header(blk)->count;
+    uint32_t *hashes;
+    int i, d;
+
+    hashes = malloc(count * sizeof(uint32_t));
+    if (!hashes)
+        return -ENOMEM;
+    for (i = 0; record < limit; record = assoofs_img_dir_next(record)) {
+        if (record->inode_no)
+            hashes[i++] = assoofs_name_hash(record->filename, record->name_len);
+    }
+    qsort(hashes, count, sizeof(uint32_t), assoofs_img_hash_cmp);
+
+    for (d = 0; d < count; d++) {
+        i = count / 2 + ((d & 1) ? -(d + 1) / 2 : d / 2);
+        if (i > 0 && i < count && hashes[i - 1] != hashes[i]) {
+            *split_hash = hashes[i];
+            free(hashes);
+            return 0;
+        }
+    }
+    free(hashes);
+    return -ENOSPC;
+}
+
+/**
+ * Reparte las entradas de una hoja llena entre ella y una hoja nueva: las de
+ * hash mayor o igual que split_hash van a la nueva
+ */
+static void assoofs_img_leaf_move(const struct assoofs_img *img, char *old, char *new, uint32_t split_hash, char *copy) {
+    struct assoofs_dir_record_entry *record, *limit;
+
+    memcpy(copy, old, img->block_size);
+    record = assoofs_img_dir_records(copy);
+    limit = assoofs_img_dir_limit(img, copy);
+
+    memset(assoofs_img_dir_records(old), 0, img->block_size - sizeof(struct assoofs_dir_block_header));
+    assoofs_img_leaf_init(img, old);
+    for (; record < limit; record = assoofs_img_dir_next(record)) {
+        if (!record->inode_no)
+            continue;
+        assoofs_img_leaf_insert(img, assoofs_name_hash(record->filename, record->name_len) >= split_hash ? new : old,
+                                record->filename, record->name_len, record->inode_no, record->file_type);
+    }
+}
+
+static void assoofs_img_dx_insert(struct assoofs_img_dx_frame *frame, uint32_t hash, uint32_t block) {
+    struct assoofs_dx_entry *at = frame->entries + frame->pos + 1;
+
+    memmove(at + 1, at, (frame->hdr->count - frame->pos - 1) * sizeof(*at));
+    at->hash = hash;
+    at->block = block;
+    frame->hdr->count++;
+}
+
+/**
+ * Hace sitio en el ultimo bloque de indice recorrido, como assoofs_dx_grow:
+ * si es la raiz el arbol crece un nivel y si es intermedio se parte en dos
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_img_dx_grow(struct assoofs_img *img, struct assoofs_inode_info *dir,
+                               struct assoofs_img_dx_frame *frames, int *nframes) {
+    struct assoofs_img_dx_frame *root = &frames[0];
+    struct assoofs_img_dx_frame *node = &frames[1];
+    uint32_t lblk, split_hash;
+    uint16_t half;
+    char *blk;
+    int ret;
+
+    if (*nframes == 1) {
+        ret = assoofs_img_dir_new_block(img, dir, ASSOOFS_DIR_INDEX_MAGIC, &lblk, &blk);
+        if (ret)
+            return ret;
+        memcpy(assoofs_img_dx_entries(blk), root->entries, root->hdr->count * sizeof(struct assoofs_dx_entry));
+        assoofs_img_dir_header(blk)->count = root->hdr->count;
+
+        node->blk = blk;
+        node->hdr = assoofs_img_dir_header(blk);
+        node->entries = assoofs_img_dx_entries(blk);
+        node->pos = root->pos;
+
+        root->hdr->levels = 1;
+        root->hdr->count = 1;
+        root->entries[0].hash = 0;
+        root->entries[0].block = lblk;
+        root->pos = 0;
+        *nframes = 2;
+        return 0;
+    }
+
+    if (root->hdr->count >= assoofs_img_dx_capacity(img))
+        return -ENOSPC;
+
+    ret = assoofs_img_dir_new_block(img, dir, ASSOOFS_DIR_INDEX_MAGIC, &lblk, &blk);
+    if (ret)
+        return ret;
+    half = node->hdr->count / 2;
+    split_hash = node->entries[half].hash;
+    memcpy(assoofs_img_dx_entries(blk), node->entries + half, (node->hdr->count - half) * sizeof(struct assoofs_dx_entry));
+    assoofs_img_dir_header(blk)->count = node->hdr->count - half;
+    node->hdr->count = half;
+    assoofs_img_dx_insert(root, split_hash, lblk);
+
+    //Seguimos por la mitad que contiene la posicion recorrida
+    if (node->pos >= half) {
+        node->blk = blk;
+        node->hdr = assoofs_img_dir_header(blk);
+        node->entries = assoofs_img_dx_entries(blk);
+        node->pos -= half;
+        root->pos++;
+    }
+    return 0;
+}
+
+/**
+ * Busca un nombre en un directorio
+ * @param img imagen
+ * @param dir informacion del directorio
+ * @param name nombre
+ * @param inode_no numero de inodo de la entrada
+ * @return 0 si se encuentra, -ENOENT si no esta o un error
+ */
+int assoofs_img_lookup(struct assoofs_img *img, const struct assoofs_inode_info *dir, const char *name,
+                       uint64_t *inode_no) {
+    struct assoofs_img_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    struct assoofs_dir_record_entry *record;
+    unsigned int len = strlen(name);
+    int nframes, ret;
+    char *leaf;
+
+    if (!S_ISDIR(dir->mode))
+        return -ENOTDIR;
+    if (len > ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+    ret = assoofs_img_dx_probe(img, dir, assoofs_name_hash(name, len), frames, &nframes, &leaf);
+    if (ret)
+        return ret;
+    record = assoofs_img_leaf_find(img, leaf, name, len);
+    if (!record)
+        return -ENOENT;
+    *inode_no = record->inode_no;
+    return 0;
+}
+
+/**
+ * Busca el inodo de una ruta absoluta, componente a componente desde la raiz
+ * @param img imagen
+ * @param path ruta
+ * @param inode_no numero de inodo
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_resolve(struct assoofs_img *img, const char *path, uint64_t *inode_no) {
+    struct assoofs_inode_info dir;
+    char name[ASSOOFS_FILENAME_MAXLEN + 1];
+    const char *end;
+    uint64_t ino = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    size_t len;
+    int ret;
+
+    for (;;) {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+        end = strchr(path, '/');
+        len = end ? (size_t)(end - path) : strlen(path);
+        if (len > ASSOOFS_FILENAME_MAXLEN)
+            return -ENAMETOOLONG;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+
+        ret = assoofs_img_read_inode(img, ino, &dir);
+        if (ret)
+            return ret;
+        ret = assoofs_img_lookup(img, &dir, name, &ino);
+        if (ret)
+            return ret;
+    }
+    *inode_no = ino;
+    return 0;
+}
+
+/**
+ * Añade una entrada a un directorio en la hoja que le corresponde por hash,
+ * partiendo la hoja si esta llena, como assoofs_dir_add_entry
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_img_dir_add_entry(struct assoofs_img *img, struct assoofs_inode_info *dir, const char *name,
+                                     uint64_t inode_no, mode_t mode) {
+    struct assoofs_img_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    uint8_t file_type = assoofs_mode_to_ftype(mode);
+    unsigned int len = strlen(name);
+    uint32_t hash, split_hash, lblk;
+    char *leaf, *new_leaf, *copy = NULL;
+    int nframes, ret;
+
+    if (len > ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+    if (inode_no > UINT32_MAX)
+        return -EOVERFLOW;
+
+    hash = assoofs_name_hash(name, len);
+    for (;;) {
+        ret = assoofs_img_dx_probe(img, dir, hash, frames, &nframes, &leaf);
+        if (ret)
+            break;
+        if (assoofs_img_leaf_find(img, leaf, name, len)) {
+            ret = -EEXIST;
+            break;
+        }
+        ret = assoofs_img_leaf_insert(img, leaf, name, len, inode_no, file_type);
+        if (ret != -ENOSPC)
+            break;
+
+        //La hoja esta llena: hacemos sitio en el indice y la partimos en dos
+        ret = assoofs_img_leaf_split_point(img, leaf, &split_hash);
+        if (ret)
+            break;
+        if (!copy) {
+            copy = malloc(img->block_size);
+            if (!copy) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+        while (frames[nframes - 1].hdr->count >= assoofs_img_dx_capacity(img)) {
+            ret = assoofs_img_dx_grow(img, dir, frames, &nframes);
+            if (ret)
+                goto out;
+        }
+        ret = assoofs_img_dir_new_block(img, dir, ASSOOFS_DIR_LEAF_MAGIC, &lblk, &new_leaf);
+        if (ret)
+            break;
+        assoofs_img_leaf_move(img, leaf, new_leaf, split_hash, copy);
+        assoofs_img_dx_insert(&frames[nframes - 1], split_hash, lblk);
+
+        //Con nombres largos la mitad que le toca puede seguir sin sitio y hay que volver a partir
+        ret = assoofs_img_leaf_insert(img, hash >= split_hash ? new_leaf : leaf, name, len, inode_no, file_type);
+        if (ret != -ENOSPC)
+            break;
+    }
+out:
+    free(copy);
+    return ret;
+}
+
+/**
+ * Crea un fichero o, si mode es de directorio, un directorio vacio, y añade
+ * su entrada al directorio padre. Los ficheros empiezan con los datos
+ * dentro del inodo, como en assoofs_create.
+ * @param img imagen
+ * @param dir informacion del directorio padre, que se actualiza y se guarda
+ * @param name nombre de la entrada
+ * @param mode tipo y permisos
+ * @param uid propietario
+ * @param gid grupo
+ * @param info informacion del nuevo inodo
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_create(struct assoofs_img *img, struct assoofs_inode_info *dir, const char *name,
+                       mode_t mode, uint32_t uid, uint32_t gid, struct assoofs_inode_info *info) {
+    uint64_t ino, count;
+    int ret;
+
+    if (!S_ISDIR(dir->mode))
+        return -ENOTDIR;
+    if (img->flags & ASSOOFS_IMG_RDONLY)
+        return -EROFS;
+    if (!S_ISDIR(mode) && !S_ISREG(mode))
+        return -EINVAL;
+    if (strlen(name) > ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+    if (!assoofs_img_lookup(img, dir, name, &ino))
+        return -EEXIST;
+
+    ret = assoofs_img_bitmap_alloc_range(&img->inode_bitmap, UINT64_MAX, 1, &ino, &count);
+    if (ret)
+        return ret;
+
+    memset(info, 0, sizeof(*info));
+    info->inode_no = ino;
+    info->mode = mode;
+    info->uid = uid;
+    info->gid = gid;
+    assoofs_img_now(&info->ctime);
+    info->atime = info->mtime = info->ctime;
+    if (S_ISDIR(mode)) {
+        //Un directorio tiene el enlace de su padre y el suyo propio '.'
+        info->links_count = 2;
+        ret = assoofs_img_dir_init(img, info);
+        if (ret)
+            goto fail;
+    } else {
+        info->links_count = 1;
+        info->flags = ASSOOFS_INODE_INLINE_DATA;
+    }
+
+    ret = assoofs_img_dir_add_entry(img, dir, name, ino, mode);
+    if (ret)
+        goto fail;
+    assoofs_img_write_inode(img, info);
+    img->sb->inodes_count++;
+
+    dir->mtime = dir->ctime = info->ctime;
+    dir->dir_children_count++;
+    if (S_ISDIR(mode))
+        dir->links_count++;
+    assoofs_img_write_inode(img, dir);
+    return 0;
+
+fail:
+    //Los bloques que haya cogido el directorio se quedan, como en el modulo
+    assoofs_img_bitmap_free(&img->inode_bitmap, ino);
+    return ret;
+}
+
+/**
+ * Añade a un directorio una entrada para un inodo que ya existe. Los
+ * ficheros ganan un enlace; el numero de enlaces de un directorio no cambia,
+ * solo el de su nuevo padre.
+ * @param img imagen
+ * @param dir informacion del directorio, que se actualiza y se guarda
+ * @param name nombre de la entrada
+ * @param info informacion del inodo, que se actualiza y se guarda
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_link(struct assoofs_img *img, struct assoofs_inode_info *dir, const char *name,
+                     struct assoofs_inode_info *info) {
+    uint64_t ino;
+    int ret;
+
+    if (!S_ISDIR(dir->mode))
+        return -ENOTDIR;
+    if (img->flags & ASSOOFS_IMG_RDONLY)
+        return -EROFS;
+    if (!assoofs_img_lookup(img, dir, name, &ino))
+        return -EEXIST;
+
+    ret = assoofs_img_dir_add_entry(img, dir, name, info->inode_no, info->mode);
+    if (ret)
+        return ret;
+    assoofs_img_now(&info->ctime);
+    if (!S_ISDIR(info->mode))
+        info->links_count++;
+    assoofs_img_write_inode(img, info);
+
+    dir->mtime = dir->ctime = info->ctime;
+    dir->dir_children_count++;
+    if (S_ISDIR(info->mode))
+        dir->links_count++;
+    assoofs_img_write_inode(img, dir);
+    return 0;
+}
+
+/*
+ * Entrada de una hoja en el orden en que la devuelve readdir
+ */
+struct assoofs_img_dir_pos_entry {
+    uint32_t hash;
+    struct assoofs_dir_record_entry *record;
+};
+
+static int assoofs_img_dir_pos_cmp(const void *a, const void *b) {
+    const struct assoofs_img_dir_pos_entry *x = a, *y = b;
+    unsigned int len = x->record->name_len < y->record->name_len ? x->record->name_len : y->record->name_len;
+    int ret;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    ret = memcmp(x->record->filename, y->record->filename, len);
+    return ret ? ret : (int)x->record->name_len - (int)y->record->name_len;
+}
+
+/**
+ * Recorre las entradas de un directorio desde pos, sin '.' y '..'. Las
+ * posiciones son las mismas que usa assoofs_iterate: el hash de la entrada y
+ * cuantas con el mismo hash van delante, asi que no cambian aunque se partan
+ * o se compacten hojas entre dos llamadas.
+ * @param img imagen
+ * @param dir informacion del directorio
+ * @param pos posicion, 0 para empezar; al volver, donde seguir
+ * @param filldir funcion a la que se pasa cada entrada
+ * @param arg argumento de filldir
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_readdir(struct assoofs_img *img, const struct assoofs_inode_info *dir, uint64_t *pos,
+                        assoofs_filldir_t filldir, void *arg) {
+    struct assoofs_img_dx_frame frames[ASSOOFS_DIR_MAX_LEVELS + 1];
+    struct assoofs_dir_record_entry *record, *limit;
+    struct assoofs_img_dir_pos_entry *ents;
+    uint64_t next, entry_next;
+    uint32_t hash, skip, minor;
+    unsigned int i, n, count;
+    int nframes, level, ret;
+    char *leaf;
+
+    if (!S_ISDIR(dir->mode))
+        return -ENOTDIR;
+    if (*pos < ASSOOFS_DIR_POS(0, 0))
+        *pos = ASSOOFS_DIR_POS(0, 0);
+
+    while (*pos <= ASSOOFS_DIR_POS_LAST) {
+        hash = ASSOOFS_DIR_POS_HASH(*pos);
+        skip = ASSOOFS_DIR_POS_MINOR(*pos);
+        ret = assoofs_img_dx_probe(img, dir, hash, frames, &nframes, &leaf);
+        if (ret)
+            return ret;
+        //La hoja siguiente empieza en el hash de la siguiente entrada del indice, en el nivel mas bajo que la tenga
+        next = ASSOOFS_DIR_EOF;
+        for (level = nframes - 1; level >= 0; level--) {
+            if (frames[level].pos + 1 < frames[level].hdr->count) {
+                next = ASSOOFS_DIR_POS(frames[level].entries[frames[level].pos + 1].hash, 0);
+                break;
+            }
+        }
+
+        count = assoofs_img_dir_header(leaf)->count;
+        ents = malloc((count ? count : 1) * sizeof(*ents));
+        if (!ents)
+            return -ENOMEM;
+        n = 0;
+        limit = assoofs_img_dir_limit(img, leaf);
+        for (record = assoofs_img_dir_records(leaf); record < limit && n < count; record = assoofs_img_dir_next(record)) {
+            if (!record->inode_no)
+                continue;
+            ents[n].hash = assoofs_name_hash(record->filename, record->name_len);
+            ents[n].record = record;
+            if (ents[n].hash >= hash)
+                n++;
+        }
+        qsort(ents, n, sizeof(*ents), assoofs_img_dir_pos_cmp);
+
+        minor = 0;
+        for (i = 0; i < n; i++) {
+            minor = i && ents[i].hash == ents[i - 1].hash ? minor + 1 : 0;
+            if (ents[i].hash == hash && minor < skip)
+                continue;
+            *pos = ASSOOFS_DIR_POS(ents[i].hash, minor);
+            if (i + 1 < n)
+                entry_next = ASSOOFS_DIR_POS(ents[i + 1].hash, ents[i + 1].hash == ents[i].hash ? minor + 1 : 0);
+            else
+                entry_next = next;
+            record = ents[i].record;
+            if (filldir(arg, record->filename, record->name_len, record->inode_no, record->file_type, entry_next)) {
+                free(ents);
+                return 0;
+            }
+        }
+        free(ents);
+        *pos = next;
+    }
+    return 0;
+}
+
+/*
+ *  Datos
+ */
+
+/**
+ * Lee datos de un fichero: de dentro del inodo o de sus tramos, con los
+ * huecos a cero
+ * @param img imagen
+ * @param info informacion del inodo
+ * @param buf destino
+ * @param len numero de bytes
+ * @param off posicion en el fichero
+ * @return bytes leidos o un error
+ */
+ssize_t assoofs_img_read(struct assoofs_img *img, const struct assoofs_inode_info *info, void *buf,
+                         size_t len, uint64_t off) {
+    uint64_t end, iblock, pblock, count, boff;
+    size_t done = 0, n;
+    int ret;
+
+    if (S_ISDIR(info->mode))
+        return -EISDIR;
+    if (off >= info->file_size)
+        return 0;
+    end = off + len > info->file_size ? info->file_size : off + len;
+    if (info->flags & ASSOOFS_INODE_INLINE_DATA) {
+        memcpy(buf, info->inline_data + off, end - off);
+        return end - off;
+    }
+
+    //Copiamos de una vez cada racha de bloques seguidos en disco
+    while (off + done < end) {
+        iblock = (off + done) >> img->blocksize_bits;
+        boff = (off + done) & (img->block_size - 1);
+        ret = assoofs_img_map_blocks(img, info, iblock, ((end - off - done + boff - 1) >> img->blocksize_bits) + 1,
+                                     &pblock, &count);
+        n = (count << img->blocksize_bits) - boff;
+        if (n > end - off - done)
+            n = end - off - done;
+        if (ret == -ENOENT)
+            memset((char *)buf + done, 0, n);
+        else if (pblock + count > img->sb->blocks_count)
+            return -EUCLEAN;
+        else
+            memcpy((char *)buf + done, assoofs_img_block(img, pblock) + boff, n);
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Pasa los datos de un fichero de dentro del inodo a su primer bloque
+ * @return 0 si todo sale bien o un error
+ */
+static int assoofs_img_convert_inline_data(struct assoofs_img *img, struct assoofs_inode_info *info) {
+    char data[ASSOOFS_INLINE_DATA_MAX];
+    uint64_t size = info->file_size, pblock, count;
+    int ret;
+
+    memcpy(data, info->inline_data, sizeof(data));
+    info->flags &= ~ASSOOFS_INODE_INLINE_DATA;
+    memset(info->inline_data, 0, sizeof(info->inline_data));
+    info->extent_count = 0;
+    info->extent_block = 0;
+    if (!size)
+        return 0;
+
+    ret = assoofs_img_alloc_blocks(img, info, 0, 1, &pblock, &count);
+    if (ret) {
+        info->flags |= ASSOOFS_INODE_INLINE_DATA;
+        memcpy(info->inline_data, data, sizeof(data));
+        return ret;
+    }
+    memset(assoofs_img_block(img, pblock), 0, img->block_size);
+    memcpy(assoofs_img_block(img, pblock), data, size);
+    return 0;
+}
+
+/**
+ * Prepara la escritura de len bytes en la posicion off de un fichero que no
+ * tiene los datos dentro del inodo, o que deja de tenerlos: asigna la racha
+ * de bloques que empieza en off si es un hueco, con lo que la escritura no
+ * cubre a cero, y devuelve donde esta en la imagen. El llamante copia ahi
+ * los datos, con memcpy sobre la proyeccion o con pwrite o splice sobre
+ * img->fd, y termina con assoofs_img_write_end.
+ * @param img imagen
+ * @param info informacion del inodo
+ * @param off posicion en el fichero
+ * @param len numero de bytes que quedan por escribir
+ * @param addr desplazamiento en la imagen donde se escribe off
+ * @return bytes seguidos que se pueden escribir en addr, hasta len, o un error
+ */
+ssize_t assoofs_img_write_begin(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t off,
+                                size_t len, uint64_t *addr) {
+    uint64_t iblock, pblock, count, boff, nblocks;
+    size_t n;
+    char *dst;
+    int ret;
+
+    if (S_ISDIR(info->mode))
+        return -EISDIR;
+    if (img->flags & ASSOOFS_IMG_RDONLY)
+        return -EROFS;
+    if (off + len < off || off + len > ASSOOFS_MAX_FILE_BLOCKS << img->blocksize_bits)
+        return -EFBIG;
+    if (info->flags & ASSOOFS_INODE_INLINE_DATA) {
+        ret = assoofs_img_convert_inline_data(img, info);
+        if (ret)
+            return ret;
+    }
+
+    iblock = off >> img->blocksize_bits;
+    boff = off & (img->block_size - 1);
+    nblocks = ((len + boff - 1) >> img->blocksize_bits) + 1;
+    ret = assoofs_img_map_blocks(img, info, iblock, nblocks, &pblock, &count);
+    n = (count << img->blocksize_bits) - boff;
+    if (n > len)
+        n = len;
+    if (ret == -ENOENT) {
+        ret = assoofs_img_alloc_blocks(img, info, iblock, count, &pblock, &count);
+        if (ret)
+            return ret;
+        //Lo que no cubre la escritura en los bloques nuevos queda a cero
+        dst = assoofs_img_block(img, pblock);
+        n = (count << img->blocksize_bits) - boff;
+        if (boff)
+            memset(dst, 0, boff);
+        if (n > len) {
+            memset(dst + boff + len, 0, n - len);
+            n = len;
+        }
+    }
+    *addr = (pblock << img->blocksize_bits) + boff;
+    return n;
+}
+
+/**
+ * Termina una escritura de done bytes en off: actualiza el tamaño y los
+ * tiempos y guarda el inodo
+ * @param img imagen
+ * @param info informacion del inodo
+ * @param off posicion en el fichero
+ * @param done bytes escritos
+ */
+void assoofs_img_write_end(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t off, size_t done) {
+    if (off + done > info->file_size)
+        info->file_size = off + done;
+    assoofs_img_now(&info->mtime);
+    info->ctime = info->mtime;
+    assoofs_img_write_inode(img, info);
+}
+
+/**
+ * Escribe datos en un fichero, asignando bloques seguidos para los huecos.
+ * Los ficheros pequeños se quedan dentro del inodo hasta que crecen por
+ * encima de ASSOOFS_INLINE_DATA_MAX. Guarda el inodo.
+ * @param img imagen
+ * @param info informacion del inodo
+ * @param buf datos
+ * @param len numero de bytes
+ * @param off posicion en el fichero
+ * @return bytes escritos o un error
+ */
+ssize_t assoofs_img_write(struct assoofs_img *img, struct assoofs_inode_info *info, const void *buf,
+                          size_t len, uint64_t off) {
+    uint64_t addr;
+    size_t done = 0;
+    ssize_t n = 0;
+
+    if (S_ISDIR(info->mode))
+        return -EISDIR;
+    if (img->flags & ASSOOFS_IMG_RDONLY)
+        return -EROFS;
+    if (!len)
+        return 0;
+
+    if ((info->flags & ASSOOFS_INODE_INLINE_DATA) && off + len <= ASSOOFS_INLINE_DATA_MAX) {
+        if (off > info->file_size)
+            memset(info->inline_data + info->file_size, 0, off - info->file_size);
+        memcpy(info->inline_data + off, buf, len);
+        done = len;
+    }
+
+    while (done < len) {
+        n = assoofs_img_write_begin(img, info, off + done, len - done, &addr);
+        if (n < 0)
+            break;
+        memcpy(img->map + addr, (const char *)buf + done, n);
+        done += n;
+    }
+    if (!done)
+        return n;
+    assoofs_img_write_end(img, info, off, done);
+    return done;
+}
+
+/**
+ * Libera los bloques de un fichero a partir del bloque logico nblocks y
+ * recorta sus tramos. Si todos los tramos que quedan caben en el inodo se
+ * libera tambien el bloque de tramos adicionales.
+ */
+static void assoofs_img_free_blocks_from(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t nblocks) {
+    struct assoofs_extent *overflow = NULL;
+    struct assoofs_extent *ext;
+    uint64_t keep, n;
+
+    if (info->extent_count > ASSOOFS_INLINE_EXTENTS)
+        overflow = (struct assoofs_extent *)assoofs_img_block(img, info->extent_block);
+
+    //Los tramos estan ordenados, asi que se recortan desde el ultimo
+    while (info->extent_count) {
+        ext = assoofs_img_extent_at(info, overflow, info->extent_count - 1);
+        if ((uint64_t)ext->ee_block + ext->ee_len <= nblocks)
+            break;
+        keep = ext->ee_block < nblocks ? nblocks - ext->ee_block : 0;
+        for (n = keep; n < ext->ee_len; n++)
+            assoofs_img_bitmap_free(&img->block_bitmap, ext->ee_start + n);
+        if (keep) {
+            ext->ee_len = keep;
+            break;
+        }
+        memset(ext, 0, sizeof(*ext));
+        info->extent_count--;
+    }
+
+    if (info->extent_count <= ASSOOFS_INLINE_EXTENTS && info->extent_block) {
+        assoofs_img_bitmap_free(&img->block_bitmap, info->extent_block);
+        info->extent_block = 0;
+    }
+}
+
+/**
+ * Cambia el tamaño de un fichero. Al crecer queda un hueco; al encoger se
+ * liberan los bloques que sobran y se pone a cero el final del ultimo, para
+ * que no reaparezca si el fichero vuelve a crecer. Guarda el inodo.
+ * @param img imagen
+ * @param info informacion del inodo
+ * @param size tamaño nuevo
+ * @return 0 si todo sale bien o un error
+ */
+int assoofs_img_truncate(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t size) {
+    uint64_t pblock, count;
+    int ret;
+
+    if (S_ISDIR(info->mode))
+        return -EISDIR;
+    if (img->flags & ASSOOFS_IMG_RDONLY)
+        return -EROFS;
+    if (size > ASSOOFS_MAX_FILE_BLOCKS << img->blocksize_bits)
+        return -EFBIG;
+
+    if (info->flags & ASSOOFS_INODE_INLINE_DATA) {
+        if (size <= ASSOOFS_INLINE_DATA_MAX) {
+            if (size < info->file_size)
+                memset(info->inline_data + size, 0, info->file_size - size);
+            goto out;
+        }
+        ret = assoofs_img_convert_inline_data(img, info);
+        if (ret)
+            return ret;
+    }
+
+    if (size < info->file_size) {
+        assoofs_img_free_blocks_from(img, info, (size + img->block_size - 1) >> img->blocksize_bits);
+        if ((size & (img->block_size - 1)) &&
+            !assoofs_img_map_blocks(img, info, size >> img->blocksize_bits, 1, &pblock, &count))
+            memset(assoofs_img_block(img, pblock) + (size & (img->block_size - 1)), 0,
+                   img->block_size - (size & (img->block_size - 1)));
+    }
+
+out:
+    info->file_size = size;
+    assoofs_img_now(&info->mtime);
+    info->ctime = info->mtime;
+    assoofs_img_write_inode(img, info);
+    return 0;
+}
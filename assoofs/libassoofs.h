@@ -0,0 +1,96 @@
+#ifndef LIBASSOOFS_H
+#define LIBASSOOFS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "assoofs.h"
+
+/*
+ * libassoofs: la logica del disco de assoofs (superbloque, mapas de bits,
+ * tabla de inodos, tramos, datos dentro del inodo y directorios indexados
+ * por hash) en espacio de usuario, sobre una imagen o un dispositivo
+ * proyectado en memoria con mmap. Sirve para probar y perfilar esa logica
+ * sin cargar el modulo ni ser root.
+ *
+ * Al abrir se reaplica el journal como al montar, pero las modificaciones
+ * se hacen directamente en su sitio, sin journal: la imagen solo queda
+ * consistente despues de assoofs_img_sync o assoofs_img_close. No debe
+ * estar montada a la vez. Con ASSOOFS_IMG_RDONLY la proyeccion es privada y
+ * la imagen no se toca nunca.
+ *
+ * Las funciones devuelven 0 o un errno negativo, como en el modulo. No
+ * cogen cerrojos: las que solo leen se pueden llamar a la vez desde varios
+ * hilos, pero las que modifican la imagen las tiene que serializar el
+ * llamante.
+ */
+#define ASSOOFS_IMG_RDONLY 0x1
+
+struct assoofs_img_bitmap {
+    unsigned char *map;
+    uint64_t nbits;
+    uint64_t nwords;
+    uint64_t hint;
+    uint64_t free;
+};
+
+struct assoofs_img {
+    int fd;
+    int flags;
+    char *map;
+    size_t size;
+    uint64_t block_size;
+    unsigned int blocksize_bits;
+    unsigned int inodes_per_block;
+    struct assoofs_super_block_info *sb;
+    struct assoofs_img_bitmap block_bitmap;
+    struct assoofs_img_bitmap inode_bitmap;
+};
+
+/*
+ * Funcion a la que assoofs_img_readdir pasa cada entrada. next es la
+ * posicion desde la que seguir despues de ella. Si devuelve distinto de 0
+ * el recorrido para y la entrada se vuelve a pasar en la siguiente llamada.
+ */
+typedef int (*assoofs_filldir_t)(void *arg, const char *name, unsigned int len, uint64_t inode_no,
+                                 uint8_t file_type, uint64_t next);
+
+static inline char *assoofs_img_block(const struct assoofs_img *img, uint64_t block) {
+    return img->map + (block << img->blocksize_bits);
+}
+
+int assoofs_img_open(struct assoofs_img *img, const char *path, int flags);
+int assoofs_img_sync(struct assoofs_img *img);
+int assoofs_img_close(struct assoofs_img *img);
+
+void assoofs_img_bitmap_set(struct assoofs_img_bitmap *bm, uint64_t bit, int used);
+
+int assoofs_img_read_inode(struct assoofs_img *img, uint64_t inode_no, struct assoofs_inode_info *info);
+int assoofs_img_write_inode(struct assoofs_img *img, const struct assoofs_inode_info *info);
+
+int assoofs_img_map_blocks(struct assoofs_img *img, const struct assoofs_inode_info *info, uint64_t iblock,
+                           uint64_t max, uint64_t *pblock, uint64_t *count);
+int assoofs_img_alloc_blocks(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t iblock,
+                             uint64_t max, uint64_t *pblock, uint64_t *count);
+
+int assoofs_img_lookup(struct assoofs_img *img, const struct assoofs_inode_info *dir, const char *name,
+                       uint64_t *inode_no);
+int assoofs_img_resolve(struct assoofs_img *img, const char *path, uint64_t *inode_no);
+int assoofs_img_create(struct assoofs_img *img, struct assoofs_inode_info *dir, const char *name,
+                       mode_t mode, uint32_t uid, uint32_t gid, struct assoofs_inode_info *info);
+int assoofs_img_link(struct assoofs_img *img, struct assoofs_inode_info *dir, const char *name,
+                     struct assoofs_inode_info *info);
+int assoofs_img_readdir(struct assoofs_img *img, const struct assoofs_inode_info *dir, uint64_t *pos,
+                        assoofs_filldir_t filldir, void *arg);
+
+ssize_t assoofs_img_read(struct assoofs_img *img, const struct assoofs_inode_info *info, void *buf,
+                         size_t len, uint64_t off);
+ssize_t assoofs_img_write(struct assoofs_img *img, struct assoofs_inode_info *info, const void *buf,
+                          size_t len, uint64_t off);
+ssize_t assoofs_img_write_begin(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t off,
+                                size_t len, uint64_t *addr);
+void assoofs_img_write_end(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t off, size_t done);
+int assoofs_img_truncate(struct assoofs_img *img, struct assoofs_inode_info *info, uint64_t size);
+
+#endif
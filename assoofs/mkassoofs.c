@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -6,155 +7,599 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include "assoofs.h"
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "libassoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
 #define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
 
-static int write_superblock(int fd) {
-    struct assoofs_super_block_info sb = {
-        .version = 1,
-        .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(15),
-    };
-    ssize_t ret;
+/*
+ * Bloques que se reservan al formatear, se calculan a partir del tamaño del
+ * dispositivo porque el mapa de bits crece con el.
+ */
+static uint64_t rootdir_block_number;
+static uint64_t block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+
+/* What -d copied, for the summary at the end */
+static uint64_t copied_files, copied_dirs, copied_bytes;
+
+static int get_device_blocks(int fd, uint64_t *blocks) {
+    struct stat st;
+    uint64_t size;
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading the device size");
         return -1;
     }
 
-    printf("Super block written succesfully.\n");
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1) {
+        perror("Error reading the device size");
+        return -1;
+    }
+
+    *blocks = size / block_size;
     return 0;
 }
 
-static int write_root_inode(int fd) {
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off) {
     ssize_t ret;
 
-    struct assoofs_inode_info root_inode;
+    while (len > 0) {
+        ret = pwrite(fd, buf, len, off);
+        if (ret <= 0)
+            return -1;
+        buf += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+/*
+ * Zeroes len bytes at off: the block device or the filesystem holding the
+ * image zeroes them itself if it can, otherwise they are written with large
+ * pwrites.
+ */
+#define ZERO_BUFFER_SIZE (1 << 20)
+
+static int zero_range(int fd, off_t off, uint64_t len) {
+    uint64_t range[2] = { off, len };
+    struct stat st;
+    size_t chunk;
+    char *buf;
+    int ret = 0;
+
+    if (!len)
+        return 0;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKZEROOUT, range) == 0)
+        return 0;
+    if (S_ISREG(st.st_mode) && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+        return 0;
+
+    buf = calloc(1, ZERO_BUFFER_SIZE);
+    if (!buf)
+        return -1;
+    while (len > 0 && !ret) {
+        chunk = len < ZERO_BUFFER_SIZE ? len : ZERO_BUFFER_SIZE;
+        ret = pwrite_full(fd, buf, chunk, off);
+        off += chunk;
+        len -= chunk;
+    }
+    free(buf);
+    return ret;
+}
+
+static void fill_bitmap(unsigned char *map, uint64_t nblocks, uint64_t nbits, uint64_t used) {
+    uint64_t bit, total = nblocks * block_size * 8;
+
+    /* The first "used" objects are taken, and the bits past the end of the
+     * bitmap must never be handed out. */
+    memset(map, 0, nblocks * block_size);
+    for (bit = 0; bit < total; bit++) {
+        if (bit < used || bit >= nbits)
+            map[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static void fill_root_inode(struct assoofs_inode_info *root_inode, uint64_t children) {
+    memset(root_inode, 0, sizeof(*root_inode));
+    root_inode->mode = S_IFDIR | 0755;
+    root_inode->inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    root_inode->links_count = 2;
+    root_inode->atime.sec = root_inode->mtime.sec = root_inode->ctime.sec = time(NULL);
+    root_inode->extent_count = 1;
+    root_inode->extents[0].ee_block = 0;
+    root_inode->extents[0].ee_len = 2;
+    root_inode->extents[0].ee_start = rootdir_block_number;
+    root_inode->file_size = 2 * block_size;
+    root_inode->dir_children_count = children;
+}
+
+/*
+ * The superblock, both bitmaps and the first block of the inode table are
+ * contiguous, so they are built in memory and written with a single pwrite.
+ * The rest of the inode table is zeroed, since free slots must have version
+ * 0 and a previous filesystem may have left records there.
+ */
+static int write_metadata(int fd, const struct assoofs_super_block_info *sb, const struct assoofs_inode_info *welcome) {
+    struct assoofs_disk_inode *table;
+    struct assoofs_inode_info root;
+    size_t len = (sb->inode_table_block + 1) * block_size;
+    char *buf;
+    int ret;
+
+    buf = calloc(1, len);
+    if (!buf) {
+        printf("Not enough memory for the metadata.\n");
+        return -1;
+    }
 
-    root_inode.mode = S_IFDIR;
-    root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
-    root_inode.dir_children_count = 1;
+    /* Only the fields matter, the padding may not fit in a small block */
+    memcpy(buf, sb, sizeof(*sb) < block_size ? sizeof(*sb) : block_size);
+    fill_bitmap((unsigned char *)buf + ASSOOFS_BITMAP_BLOCK_NUMBER * block_size, sb->bitmap_blocks,
+                sb->blocks_count, rootdir_block_number + 2);
+    fill_bitmap((unsigned char *)buf + sb->inode_bitmap_block * block_size, sb->inode_bitmap_blocks,
+                sb->inodes_total, sb->inodes_count + 1);
 
-    ret = write(fd, &root_inode, sizeof(root_inode));
+    /* Inode number N lives at slot N of the table; all used inodes fit in
+     * the first block. */
+    table = (struct assoofs_disk_inode *)(buf + sb->inode_table_block * block_size);
+    fill_root_inode(&root, welcome ? 1 : 0);
+    assoofs_inode_to_disk(&root, &table[ASSOOFS_ROOTDIR_INODE_NUMBER]);
+    if (welcome)
+        assoofs_inode_to_disk(welcome, &table[WELCOMEFILE_INODE_NUMBER]);
 
-    if (ret != sizeof(root_inode)) {
-        printf("The inode store was not written properly.\n");
+    ret = pwrite_full(fd, buf, len, 0);
+    free(buf);
+    if (ret) {
+        perror("Error writing the metadata");
+        return -1;
+    }
+    if (zero_range(fd, len, (sb->inode_table_blocks - 1) * block_size)) {
+        perror("Error clearing the inode table");
         return -1;
     }
 
-    printf("root directory inode written succesfully.\n");
+    printf("Super block written succesfully.\n");
+    printf("Bitmaps (%llu + %llu blocks) written succesfully.\n", (unsigned long long)sb->bitmap_blocks,
+           (unsigned long long)sb->inode_bitmap_blocks);
+    printf("Inode table (%llu blocks, %llu inodes) written succesfully.\n", (unsigned long long)sb->inode_table_blocks,
+           (unsigned long long)sb->inodes_total);
     return 0;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
-    off_t nbytes;
-    ssize_t ret;
+static int write_journal(int fd, const struct assoofs_super_block_info *sb) {
+    size_t len = sb->journal_blocks * block_size;
+    struct assoofs_journal_super_block *jsb;
+    char *buf;
+    int ret;
 
-    ret = write(fd, i, sizeof(*i));
-    if (ret != sizeof(*i)) {
-        printf("The welcomefile inode was not written properly.\n");
+    /* An empty journal: the first transaction goes right after the journal
+     * superblock, and stale blocks from a previous filesystem are zeroed so
+     * they can never be replayed. */
+    buf = calloc(1, len);
+    if (!buf) {
+        printf("Not enough memory for the journal.\n");
         return -1;
     }
-    printf("welcomefile inode written succesfully.\n");
+    jsb = (struct assoofs_journal_super_block *)buf;
+    jsb->header.magic = ASSOOFS_JOURNAL_MAGIC;
+    jsb->header.type = ASSOOFS_JOURNAL_SUPERBLOCK;
+    jsb->header.sequence = 1;
+    jsb->start = 0;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
+    ret = pwrite_full(fd, buf, len, sb->journal_block * block_size);
+    free(buf);
+    if (ret) {
+        perror("Writing the journal has failed");
         return -1;
     }
 
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
+    printf("Journal (%llu blocks) written succesfully.\n", (unsigned long long)sb->journal_blocks);
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
-    ssize_t nbytes = sizeof(*record), ret;
+/*
+ * Writes the root directory: the index block and one leaf holding name, or
+ * an empty leaf if name is NULL
+ */
+static int write_rootdir(int fd, const char *name, uint32_t inode_no, uint8_t file_type) {
+    char *buf = calloc(2, block_size);
+    struct assoofs_dir_block_header *hdr = (struct assoofs_dir_block_header *)buf;
+    struct assoofs_dx_entry *root = (struct assoofs_dx_entry *)(hdr + 1);
+    struct assoofs_dir_block_header *leaf = (struct assoofs_dir_block_header *)(buf + block_size);
+    struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)(leaf + 1);
+    int ret;
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes) {
-        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
+    if (!buf) {
+        printf("Not enough memory for the root directory.\n");
         return -1;
     }
-    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
+    /* Index root: a single entry that sends every hash to the leaf in logical block 1 */
+    hdr->magic = ASSOOFS_DIR_INDEX_MAGIC;
+    hdr->count = 1;
+    root[0].hash = 0;
+    root[0].block = 1;
+
+    /* The only entry spans the whole leaf, leaving its tail free for new
+     * entries; an empty leaf keeps it with no name */
+    leaf->magic = ASSOOFS_DIR_LEAF_MAGIC;
+    record->rec_len = block_size - sizeof(*leaf);
+    if (name) {
+        leaf->count = 1;
+        record->name_len = strlen(name);
+        record->file_type = file_type;
+        record->inode_no = inode_no;
+        memcpy(record->filename, name, record->name_len);
+    }
+
+    ret = pwrite_full(fd, buf, 2 * block_size, rootdir_block_number * block_size);
+    free(buf);
+    if (ret) {
+        perror("Writing the root directory has failed");
         return -1;
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
+    printf("root directory blocks written succesfully.\n");
     return 0;
 }
 
-int write_block(int fd, char *block, size_t len) {
+/*
+ * Population from a source directory (-d). The freshly formatted image is
+ * opened with libassoofs, which maps it and allocates blocks front to back,
+ * so walking the tree in sorted order lays every file out contiguously and
+ * in directory order. Metadata goes through the mapping, but file data is
+ * copied with large pwrites on the image descriptor, one contiguous run at a
+ * time: faulting in every page of the mapping is several times slower.
+ */
+#define COPY_BUFFER_SIZE (8 << 20)
+
+static char *copy_buffer;
+
+static ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t done = 0;
     ssize_t ret;
 
-    ret = write(fd, block, len);
-    if (ret != len) {
-        printf("Writing file body has failed.\n");
+    while (done < len) {
+        ret = read(fd, buf + done, len - done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            return -errno;
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    return done;
+}
+
+/* Modification times are kept; ctime is set to mtime as well so that the
+ * same tree always produces the same image */
+static void copy_times(struct assoofs_inode_info *info, const struct stat *st) {
+    info->atime.sec = st->st_atim.tv_sec;
+    info->atime.nsec = st->st_atim.tv_nsec;
+    info->mtime.sec = st->st_mtim.tv_sec;
+    info->mtime.nsec = st->st_mtim.tv_nsec;
+    info->ctime = info->mtime;
+}
+
+static int copy_file(struct assoofs_img *img, struct assoofs_inode_info *info, const char *path, const struct stat *st) {
+    char small[ASSOOFS_INLINE_DATA_MAX];
+    uint64_t off = 0, addr;
+    size_t run, len;
+    ssize_t n, got;
+    int fd, ret = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* Small files stay inside their inode */
+    if (st->st_size <= ASSOOFS_INLINE_DATA_MAX) {
+        got = read_full(fd, small, st->st_size);
+        if (got > 0)
+            got = assoofs_img_write(img, info, small, got, 0);
+        ret = got < 0 ? got : 0;
+        off = got < 0 ? 0 : got;
+        goto out;
+    }
+
+    while (off < (uint64_t)st->st_size) {
+        n = assoofs_img_write_begin(img, info, off, st->st_size - off, &addr);
+        if (n < 0) {
+            ret = n;
+            break;
+        }
+        for (run = 0; run < (size_t)n; run += got) {
+            len = n - run < COPY_BUFFER_SIZE ? n - run : COPY_BUFFER_SIZE;
+            got = read_full(fd, copy_buffer, len);
+            if (got > 0 && pwrite_full(img->fd, copy_buffer, got, addr + run))
+                got = -errno;
+            if (got < 0) {
+                ret = got;
+                break;
+            }
+            /* The file shrank while it was being copied */
+            if ((size_t)got < len) {
+                run += got;
+                break;
+            }
+        }
+        if (run > 0)
+            assoofs_img_write_end(img, info, off, run);
+        off += run;
+        if (ret || run < (size_t)n)
+            break;
+    }
+    /* Give back whatever was allocated past the data actually copied */
+    if (ret || off < (uint64_t)st->st_size)
+        assoofs_img_truncate(img, info, off);
+out:
+    close(fd);
+    copied_bytes += off;
+    return ret;
+}
+
+static int skip_dots(const struct dirent *d) {
+    return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
+}
+
+static int copy_dir(struct assoofs_img *img, struct assoofs_inode_info *dir, const char *path) {
+    struct assoofs_inode_info info;
+    struct dirent **names;
+    struct stat st;
+    char *child;
+    int i, n, ret = 0;
+
+    n = scandir(path, &names, skip_dots, alphasort);
+    if (n == -1) {
+        ret = -errno;
+        fprintf(stderr, "Error reading %s: %s\n", path, strerror(-ret));
+        return ret;
+    }
+
+    for (i = 0; i < n && !ret; i++) {
+        child = malloc(strlen(path) + strlen(names[i]->d_name) + 2);
+        if (!child) {
+            ret = -ENOMEM;
+            break;
+        }
+        sprintf(child, "%s/%s", path, names[i]->d_name);
+
+        if (lstat(child, &st) == -1) {
+            ret = -errno;
+        } else if (S_ISDIR(st.st_mode)) {
+            ret = assoofs_img_create(img, dir, names[i]->d_name, S_IFDIR | (st.st_mode & 07777), st.st_uid,
+                                     st.st_gid, &info);
+            if (!ret)
+                ret = copy_dir(img, &info, child);
+            copied_dirs++;
+        } else if (S_ISREG(st.st_mode)) {
+            ret = assoofs_img_create(img, dir, names[i]->d_name, S_IFREG | (st.st_mode & 07777), st.st_uid,
+                                     st.st_gid, &info);
+            if (!ret)
+                ret = copy_file(img, &info, child, &st);
+            copied_files++;
+        } else {
+            fprintf(stderr, "Skipping %s: only regular files and directories are supported.\n", child);
+            free(child);
+            continue;
+        }
+
+        if (!ret) {
+            copy_times(&info, &st);
+            ret = assoofs_img_write_inode(img, &info);
+        }
+        if (ret == -ECANCELED)
+            ;
+        else if (ret && ret != -ENOSPC)
+            fprintf(stderr, "Error copying %s: %s\n", child, strerror(-ret));
+        else if (ret)
+            fprintf(stderr, "Error copying %s: not enough blocks or inodes, try a bigger device or -N.\n", child);
+        free(child);
+    }
+
+    for (i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+    /* A failure deep down has already been reported */
+    return ret ? -ECANCELED : 0;
+}
+
+static int populate(const char *device, const char *srcdir) {
+    struct assoofs_inode_info root;
+    struct assoofs_img img;
+    struct stat st;
+    int ret;
+
+    if (stat(srcdir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s is not a directory.\n", srcdir);
+        return -1;
+    }
+
+    copy_buffer = malloc(COPY_BUFFER_SIZE);
+    if (!copy_buffer) {
+        printf("Not enough memory for the copy buffer.\n");
+        return -1;
+    }
+
+    ret = assoofs_img_open(&img, device, 0);
+    if (ret) {
+        fprintf(stderr, "Error opening the new filesystem: %s\n", strerror(-ret));
+        free(copy_buffer);
         return -1;
     }
-    printf("block has been written succesfully.\n");
+
+    ret = assoofs_img_read_inode(&img, ASSOOFS_ROOTDIR_INODE_NUMBER, &root);
+    if (!ret)
+        ret = copy_dir(&img, &root, srcdir);
+    if (!ret) {
+        copy_times(&root, &st);
+        root.mode = S_IFDIR | (st.st_mode & 07777);
+        root.uid = st.st_uid;
+        root.gid = st.st_gid;
+        ret = assoofs_img_write_inode(&img, &root);
+    }
+
+    free(copy_buffer);
+    if (assoofs_img_close(&img) && !ret) {
+        perror("Error writing back the filesystem");
+        return -1;
+    }
+    if (ret)
+        return -1;
+
+    printf("%llu files and %llu directories (%llu bytes) copied from %s.\n", (unsigned long long)copied_files,
+           (unsigned long long)copied_dirs, (unsigned long long)copied_bytes, srcdir);
     return 0;
 }
 
+static void usage(void) {
+    printf("Usage: mkassoofs [-b block_size] [-N inodes] [-d srcdir] <device>\n");
+    printf("  -b  block size in bytes, a power of two between %d and %d (default: %d)\n", ASSOOFS_MIN_BLOCK_SIZE,
+           ASSOOFS_MAX_BLOCK_SIZE, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    printf("  -N  number of inodes (default: one every four blocks)\n");
+    printf("  -d  copy the files and directories under srcdir into the new filesystem\n");
+}
+
 int main(int argc, char *argv[])
 {
-    int fd;
+    int fd, opt;
     ssize_t ret;
+    uint64_t inodes_per_block, inodes = 0;
+    const char *srcdir = NULL;
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
-    
+
+    struct assoofs_super_block_info sb = {
+        .version = 1,
+        .magic = ASSOOFS_MAGIC,
+        .inodes_count = WELCOMEFILE_INODE_NUMBER,
+    };
+
+    /* The welcome file is small enough to live inside its inode */
     struct assoofs_inode_info welcome = {
-        .mode = S_IFREG,
+        .mode = S_IFREG | 0644,
         .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
+        .links_count = 1,
+        .flags = ASSOOFS_INODE_INLINE_DATA,
         .file_size = sizeof(welcomefile_body),
     };
-    
-    struct assoofs_dir_record_entry record = {
-        .filename = "README.txt",
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
-    };
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    while ((opt = getopt(argc, argv, "b:N:d:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'N':
+            inodes = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            srcdir = optarg;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
+        return -1;
+    }
+
+    if (block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1))) {
+        printf("Invalid block size %llu.\n", (unsigned long long)block_size);
         return -1;
     }
+    /* Buffer heads cannot be bigger than a page */
+    if (block_size > (uint64_t)sysconf(_SC_PAGESIZE))
+        printf("Note: the kernel module only mounts blocks up to the page size (%ld bytes), "
+               "use assoofs-fuse for this image.\n", sysconf(_SC_PAGESIZE));
+    sb.block_size = block_size;
 
-    fd = open(argv[1], O_RDWR);
+    /* With -d the tree replaces the welcome file */
+    if (srcdir)
+        sb.inodes_count = ASSOOFS_ROOTDIR_INODE_NUMBER;
+
+    fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("Error opening the device");
         return -1;
     }
 
+    if (get_device_blocks(fd, &sb.blocks_count)) {
+        close(fd);
+        return -1;
+    }
+
+    /* One inode every four blocks unless -N says otherwise, rounded up to
+     * whole inode table blocks */
+    inodes_per_block = block_size / sizeof(struct assoofs_disk_inode);
+    if (!inodes)
+        inodes = sb.blocks_count / 4;
+    if (inodes <= sb.inodes_count || inodes > UINT32_MAX) {
+        printf("Invalid number of inodes %llu.\n", (unsigned long long)inodes);
+        close(fd);
+        return -1;
+    }
+    sb.inode_table_blocks = (inodes + inodes_per_block - 1) / inodes_per_block;
+    sb.inodes_total = sb.inode_table_blocks * inodes_per_block;
+
+    sb.bitmap_blocks = (sb.blocks_count + block_size * 8 - 1) / (block_size * 8);
+    sb.inode_bitmap_block = ASSOOFS_BITMAP_BLOCK_NUMBER + sb.bitmap_blocks;
+    sb.inode_bitmap_blocks = (sb.inodes_total + block_size * 8 - 1) / (block_size * 8);
+    sb.inode_table_block = sb.inode_bitmap_block + sb.inode_bitmap_blocks;
+
+    /* The metadata journal takes 1/16 of the device, between the minimum the
+     * kernel accepts and the default size */
+    sb.journal_blocks = sb.blocks_count / 16;
+    if (sb.journal_blocks > ASSOOFS_JOURNAL_DEFAULT_BLOCKS)
+        sb.journal_blocks = ASSOOFS_JOURNAL_DEFAULT_BLOCKS;
+    if (sb.journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS)
+        sb.journal_blocks = ASSOOFS_JOURNAL_MIN_BLOCKS;
+    sb.journal_block = sb.inode_table_block + sb.inode_table_blocks;
+    rootdir_block_number = sb.journal_block + sb.journal_blocks;
+    memcpy(welcome.inline_data, welcomefile_body, sizeof(welcomefile_body));
+    welcome.atime.sec = welcome.mtime.sec = welcome.ctime.sec = time(NULL);
+
+    if (sb.blocks_count <= rootdir_block_number + 2) {
+        printf("The device is too small (%llu blocks).\n", (unsigned long long)sb.blocks_count);
+        close(fd);
+        return -1;
+    }
+
+    /* Everything up to the root directory blocks and inode is in use */
+    sb.free_blocks = sb.blocks_count - (rootdir_block_number + 2);
+    sb.free_inodes = sb.inodes_total - (sb.inodes_count + 1);
+
     ret = 1;
     do {
-        if (write_superblock(fd))
+        if (write_metadata(fd, &sb, srcdir ? NULL : &welcome))
             break;
 
-        if (write_root_inode(fd))
-            break;
-        
-        if (write_welcome_inode(fd, &welcome))
+        if (write_journal(fd, &sb))
             break;
 
-        if (write_dirent(fd, &record))
-            break;
-        
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+        if (srcdir)
+            ret = write_rootdir(fd, NULL, 0, 0);
+        else
+            ret = write_rootdir(fd, "README.txt", WELCOMEFILE_INODE_NUMBER, ASSOOFS_FT_REG_FILE);
+        if (ret)
             break;
 
         ret = 0;
     } while (0);
 
     close(fd);
+    if (!ret && srcdir)
+        ret = populate(argv[optind], srcdir);
     return ret;
 }